@@ -0,0 +1,114 @@
+// Micro-benchmarks for Table against the std::map it replaced. Built only
+// with -DCLOX_BENCHMARKS=ON, run as `table_bench [key count]`.
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "obj_string.h"
+#include "table.h"
+
+using namespace Clox;
+
+namespace {
+
+using MapTable = std::map<ObjString*, Value>;
+using Clock = std::chrono::steady_clock;
+
+constexpr auto ROUNDS = 20;
+
+std::vector<std::unique_ptr<ObjString>> make_keys(size_t count, std::string_view prefix)
+{
+	std::vector<std::unique_ptr<ObjString>> keys;
+	for (size_t i = 0; i < count; i++)
+	{
+		auto key = std::make_unique<ObjString>();
+		key->content = std::string(prefix) + std::to_string(i);
+		key->hash = hash_string(key->content);
+		keys.push_back(std::move(key));
+	}
+	return keys;
+}
+
+template<typename F>
+void measure(std::string_view name, size_t ops, F&& f)
+{
+	auto best = Clock::duration::max();
+	for (auto round = 0; round < ROUNDS; round++)
+	{
+		auto start = Clock::now();
+		f();
+		best = std::min(best, Clock::now() - start);
+	}
+	auto ns = std::chrono::duration<double, std::nano>(best).count();
+	std::cout << name << "\t" << ns / ops << " ns/op\n";
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	size_t count = argc > 1 ? std::stoul(argv[1]) : 1000;
+	auto keys = make_keys(count, "key");
+	auto missing = make_keys(count, "missing");
+	double sink = 0;
+
+	Table table;
+	MapTable map;
+	for (auto& key : keys)
+	{
+		table.set(key.get(), Value(1.0));
+		map.insert_or_assign(key.get(), Value(1.0));
+	}
+
+	measure("table insert", count, [&]
+		{
+			Table fresh;
+			for (auto& key : keys)
+				fresh.set(key.get(), Value(1.0));
+		});
+	measure("map insert", count, [&]
+		{
+			MapTable fresh;
+			for (auto& key : keys)
+				fresh.insert_or_assign(key.get(), Value(1.0));
+		});
+
+	measure("table lookup", count, [&]
+		{
+			for (auto& key : keys)
+				sink += table.find(key.get())->as<double>();
+		});
+	measure("map lookup", count, [&]
+		{
+			for (auto& key : keys)
+				sink += map.find(key.get())->second.as<double>();
+		});
+
+	measure("table miss", count, [&]
+		{
+			for (auto& key : missing)
+				sink += table.find(key.get()) == nullptr;
+		});
+	measure("map miss", count, [&]
+		{
+			for (auto& key : missing)
+				sink += map.find(key.get()) == map.end();
+		});
+
+	measure("table iterate", count, [&]
+		{
+			table.for_each([&](ObjString*, const Value& value) { sink += value.as<double>(); });
+		});
+	measure("map iterate", count, [&]
+		{
+			for (auto& [key, value] : map)
+				sink += value.as<double>();
+		});
+
+	std::cerr << sink << "\n";
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+
+namespace Clox {
+
+struct GC;
+
+struct AllocBase
+{
+protected:
+	inline static GC* gc = nullptr;
+	// what this thread allocated while it compiles alongside others, see
+	// Compilation::compile_parallel(); set, it never collects
+	inline static thread_local size_t* detached = nullptr;
+
+public:
+	static void init(GC* value)noexcept
+	{
+		if (gc == nullptr && value != nullptr)
+			gc = value;
+	}
+
+	// counts this thread's allocations into bytes rather than gc until
+	// called with nullptr, leaving the caller to add them to gc
+	static void detach(size_t* bytes)noexcept
+	{
+		detached = bytes;
+	}
+};
+
+template<typename T>
+struct Allocator final :public AllocBase
+{
+	static_assert(!std::is_const_v<T>);
+
+	using value_type = T;
+
+	inline static std::allocator<T> worker = {};
+	using worker_traits = std::allocator_traits<decltype(worker)>;
+
+	constexpr Allocator()noexcept {}
+	constexpr Allocator(const Allocator&)noexcept = default;
+	template<typename U>
+	constexpr Allocator(const Allocator<U>&) noexcept {}
+
+	[[nodiscard]] constexpr T* allocate(std::size_t n);
+	constexpr void deallocate(T* p, std::size_t n)noexcept;
+};
+
+template<typename T, typename U>
+[[nodiscard]] bool operator==(const Allocator<T>& t, const Allocator<U>& u)noexcept
+{
+	return true;
+}
+
+template<typename T, typename U>
+[[nodiscard]] bool operator!=(const Allocator<T>& t, const Allocator<U>& u)noexcept
+{
+	return false;
+}
+
+} //Clox
\ No newline at end of file
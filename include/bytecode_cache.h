@@ -0,0 +1,27 @@
+#pragma once
+
+#include <filesystem>
+#include <string_view>
+
+namespace Clox {
+
+struct ObjFunction;
+struct VM;
+
+// The compiled script a source file was last run as, kept next to it in a
+// .loxc file and keyed by a hash of the source. Functions are stored before
+// superinstruction fusion and register lowering, which loading redoes under
+// the running VM's options, and refer to globals by name so that a VM hands
+// out the slots they were compiled against.
+
+[[nodiscard]] std::filesystem::path cache_path(const std::filesystem::path& source_path);
+
+// nullptr when there is no cache for this source, or it does not load and verify
+[[nodiscard]] ObjFunction* load_cache(VM& vm, const std::filesystem::path& path,
+	std::string_view source);
+
+// best effort, a cache that cannot be written is simply missing next time
+void save_cache(const VM& vm, const std::filesystem::path& path, std::string_view source,
+	const ObjFunction& script);
+
+} // Clox
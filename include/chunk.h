@@ -4,6 +4,8 @@
 #include <string_view>
 #include <vector>
 
+#include "inline_cache.h"
+#include "line_table.h"
 #include "memory.h"
 #include "value.h"
 
@@ -49,9 +51,102 @@ enum class OpCode :uint8_t
 	Return,
 	Class,
 	Inherit,
-	Method
+	Method,
+	// Call and Invoke ending a return statement, they hand the frame of the
+	// returning function over to the callee
+	TailCall,
+	TailInvoke,
+	// a local function the compiler proved is only ever called by name from
+	// the frame declaring it: that frame sits right below the function's own,
+	// so it reads and writes the declarer's locals there, and its closure is
+	// made once rather than on every declaration when it captures nothing
+	GetEnclosing,
+	SetEnclosing,
+	FrameClosure,
+	// keeps the value on top and drops the operand's count of values below
+	// it, where the code of a function copied into its caller returns
+	PopUnder,
+	// long forms, emitted where a constant index or global slot does not fit
+	// the operand of the instruction above; it takes three bytes here
+	ConstantLong,
+	GetGlobalLong,
+	DefineGlobalLong,
+	SetGlobalLong,
+	GetPropertyLong,
+	SetPropertyLong,
+	GetSuperLong,
+	InvokeLong,
+	SuperInvokeLong,
+	ClosureLong,
+	ClassLong,
+	MethodLong,
+	FrameClosureLong,
+	// quickened forms, never emitted by the compiler; VM::run rewrites the
+	// generic instruction above into one of these after executing it
+	AddNumber,
+	AddString,
+	SubtractNumber,
+	MultiplyNumber,
+	DivideNumber,
+	GreaterNumber,
+	LessNumber,
+	NegateNumber,
+	// unchecked forms, emitted by optimize() where it proved every operand a
+	// number; they neither check their operands nor rewrite themselves
+	AddUnchecked,
+	SubtractUnchecked,
+	MultiplyUnchecked,
+	DivideUnchecked,
+	GreaterUnchecked,
+	LessUnchecked,
+	NegateUnchecked,
+	// Superinstructions, written over the first instruction of the sequence
+	// they stand for by fuse_superinstructions(). The rest of the sequence
+	// is left in place, so jumps into it and walkers stepping through it by
+	// instruction_length() still find ordinary instructions there.
+	GetLocalGetLocal,
+	GetLocalConstant,
+	GetLocalGetProperty,
+	SetLocalPop,
+	PopLoop,
+	JumpIfFalsePop,
+	LessJumpIfFalsePop,
+	// three-address forms, only found in a RegisterChunk. Operands name
+	// registers, that is frame slots, with the destination first
+	RegMove,
+	RegConstant,
+	RegNil,
+	RegTrue,
+	RegFalse,
+	RegGetGlobal,
+	RegDefineGlobal,
+	RegSetGlobal,
+	RegGetUpvalue,
+	RegSetUpvalue,
+	RegEqual,
+	RegGreater,
+	RegLess,
+	RegAdd,
+	RegSubtract,
+	RegMultiply,
+	RegDivide,
+	RegNot,
+	RegNegate,
+	RegPrint,
+	RegJump,
+	RegJumpIfFalse,
+	RegLoop,
+	RegCall,
+	RegTailCall,
+	RegClosure,
+	RegCloseUpvalue,
+	RegReturn
 };
 
+constexpr auto OPCODE_COUNT = static_cast<size_t>(OpCode::RegReturn) + 1;
+// largest constant index or global slot, the reach of a long operand
+constexpr size_t LONG_OPERAND_MAX = (1 << 24) - 1;
+
 std::string_view nameof(OpCode code);
 std::ostream& operator<<(std::ostream& out, OpCode code);
 
@@ -72,11 +167,18 @@ template<template<typename>typename Alloc = Allocator>
 struct ChunkT
 {
 	std::vector<uint8_t, Alloc<uint8_t>> code;
-	std::vector<size_t, Alloc<size_t>> lines;
+	LineTable<Alloc> lines;
 	ValueArray<Alloc> constants;
+	std::vector<InlineCache, Alloc<InlineCache>> caches;
 
 	[[nodiscard]] constexpr size_t count()const noexcept { return code.size(); }
 
+	[[nodiscard]] size_t add_cache(size_t offset)
+	{
+		caches.emplace_back(offset);
+		return caches.size() - 1;
+	}
+
 	template<typename T>
 	[[nodiscard]] typename std::enable_if_t<std::is_convertible_v<T, Value>, size_t>
 		add_constant(T&& value)
@@ -90,7 +192,7 @@ struct ChunkT
 		write(T byte, size_t line)
 	{
 		code.push_back(static_cast<uint8_t>(byte));
-		lines.push_back(line);
+		lines.add(code.size() - 1, line);
 	}
 };
 
@@ -100,4 +202,34 @@ struct Chunk final :public ChunkT<>
 {
 };
 
+// the long form of an instruction taking a constant index or global slot
+[[nodiscard]] OpCode long_form(OpCode op)noexcept;
+
+// the first instruction of the sequence a superinstruction stands for, else op itself
+[[nodiscard]] OpCode unfused(OpCode op)noexcept;
+
+// the generic instruction an unchecked one does the work of, else op itself
+[[nodiscard]] OpCode checked(OpCode op)noexcept;
+
+// bytes taken by the stack instruction at offset, operands included; for a
+// superinstruction those of the first instruction it stands for
+[[nodiscard]] size_t instruction_length(const Chunk& chunk, size_t offset);
+
+// values the stack instruction at offset leaves on the stack less those it
+// takes, superinstructions counting as the first instruction they stand for
+[[nodiscard]] int stack_effect(const Chunk& chunk, size_t offset);
+
+// Stack depth before each byte of the first end bytes of code, counting the
+// depth slots the frame starts with; -1 where no instruction begins or none
+// is reached. Control is taken to reach an instruction only as the compiler
+// lays code out: from the instruction before it, by a jump from earlier that
+// was already patched, or by a Loop, each arriving at the same depth.
+[[nodiscard]] std::vector<int> stack_depths(const Chunk& chunk, size_t end, int depth);
+// the deepest stack_depths() finds anywhere in the chunk
+[[nodiscard]] size_t max_stack_depth(const Chunk& chunk, int depth);
+
+// Replaces the opcode sequences VM::run spends most dispatches on, going by
+// the DEBUG_PROFILE_OPCODES profile of the bench scripts, with superinstructions.
+void fuse_superinstructions(Chunk& chunk);
+
 } // Clox
\ No newline at end of file
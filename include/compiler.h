@@ -1,7 +1,11 @@
 #pragma once
 
 #include <array>
+#include <iosfwd>
+#include <mutex>
 #include <optional>
+#include <unordered_map>
+#include <vector>
 
 #include "chunk.h"
 #include "scanner.h"
@@ -10,9 +14,11 @@ namespace Clox {
 
 struct Chunk;
 struct ObjFunction;
+struct ObjString;
 struct VM;
 
 struct Compilation;
+struct Options;
 struct Parser;
 
 enum class Precedence :uint8_t
@@ -39,6 +45,10 @@ void error(Parser& parser, std::string_view message);
 void error_at_current(Parser& parser, std::string_view message);
 void error_at(Parser& parser, const Token& token, std::string_view message);
 
+// Lowers a function verify() accepted to the forms options run it in: register
+// code, and superinstructions unless built without them.
+void prepare_function(ObjFunction& function, const Options& options);
+
 struct Parser
 {
 	Scanner scanner;
@@ -46,6 +56,7 @@ struct Parser
 	Token previous;
 	bool had_error = false;
 	bool panic_mode = false;
+	std::ostream* errors = nullptr; // where error_at() reports, std::cerr when null
 
 	constexpr explicit Parser(std::string_view source)noexcept
 		:scanner(source)
@@ -81,6 +92,8 @@ struct Local
 	Token name;
 	int depth = -1;
 	bool is_captured = false;
+	bool frame_bound = false; // a function only ever called from this frame, see stays_in_frame()
+	ObjFunction* function = nullptr; // the one a frame-bound local holds
 };
 
 struct Upvalue
@@ -89,6 +102,29 @@ struct Upvalue
 	bool is_local = false;
 };
 
+// Where the numbers and strings already in a chunk are, so that equal ones
+// share a slot. Strings are interned, their address tells them apart;
+// numbers go by their bits, keeping 0 and -0 apart.
+struct ConstantIndex
+{
+	std::unordered_map<uint64_t, size_t> numbers;
+	std::unordered_map<const Obj*, size_t> strings;
+
+	[[nodiscard]] std::optional<size_t> find(const Value& value)const;
+	void add(const Value& value, size_t index);
+};
+
+// What is known about the expression compiled last, whose code runs from
+// start to end of the chunk, see parse_precedence(). A value means it is a
+// literal or folded to one, and its code is a single instruction loading it.
+struct KnownExpression
+{
+	size_t start = 0;
+	size_t end = 0;
+	std::optional<Value> value;
+	bool number = false; // evaluates to a number unless it raises an error
+};
+
 struct Compiler
 {
 	std::unique_ptr<Compiler> enclosing = nullptr;
@@ -99,6 +135,10 @@ struct Compiler
 	size_t local_count = 0;
 	std::array<Upvalue, UINT8_COUNT> upvalues;
 	int scope_depth = 0;
+	bool frame_bound = false; // uses the locals of the enclosing frame in place
+	std::optional<size_t> last_call; // offset of the latest Call or Invoke emitted
+	KnownExpression known;
+	ConstantIndex constants;
 };
 
 struct ClassCompiler
@@ -114,6 +154,8 @@ struct Compilation
 	std::unique_ptr<ClassCompiler> current_class = nullptr;
 	std::unique_ptr<Parser> parser = nullptr;
 	VM& vm;
+	std::vector<ObjFunction*> split; // bodies lazy_function() left for compile_parallel()
+	std::mutex* shared = nullptr; // held by the threads of compile_parallel() around the VM, see lock_vm()
 
 	constexpr explicit Compilation(VM& vm)noexcept
 		:vm(vm)
@@ -121,8 +163,18 @@ struct Compilation
 	}
 
 	[[nodiscard]] ObjFunction* compile(std::string_view source);
+	// Compiles the body Options::lazy or Options::compile_threads left in
+	// function, which closures already hold. False on a compile error, leaving it to compile again.
+	// Errors go to errors, or std::cerr when it is null.
+	[[nodiscard]] bool compile_lazy(ObjFunction& function, std::ostream* errors = nullptr);
 
 private:
+	void compile_parallel();
+	// Interning strings, registering objects, the stack make_constant()
+	// roots values on and the globals are the VM's, which the threads of
+	// compile_parallel() take turns at. Unlocked on their own.
+	[[nodiscard]] std::unique_lock<std::mutex> lock_vm()const;
+	[[nodiscard]] ObjString* intern(std::string_view text);
 
 	void expression();
 	void and_(bool can_assign);
@@ -152,18 +204,27 @@ private:
 	void class_declaration();
 	void fun_declaration();
 	void var_declaration();
-	void function(FunctionType type);
+	ObjFunction* function(FunctionType type, bool frame_bound = false);
+	void function_body();
+	[[nodiscard]] ObjFunction* lazy_function(FunctionType type);
+	[[nodiscard]] bool stays_in_frame(const Token& name)const;
 	void method();
 
 	[[nodiscard]] uint8_t argument_list();
 	void declare_variable();
-	void define_variable(uint8_t global)const;
-	[[nodiscard]] uint8_t identifier_constant(const Token& name);
+	void define_variable(size_t global)const;
+	[[nodiscard]] size_t identifier_constant(const Token& name);
+	[[nodiscard]] size_t global_slot(const Token& name);
 	void named_variable(const Token& name, bool can_assign);
+	[[nodiscard]] bool inline_call(const ObjFunction& callee, size_t start);
 	void parse_precedence(Precedence precedence);
-	[[nodiscard]] uint8_t parse_variable(std::string_view error);
+	void settle_known(size_t start);
+	[[nodiscard]] std::optional<Value> fold(TokenType op, const Value& left, const Value& right);
+	void emit_folded(size_t start, const Value& value);
+	void truncate(size_t offset)const;
+	[[nodiscard]] size_t parse_variable(std::string_view error);
 
-	void init_compiler(FunctionType type);
+	void init_compiler(FunctionType type, ObjFunction* function = nullptr);
 	[[nodiscard]] auto end_compiler()->std::pair<ObjFunction*, std::unique_ptr<Compiler>>;
 	void add_local(const Token& name);
 	[[nodiscard]] uint8_t add_upvalue(const std::unique_ptr<Compiler>& compiler, uint8_t index, bool is_local);
@@ -174,18 +235,27 @@ private:
 	[[nodiscard]] std::optional<uint8_t> resolve_upvalue(const std::unique_ptr<Compiler>& compiler, const Token& name);
 
 	template<typename T>
-	[[nodiscard]] typename std::enable_if_t<std::is_convertible_v<T, Value>, uint8_t>
+	[[nodiscard]] typename std::enable_if_t<std::is_convertible_v<T, Value>, size_t>
 		make_constant(T&& value)
 	{
-		vm.push(value);
-		auto constant = current_chunk().add_constant(std::forward<T>(value));
-		vm.pop();
-		if (constant > UINT8_MAX)
+		auto known = current->constants.find(value);
+		if (known.has_value())
+			return known.value();
+
+		size_t constant = 0;
+		{
+			auto lock = lock_vm();
+			vm.push(value);
+			constant = current_chunk().add_constant(std::forward<T>(value));
+			vm.pop();
+		}
+		if (constant > LONG_OPERAND_MAX)
 		{
 			error(*parser, "Too many constants in one chunk.");
 			return 0;
 		}
-		return static_cast<uint8_t>(constant);
+		current->constants.add(current_chunk().constants.values[constant], constant);
+		return constant;
 	}
 
 	template<typename T>
@@ -207,7 +277,7 @@ private:
 	typename std::enable_if_t<std::is_convertible_v<T, Value>, void>
 		emit_constant(T&& value)
 	{
-		emit_byte(OpCode::Constant, make_constant(std::forward<T>(value)));
+		emit_constant_operand(OpCode::Constant, make_constant(std::forward<T>(value)));
 	}
 
 	template<typename T>
@@ -219,6 +289,10 @@ private:
 		emit_byte(static_cast<uint8_t>(0xff));
 		return current_chunk().count() - 2;
 	}
+	void emit_cache(size_t offset);
+	void emit_global(OpCode op, size_t slot)const;
+	void emit_constant_operand(OpCode op, size_t constant)const;
+	void emit_long(size_t operand)const;
 	void emit_loop(size_t loop_start);
 	void emit_return()const;
 	void patch_jump(size_t offset);
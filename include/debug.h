@@ -1,12 +1,37 @@
 #pragma once
 
+#include <cstdint>
 #include <string_view>
+#include <vector>
 
 namespace Clox {
 
 struct Chunk;
+struct ObjFunction;
 
 void disassemble_chunk(const Chunk& chunk, std::string_view name);
 [[nodiscard]] size_t disassemble_instruction(const Chunk& chunk, size_t offset);
+void disassemble_registers(const ObjFunction& function);
+[[nodiscard]] size_t disassemble_register_instruction(const ObjFunction& function, size_t offset);
+// hit rate of every inline cache in function and the functions nested in it
+void report_inline_caches(const ObjFunction& function);
+// line table size of function and the functions nested in it, against one
+// size_t per byte of code
+void report_line_tables(const ObjFunction& function);
+
+// How often each opcode ran straight after one or two others, to find the
+// sequences worth a superinstruction.
+struct OpcodeProfile
+{
+	std::vector<size_t> pairs;
+	std::vector<size_t> triples;
+	uint8_t previous[2] = {};
+	size_t count = 0;
+
+	OpcodeProfile();
+	void record(uint8_t op)noexcept;
+	// the most frequent pairs and triples, then starts over
+	void report(size_t top);
+};
 
 } // Clox
\ No newline at end of file
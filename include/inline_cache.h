@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+
+namespace Clox {
+
+struct ObjClosure;
+struct Shape;
+
+// a site stops caching once it has seen more receiver shapes than this
+constexpr auto INLINE_CACHE_WAYS = 4;
+
+// What a property access resolved to for receivers of one shape: either
+// a field slot, or a method when method is set.
+struct InlineCacheEntry
+{
+	const Shape* shape = nullptr;
+	Shape* transition = nullptr; // shape after a SetProperty that adds the field
+	size_t slot = 0;
+	ObjClosure* method = nullptr;
+};
+
+// Per call site memo keyed on receiver shape. One entry is the monomorphic
+// case, up to INLINE_CACHE_WAYS the polymorphic one.
+struct InlineCache
+{
+	size_t offset = 0; // of the instruction owning this cache
+	std::array<InlineCacheEntry, INLINE_CACHE_WAYS> entries;
+	size_t entry_count = 0;
+	bool megamorphic = false;
+
+	size_t hits = 0;
+	size_t misses = 0;
+
+	explicit InlineCache(size_t offset)noexcept :offset(offset) {}
+
+	[[nodiscard]] const InlineCacheEntry* lookup(const Shape* shape)noexcept
+	{
+		for (size_t i = 0; i < entry_count; i++)
+		{
+			if (entries[i].shape == shape)
+			{
+				hits++;
+				return &entries[i];
+			}
+		}
+		misses++;
+		return nullptr;
+	}
+
+	void update(const InlineCacheEntry& entry)noexcept
+	{
+		if (entry_count == INLINE_CACHE_WAYS)
+		{
+			megamorphic = true;
+			return;
+		}
+		entries[entry_count++] = entry;
+	}
+};
+
+} // Clox
\ No newline at end of file
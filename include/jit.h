@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "value.h"
+
+// the emitted code works on NaN-boxed values directly
+#if defined(__linux__) && defined(__x86_64__) && defined(NAN_BOXING)
+#define CLOX_JIT_X64
+#endif
+
+namespace Clox {
+
+struct ObjFunction;
+
+// What the native code reads on entry and writes back on exit.
+struct JitState
+{
+	Value* slots;
+	Value* stacktop;
+	Value* globals;
+};
+
+// Native x86-64 translation of one function's bytecode. Values stay on the
+// VM stack in their usual layout, so native code can be entered at any
+// instruction it handles and hands back to the interpreter at the first
+// instruction it does not, or whose operand types it does not expect.
+struct JitCode
+{
+	using EntryFn = size_t(*)(JitState* state, const void* target);
+
+	void* memory = nullptr;
+	size_t size = 0;
+	uint8_t* code = nullptr; // the bytecode this was translated from
+	std::vector<const uint8_t*> entries; // per bytecode offset, nullptr where native code cannot start
+
+	JitCode() = default;
+	JitCode(const JitCode&) = delete;
+	JitCode& operator=(const JitCode&) = delete;
+	~JitCode();
+
+	// runs from ip until the interpreter has to take over, and returns where
+	[[nodiscard]] uint8_t* run(Value* slots, Value*& stacktop, Value* globals, uint8_t* ip)const;
+};
+
+[[nodiscard]] constexpr bool jit_supported()noexcept
+{
+#ifdef CLOX_JIT_X64
+	return true;
+#else
+	return false;
+#endif // CLOX_JIT_X64
+}
+
+// nullptr when this platform has no JIT
+[[nodiscard]] std::unique_ptr<JitCode> jit_compile(ObjFunction& function);
+
+} // Clox
\ No newline at end of file
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+namespace Clox {
+
+// Source line of every byte of some bytecode, kept as one run per stretch of
+// code compiled from the same line. Lines start at 1, so 0 stands for code
+// whose table was stripped.
+template<template<typename>typename Alloc = std::allocator>
+struct LineTable
+{
+	struct Run
+	{
+		uint32_t offset; // of the first byte on line
+		uint32_t line;
+	};
+
+	std::vector<Run, Alloc<Run>> runs;
+
+	// line of the byte at offset, appended after all earlier ones
+	void add(size_t offset, size_t line)
+	{
+		if (runs.empty() || runs.back().line != line)
+			runs.push_back(Run{ static_cast<uint32_t>(offset), static_cast<uint32_t>(line) });
+	}
+
+	[[nodiscard]] size_t line_at(size_t offset)const noexcept
+	{
+		auto run = std::upper_bound(runs.begin(), runs.end(), offset,
+			[](size_t offset, const Run& run) { return offset < run.offset; });
+		if (run == runs.begin())
+			return 0;
+		return std::prev(run)->line;
+	}
+
+	// forgets the bytes from offset on, which the compiler took back
+	void truncate(size_t offset)
+	{
+		while (!runs.empty() && runs.back().offset >= offset)
+			runs.pop_back();
+	}
+
+	void strip()
+	{
+		runs.clear();
+		runs.shrink_to_fit();
+	}
+
+	[[nodiscard]] size_t bytes()const noexcept { return runs.size() * sizeof(Run); }
+};
+
+} // Clox
\ No newline at end of file
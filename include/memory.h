@@ -1,12 +1,12 @@
 #pragma once
 
-#include <algorithm>
 #include <deque>
 #include <memory>
-#include <set>
 
+#include "allocator.h"
 #include "obj.h"
 #include "table.h"
+#include "value.h"
 
 #ifdef _DEBUG
 #define DEBUG_STRESS_GC
@@ -16,46 +16,13 @@
 namespace Clox {
 
 struct ObjString;
+struct Shape;
 struct VM;
 
-struct GC;
-
-struct AllocBase
-{
-protected:
-	inline static GC* gc = nullptr;
-
-public:
-	static void init(GC* value)noexcept
-	{
-		if (gc == nullptr && value != nullptr)
-			gc = value;
-	}
-};
-
-template<typename T>
-struct Allocator final :public AllocBase
-{
-	static_assert(!std::is_const_v<T>);
-
-	using value_type = T;
-
-	inline static std::allocator<T> worker = {};
-	using worker_traits = std::allocator_traits<decltype(worker)>;
-
-	constexpr Allocator()noexcept {}
-	constexpr Allocator(const Allocator&)noexcept = default;
-	template<typename U>
-	constexpr Allocator(const Allocator<U>&) noexcept {}
-
-	[[nodiscard]] constexpr T* allocate(std::size_t n);
-	constexpr void deallocate(T* p, std::size_t n)noexcept;
-};
-
 struct GC
 {
 	std::unique_ptr<Obj, ObjDeleter> objects = nullptr;
-	std::set<ObjString*, std::less<ObjString*>, Allocator<ObjString*>> strings;
+	Table strings; // weak, entries are dropped by remove_white_string
 	std::deque<Obj*> gray_stack;
 
 	size_t bytes_allocated = 0;
@@ -75,7 +42,8 @@ private:
 	void mark_array(const ValueArray<>& array);
 	void mark_compiler_roots();
 	void mark_object(Obj* const ptr);
-	void mark_table(const table& table);
+	void mark_shape(const Shape& shape);
+	void mark_table(const Table& table);
 	void mark_value(const Value& value);
 
 	void trace_references();
@@ -85,18 +53,10 @@ private:
 	void sweep();
 
 public:
-	template<typename T>
-	[[nodiscard]] ObjString* find_string(const T& str)const
+	[[nodiscard]] ObjString* find_string(std::string_view text, uint32_t hash)const noexcept
 	{
-		if (strings.empty()) return nullptr;
-
-		auto res = std::find_if(strings.cbegin(), strings.cend(),
-			[&str](const auto& it) { return it->content == str; });
-		if (res != strings.end())
-			return *res;
-		return nullptr;
+		return strings.find_string(text, hash);
 	}
-
 };
 
 template<typename T>
@@ -105,7 +65,9 @@ template<typename T>
 	auto alloc_size = n * sizeof(T);
 	auto p = worker_traits::allocate(worker, n);
 
-	if (gc != nullptr)
+	if (detached != nullptr)
+		*detached += alloc_size;
+	else if (gc != nullptr)
 	{
 		gc->bytes_allocated += alloc_size;
 
@@ -124,20 +86,10 @@ template<typename T>
 constexpr void Allocator<T>::deallocate(T* p, std::size_t n)noexcept
 {
 	worker_traits::deallocate(worker, p, n);
-	if (gc != nullptr)
+	if (detached != nullptr)
+		*detached -= sizeof(T) * n;
+	else if (gc != nullptr)
 		gc->bytes_allocated -= sizeof(T) * n;
 }
 
-template<typename T, typename U>
-[[nodiscard]] bool operator==(const Allocator<T>& t, const Allocator<U>& u)noexcept
-{
-	return true;
-}
-
-template<typename T, typename U>
-[[nodiscard]] bool operator!=(const Allocator<T>& t, const Allocator<U>& u)noexcept
-{
-	return false;
-}
-
 } //Clox
\ No newline at end of file
@@ -10,6 +10,7 @@ using clox_string = std::basic_string<char, std::char_traits<char>, Allocator<ch
 struct ObjString final :public Obj
 {
 	clox_string content;
+	uint32_t hash = 0;
 
 	explicit ObjString()noexcept :Obj(ObjType::String) {}
 	std::string_view text()const { return content; }
@@ -21,7 +22,10 @@ std::ostream& operator<<(std::ostream& out, const ObjString& s);
 template<typename T>
 [[nodiscard]] ObjString* create_obj_string(T&& str, VM& vm)
 {
-	auto interned = vm.gc.find_string(str);
+	// hash and probe the text in place, only a new string copies it
+	std::string_view text = str;
+	auto hash = hash_string(text);
+	auto interned = vm.gc.find_string(text, hash);
 	if (interned != nullptr)
 		return interned;
 
@@ -29,7 +33,8 @@ template<typename T>
 	auto res = static_cast<ObjString*>(p.get());
 	vm.push(res);
 	res->content = std::forward<T>(str);
-	vm.gc.strings.emplace(res);
+	res->hash = hash;
+	vm.gc.strings.set(res, Value());
 	register_obj(std::move(p), vm.gc);
 	vm.pop();
 	return res;
@@ -3,7 +3,10 @@
 #include <string_view>
 
 #include "chunk.h"
+#include "jit.h"
 #include "obj.h"
+#include "register_chunk.h"
+#include "shape.h"
 #include "table.h"
 
 namespace Clox {
@@ -26,8 +29,22 @@ struct ObjFunction final : public Obj
 {
 	size_t arity = 0;
 	size_t upvalue_count = 0;
+	size_t slot_count = 0; // stack slots used by locals, including the callee slot
+	size_t max_depth = 0; // the most stack slots a call uses, locals and temporaries, see VM::call()
+	size_t enclosing_slots = 0; // of the declaring frame, where a frame-bound one's GetEnclosing reads
 	Chunk chunk;
 	ObjString* name = nullptr;
+	ObjClosure* shared_closure = nullptr; // made by the first FrameClosure, when it captures nothing
+	// the parameters and body Options::lazy leaves for the first call to
+	// compile, or Options::compile_threads for compile_parallel(), empty
+	// once compiled, and the line they start on
+	std::string_view lazy_source;
+	size_t lazy_line = 0;
+	bool lazy_method = false;
+
+	size_t hotness = 0; // calls plus loop back-edges, counted while Options::jit is set
+	std::unique_ptr<JitCode> jit_code = nullptr;
+	std::unique_ptr<RegisterChunk> register_chunk = nullptr; // set while Options::registers is
 
 	ObjFunction() :Obj(ObjType::Function) {}
 };
@@ -73,10 +90,11 @@ std::ostream& operator<<(std::ostream& out, const ObjClosure& s);
 struct ObjClass final :public Obj
 {
 	ObjString* const name;
-	table methods;
+	Table methods;
+	const ShapePtr root_shape; // shape of a fresh instance
 
-	ObjClass(ObjString* name) noexcept
-		:Obj(ObjType::Class), name(name)
+	ObjClass(ObjString* name)
+		:Obj(ObjType::Class), name(name), root_shape(Shape::root(this))
 	{
 	}
 };
@@ -85,10 +103,11 @@ std::ostream& operator<<(std::ostream& out, const ObjClass& c);
 struct ObjInstance final :public Obj
 {
 	ObjClass* const klass;
-	table fields;
+	Shape* shape;
+	std::vector<Value, Allocator<Value>> fields; // laid out by shape
 
 	explicit ObjInstance(ObjClass* klass)
-		:Obj(ObjType::Instance), klass(klass)
+		:Obj(ObjType::Instance), klass(klass), shape(klass->root_shape.get())
 	{
 	}
 };
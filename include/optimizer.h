@@ -0,0 +1,19 @@
+#pragma once
+
+namespace Clox {
+
+struct ObjFunction;
+
+// The passes clox -O runs over each function once it compiles: the stack
+// code is lifted to SSA form (see ssa.h), common subexpressions and loads
+// after a store to the same global, upvalue or field are replaced by the
+// value already computed, loop invariants move in front of their loop, and
+// stores overwritten before anything could read them are dropped along with
+// values nothing uses. Arithmetic and comparisons whose operands are proven
+// numbers, by constants, other arithmetic or an earlier check of the same
+// value, become the unchecked forms of their instructions. Nothing that could raise a runtime error moves past
+// anything observable or is dropped. Functions the IR does not model keep
+// their code. With dump set, the IR is printed before it is lowered.
+void optimize(ObjFunction& function, bool dump);
+
+} // Clox
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+
+namespace Clox {
+
+// Runtime switches, set from the command line in clox.cpp.
+struct Options
+{
+	bool jit = false; // compile hot functions to native code where jit_supported()
+	size_t jit_threshold = 1000; // calls plus loop back-edges before a function is compiled
+	bool registers = false; // run functions as register code where register_compile() lowers them
+	bool peephole = true; // thread jumps and drop dead code and stack traffic after compiling
+	bool inline_calls = true; // copy small frame-bound functions into the calls to them
+	bool optimize = false; // run the SSA passes of optimizer.h over each function compiled
+	bool dump_ir = false; // print the SSA form of each function optimize() lowers
+	bool lazy = false; // compile the body of a top-level function or method on its first call
+	size_t compile_threads = 0; // unless lazy, compile those bodies on this many threads before running
+	bool line_info = true; // keep the line tables runtime errors are reported with
+	size_t max_frames = 1 << 16; // call depth past which a call reports a stack overflow
+	bool bytecode_cache = false; // reuse and write the .loxc file next to a script run from a file
+};
+
+} // Clox
\ No newline at end of file
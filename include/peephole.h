@@ -0,0 +1,14 @@
+#pragma once
+
+namespace Clox {
+
+struct Chunk;
+
+// Rewrites freshly compiled code in place: threads jumps that land on other
+// jumps, drops code no path reaches and stack traffic that cancels out, such
+// as a pushed constant popped unused or a local stored, popped and loaded
+// again. Line info, inline caches and jump offsets follow the code; when a
+// threaded jump would no longer fit its operand the chunk is left as it was.
+void peephole(Chunk& chunk);
+
+} // Clox
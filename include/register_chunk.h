@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "line_table.h"
+
+namespace Clox {
+
+struct ObjFunction;
+
+// Three-address form of one function's bytecode, made of the Reg* opcodes
+// and run by the same VM::run loop. Register i is frame->slots[i]: locals
+// keep the slot the compiler gave them, and a temporary lives in the slot
+// it would have taken on the stack. Constants, upvalue captures and global
+// slots are shared with the function's stack Chunk.
+struct RegisterChunk
+{
+	std::vector<uint8_t> code;
+	LineTable<> lines;
+	size_t frame_size = 0; // registers in use, the callee slot included
+
+	[[nodiscard]] size_t count()const noexcept { return code.size(); }
+};
+
+// Lowers a verified stack Chunk, or returns nullptr when the function uses
+// something registers are not implemented for (classes, properties, methods
+// and frame-bound functions), in which case it keeps running as stack code.
+[[nodiscard]] std::unique_ptr<RegisterChunk> register_compile(const ObjFunction& function);
+
+} // Clox
\ No newline at end of file
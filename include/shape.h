@@ -0,0 +1,49 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "allocator.h"
+
+namespace Clox {
+
+struct ObjClass;
+struct ObjString;
+struct Shape;
+
+// frees a shape through Allocator<Shape>, which counts it toward the GC heap
+struct ShapeDeleter
+{
+	void operator()(Shape* shape)const noexcept;
+};
+using ShapePtr = std::unique_ptr<Shape, ShapeDeleter>;
+
+// Field layout shared by every instance of a class that gained the same
+// fields in the same order. Each class owns the root of its own transition
+// tree, so a shape also identifies the class of an instance. A shape holds
+// only the field it appended, the ones before it are up the parent chain.
+struct Shape
+{
+	ObjClass* const klass;
+	const Shape* const parent; // nullptr for the root
+	ObjString* const key; // field appended to parent, nullptr for the root
+	const size_t depth; // fields from the root down to this shape
+	// shapes reached by appending one more field, rarely more than one or two
+	std::vector<ShapePtr, Allocator<ShapePtr>> transitions;
+
+	Shape(ObjClass* klass, const Shape* parent, ObjString* key)noexcept
+		:klass(klass), parent(parent), key(key), depth(parent == nullptr ? 0 : parent->depth + 1)
+	{
+	}
+
+	// shape of a fresh instance of klass
+	[[nodiscard]] static ShapePtr root(ObjClass* klass);
+
+	[[nodiscard]] size_t field_count()const noexcept { return depth; }
+	[[nodiscard]] std::optional<size_t> slot_of(const ObjString* name)const noexcept;
+	// shape reached by appending name as a new field
+	[[nodiscard]] Shape* add(ObjString* name);
+};
+
+} // Clox
\ No newline at end of file
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace Clox {
+
+struct ObjFunction;
+
+// Operations of the SSA form, most standing for the stack instruction of the
+// same name with its short and long forms merged. Param is the callee or an
+// argument in its slot as the function starts, Phi the value one stack slot
+// holds where control flow meets, and Jump, Branch and Return end a block.
+enum class IrOp :uint8_t
+{
+	Param,
+	Phi,
+	Constant,
+	Nil,
+	True,
+	False,
+	GetGlobal,
+	DefineGlobal,
+	SetGlobal,
+	GetUpvalue,
+	SetUpvalue,
+	GetProperty,
+	SetProperty,
+	Equal,
+	Greater,
+	Less,
+	Add,
+	Subtract,
+	Multiply,
+	Divide,
+	Not,
+	Negate,
+	Print,
+	Call,
+	TailCall,
+	Invoke,
+	TailInvoke,
+	Closure,
+	Jump,
+	Branch,
+	Return
+};
+
+[[nodiscard]] std::string_view nameof(IrOp op);
+
+// whether op leaves a value on the stack; the stores leave the one they
+// stored, which stays the value of their operand in the IR
+[[nodiscard]] bool pushes(IrOp op)noexcept;
+// whether op names a value of its own that later instructions can use
+[[nodiscard]] bool produces(IrOp op)noexcept;
+
+using IrValue = uint32_t;
+constexpr IrValue NO_VALUE = UINT32_MAX;
+constexpr uint32_t NO_BLOCK = UINT32_MAX;
+
+// An instruction, and the value it produces when it produces one.
+struct IrInstruction
+{
+	IrOp op;
+	bool dead = false;
+	uint8_t arg_count = 0; // of Call and Invoke
+	uint32_t operand = 0; // constant index, global slot, upvalue index or Param slot
+	uint32_t block = NO_BLOCK;
+	size_t line = 0;
+	size_t source = 0; // offset of the stack instruction, where Closure keeps its captures
+	std::vector<IrValue> args;
+	bool unchecked = false; // arithmetic or a comparison proven to take numbers
+};
+
+struct IrBlock
+{
+	std::vector<IrValue> phis; // bottom of the stack first
+	std::vector<IrValue> code; // ends in Jump, Branch or Return
+	std::vector<uint32_t> preds; // in the order of each phi's args
+	std::vector<uint32_t> succs; // for Branch, the one taken when the condition holds first
+};
+
+// One function in SSA form. Values and blocks are only ever appended;
+// instructions a pass removes are marked dead and dropped from their block.
+struct IrFunction
+{
+	ObjFunction& function;
+	std::vector<IrInstruction> values;
+	std::vector<IrBlock> blocks; // blocks[0] is the entry, holding the Params
+
+	explicit IrFunction(ObjFunction& function) :function(function) {}
+
+	[[nodiscard]] const IrInstruction& operator[](IrValue value)const { return values[value]; }
+	[[nodiscard]] IrInstruction& operator[](IrValue value) { return values[value]; }
+	[[nodiscard]] IrValue terminator(uint32_t block)const { return blocks[block].code.back(); }
+
+	IrValue append(uint32_t block, IrInstruction instruction);
+	// Reachable blocks, each after the blocks dominating it and a Branch's
+	// first successor straight after it where possible.
+	[[nodiscard]] std::vector<uint32_t> reverse_postorder()const;
+	// Puts an empty block on every edge from a block with several successors
+	// to one with several predecessors, so code can be added to the edge.
+	void split_critical_edges();
+	// Appends each block that is the only successor of its only predecessor
+	// to that predecessor, leaving it empty and unreachable.
+	void merge_blocks();
+	// args naming a value in replacements name its replacement instead
+	void replace_uses(std::vector<IrValue>& replacements);
+	void remove_dead();
+};
+
+// nullopt when the function does something the IR does not model: classes,
+// super calls, closures capturing its locals, or frame-bound functions (see
+// OpCode::FrameClosure) declared in it or being one.
+[[nodiscard]] std::optional<IrFunction> build_ir(ObjFunction& function);
+
+// Replaces the function's stack code with that of ir, every value the stack
+// does not hand straight to its one use kept in a slot of the frame. False
+// when that takes more slots or longer jumps than the instructions can
+// address, leaving the function as it was.
+[[nodiscard]] bool lower_ir(IrFunction& ir);
+
+void print_ir(const IrFunction& ir, std::string_view name);
+
+} // Clox
@@ -1,16 +1,68 @@
 #pragma once
 
-#include <map>
+#include <cstdint>
+#include <string_view>
+#include <vector>
 
+#include "allocator.h"
 #include "value.h"
 
 namespace Clox {
 
 struct ObjString;
 
-template<typename T>
-struct Allocator;
+// 32-bit FNV-1a, cached on every string so tables never rehash keys
+[[nodiscard]] constexpr uint32_t hash_string(std::string_view text)noexcept
+{
+	uint32_t hash = 2166136261u;
+	for (auto c : text)
+	{
+		hash ^= static_cast<uint8_t>(c);
+		hash *= 16777619u;
+	}
+	return hash;
+}
 
-using table = std::map<ObjString*, Value, std::less<ObjString*>, Allocator<std::pair<ObjString* const, Value>>>;
+// An empty slot has no key and a nil value, a deleted one no key and true.
+struct Entry
+{
+	ObjString* key = nullptr;
+	Value value;
+};
 
-}// Clox
\ No newline at end of file
+// Open addressing with linear probing over interned string keys, probing
+// starts at the hash cached on the string.
+struct Table
+{
+	std::vector<Entry, Allocator<Entry>> entries;
+	size_t count = 0; // live entries plus tombstones
+
+	[[nodiscard]] Value* find(const ObjString* key)noexcept;
+	[[nodiscard]] const Value* find(const ObjString* key)const noexcept;
+	// returns true when the key was not in the table yet
+	bool set(ObjString* key, const Value& value);
+	bool erase(const ObjString* key)noexcept;
+	void add_all(const Table& from);
+
+	// for the intern table, where the key to compare against is not a string yet
+	[[nodiscard]] ObjString* find_string(std::string_view text, uint32_t hash)const noexcept;
+	// turns entries whose key was not marked into tombstones
+	void remove_white()noexcept;
+
+	template<typename F>
+	void for_each(F&& f)const
+	{
+		for (auto& entry : entries)
+		{
+			if (entry.key != nullptr)
+				f(entry.key, entry.value);
+		}
+	}
+
+private:
+	[[nodiscard]] Entry& find_entry(std::vector<Entry, Allocator<Entry>>& entries,
+		const ObjString* key)const noexcept;
+	void adjust_capacity(size_t capacity);
+};
+
+} // Clox
\ No newline at end of file
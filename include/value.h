@@ -21,10 +21,12 @@ constexpr uint64_t QNAN = 0x7ffc000000000000;
 constexpr uint64_t TAG_NIL = 1;
 constexpr uint64_t TAG_FALSE = 2;
 constexpr uint64_t TAG_TRUE = 3;
+constexpr uint64_t TAG_UNDEFINED = 4;
 
 constexpr uint64_t NIL_VAL = (QNAN | TAG_NIL);
 constexpr uint64_t FALSE_VAL = (QNAN | TAG_FALSE);
 constexpr uint64_t TRUE_VAL = (QNAN | TAG_TRUE);
+constexpr uint64_t UNDEFINED_VAL = (QNAN | TAG_UNDEFINED);
 
 #endif // NAN_BOXING
 
@@ -74,6 +76,19 @@ struct Value
 		return (value & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT);
 	}
 
+	// never seen by Lox code, marks a global slot whose variable is not defined yet
+	[[nodiscard]] static constexpr Value undefined()noexcept
+	{
+		Value res;
+		res.value = UNDEFINED_VAL;
+		return res;
+	}
+
+	[[nodiscard]] constexpr bool is_undefined()const noexcept
+	{
+		return value == UNDEFINED_VAL;
+	}
+
 	template<typename T>
 	[[nodiscard]] constexpr T as()const
 	{
@@ -91,7 +106,12 @@ struct Value
 
 #else
 
-	using var_t = std::variant<bool, std::monostate, double, Obj*>;
+	struct Undefined
+	{
+		[[nodiscard]] constexpr bool operator==(Undefined)const noexcept { return true; }
+	};
+
+	using var_t = std::variant<bool, std::monostate, double, Obj*, Undefined>;
 
 	var_t value;
 
@@ -105,6 +125,14 @@ struct Value
 	[[nodiscard]] constexpr bool is_number()const noexcept { return std::holds_alternative<double>(value); }
 	[[nodiscard]] constexpr bool is_obj()const noexcept { return std::holds_alternative<Obj*>(value); }
 
+	[[nodiscard]] static constexpr Value undefined()noexcept
+	{
+		Value res;
+		res.value = Undefined();
+		return res;
+	}
+	[[nodiscard]] constexpr bool is_undefined()const noexcept { return std::holds_alternative<Undefined>(value); }
+
 	template<typename T>
 	[[nodiscard]] constexpr T as()const
 	{
@@ -125,20 +153,22 @@ struct Value
 		return false;
 	}
 
+	// unchecked, the caller has already tested is_obj_type<U>()
 	template<typename U>
-	[[nodiscard]] auto as_obj()const
+	[[nodiscard]] auto as_obj()const noexcept
 		->typename std::enable_if_t<std::is_base_of_v<Obj, U> && !std::is_same_v<Obj, U>, U*>
 	{
-		try
-		{
-			if (is_obj_type<U>())
-				return static_cast<U*>(as<Obj*>());
-			else throw;
-		} catch (...)
-		{
-			throw std::invalid_argument(std::string("Value is not a(n) ")
-				+ nameof<U>().data());
-		}
+		return static_cast<U*>(as<Obj*>());
+	}
+
+	// nullptr when the value is not a U
+	template<typename U>
+	[[nodiscard]] auto try_as_obj()const
+		->typename std::enable_if_t<std::is_base_of_v<Obj, U> && !std::is_same_v<Obj, U>, U*>
+	{
+		if (is_obj_type<U>())
+			return as_obj<U>();
+		return nullptr;
 	}
 
 };
@@ -157,6 +187,13 @@ struct Value
 	return !(v1 == v2);
 }
 
+// only nil and false, every other value is true in a condition
+[[nodiscard]] constexpr bool is_falsey(const Value& value)
+{
+	return value.is_nil() ||
+		(value.is_bool() && !value.as<bool>());
+}
+
 std::ostream& operator<<(std::ostream& out, const Value& value);
 
 template<template<typename>typename Alloc = Allocator>
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <optional>
+#include <string_view>
+
+namespace Clox {
+
+struct ObjFunction;
+
+// Checks the bytecode of a freshly compiled function once, so that VM::run
+// can decode it without bounds checks. Returns the reason on rejection.
+// global_count is the number of global slots the VM has handed out.
+[[nodiscard]] std::optional<std::string_view> verify(const ObjFunction& function,
+	size_t global_count);
+
+} // Clox
\ No newline at end of file
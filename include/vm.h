@@ -1,15 +1,27 @@
 #pragma once
 
-#include <array>
+#include <deque>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
 
 #include "compiler.h"
 #include "memory.h"
 #include "object.h"
+#include "options.h"
 
 namespace Clox {
 
-constexpr auto FRAME_MAX = 64;
-constexpr auto STACK_MAX = FRAME_MAX * UINT8_COUNT;
+// Stack slots a call makes sure are free above the deepest its callee's
+// code goes, ObjFunction::max_depth, for the string create_obj_string()
+// roots there while it allocates.
+constexpr size_t FRAME_HEADROOM = 1;
+constexpr size_t STACK_INITIAL = 2 * UINT8_COUNT;
+constexpr size_t FRAMES_INITIAL = 8;
+// frames a runtime error's trace prints at each end of the call stack,
+// eliding the ones between
+constexpr size_t TRACE_FRAMES = 10;
 
 enum class InterpretResult
 {
@@ -21,53 +33,78 @@ enum class InterpretResult
 struct CallFrame
 {
 	const ObjClosure* closure = nullptr;
-	size_t ip = 0; // index at function->chunk.code
+	uint8_t* ip = nullptr; // points into function->chunk.code, which run() quickens in place
 	Value* slots = nullptr;  // pointer to VM::stack
-
-	[[nodiscard]] uint8_t read_byte();
-	[[nodiscard]] Value read_constant();
-	[[nodiscard]] uint16_t read_short();
-	[[nodiscard]] ObjString* read_string();
+	Value* top = nullptr; // end of the registers while running register code, nullptr for stack code
 
 	[[nodiscard]] const Chunk& chunk()const noexcept;
+	[[nodiscard]] size_t line()const;
 };
 
 struct VM
 {
-	std::array<CallFrame, FRAME_MAX> frames;
+	// Both grow by doubling up to Options::max_frames frames. The stack is
+	// moved when it grows, see grow_stack(), so pointers into it must not be
+	// held across a call.
+	std::vector<CallFrame> frames;
 	size_t frame_count = 0;
-	std::array<Value, STACK_MAX> stack;
+	std::vector<Value> stack;
 	Value* stacktop = nullptr;
-	table globals;
+	Table global_slots; // the slot in globals a global name was resolved to
+	ValueArray<> globals; // Value::undefined() until the variable is defined
 	ObjString* init_string = nullptr;
 	ObjUpvalue* open_upvalues = nullptr;
+	std::deque<std::string> sources; // of each script compiled with Options::lazy, which its functions compile from
 
 	Compilation cu;
 	GC gc;
+	const Options options;
 
 	InterpretResult interpret(std::string_view source);
-	VM();
+	// as interpret(source), loading the script from the bytecode cache at
+	// cache when it was compiled from this source, and writing it there if not
+	InterpretResult interpret(std::string_view source, const std::filesystem::path& cache);
+	explicit VM(const Options& options = {});
 
 	Value pop();
 	void push(Value value);
 
+	// slots stay valid for the lifetime of the VM, so REPL lines share them
+	[[nodiscard]] size_t global_slot(ObjString* name);
+
 private:
+	InterpretResult run_script(ObjFunction* function);
 	InterpretResult run();
 
 	[[nodiscard]] ObjUpvalue* captured_upvalue(Value* local);
+	// the closure FrameClosure pushes, shared by every declaration of a
+	// function capturing nothing
+	[[nodiscard]] ObjClosure* frame_closure(ObjFunction* function);
 	void close_upvalues(Value* last);
+	void grow_stack(size_t needed);
+	// pops the running frame for a call in tail position, moving the callee
+	// and its arguments down to where the frame's slots began
+	void drop_frame(Value* callee, uint8_t arg_count);
 	void define_method(ObjString* name);
+	void tier_up(ObjFunction& function);
 	[[nodiscard]] bool call(const ObjClosure* closure, uint8_t arg_count);
 	[[nodiscard]] bool call_value(const Value& callee, uint8_t arg_count);
+	[[nodiscard]] std::optional<InlineCacheEntry> resolve_property(const ObjInstance* instance,
+		ObjString* name)const;
+	[[nodiscard]] ObjClosure* find_method(const ObjClass* klass, ObjString* name)const;
+	[[nodiscard]] bool get_property(ObjInstance* instance, ObjString* name, InlineCache& cache);
+	void set_property(ObjInstance* instance, ObjString* name, InlineCache& cache);
 	[[nodiscard]] bool bind_method(const ObjClass* klass, ObjString* name);
-	[[nodiscard]] bool invoke(ObjString* const name, uint8_t arg_count);
+	[[nodiscard]] bool invoke(ObjString* const name, uint8_t arg_count, InlineCache& cache);
 	[[nodiscard]] bool invoke_from_class(const ObjClass* klass,
 		ObjString* name, uint8_t arg_count);
 	void define_native(std::string_view name, NativeFn function);
+	[[nodiscard]] ObjString* global_name(size_t slot)const;
 
 	[[nodiscard]] const Value& peek(size_t distance)const;
 
 	void reset_stack()noexcept;
+	void print_trace()const;
 
 	template<typename... Args>
 	void runtime_error(Args&&... args)
@@ -75,18 +112,7 @@ private:
 		static_assert(sizeof...(Args) > 0);
 		(std::cerr << ... << std::forward<Args>(args));
 		std::cerr << '\n';
-		for (int i = frame_count - 1; i >= 0; i--)
-		{
-			const auto& frame = frames.at(i);
-			auto function = frame.closure->function;
-			auto instruction = frame.ip - 1;
-			auto line = function->chunk.lines.at(instruction);
-			std::cerr << "[line " << line << "] in ";
-			if (function->name == nullptr)
-				std::cerr << "script\n";
-			else
-				std::cerr << function->name->text() << "()\n";
-		}
+		print_trace();
 		reset_stack();
 	}
 };
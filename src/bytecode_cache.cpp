@@ -0,0 +1,405 @@
+#include "bytecode_cache.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // _WIN32
+
+#include "obj_string.h"
+#include "verifier.h"
+#include "vm.h"
+
+namespace Clox {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Native byte order throughout: read on a machine of the other order, the
+// magic number does not match and the cache is ignored.
+constexpr uint32_t CACHE_MAGIC = 0x434f4c58; // "XLOC" little endian
+// bump when the layout or the meaning of an existing opcode changes
+constexpr uint32_t CACHE_VERSION = 4;
+// every nested function is pushed while it loads, so keep well inside STACK_INITIAL
+constexpr size_t CACHE_MAX_NESTING = UINT8_COUNT;
+
+// the options that change the code compiled, which a cache must match
+[[nodiscard]] uint32_t compile_flags(const Options& options)noexcept
+{
+	return (options.peephole ? 1u : 0u) | (options.optimize ? 2u : 0u) | (options.inline_calls ? 4u : 0u);
+}
+
+enum class ConstantTag :uint8_t
+{
+	Number,
+	String,
+	Function
+};
+
+// 64-bit FNV-1a, of the source a cache was compiled from and of the cache
+// itself: verify() only bounds the stack depth along the layout the
+// compiler gives code, so damaged code that still decodes must be caught
+// before it runs
+[[nodiscard]] uint64_t hash_bytes(std::string_view bytes)noexcept
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (auto c : bytes)
+	{
+		hash ^= static_cast<uint8_t>(c);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+// Read only view of a whole file, unmapped on destruction. Empty when the
+// file is missing, empty or cannot be mapped.
+class MappedFile
+{
+public:
+	explicit MappedFile(const fs::path& path)
+	{
+#ifdef _WIN32
+		file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+			return;
+		mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping == nullptr)
+			return;
+		auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (view == nullptr)
+			return;
+		begin = static_cast<const uint8_t*>(view);
+		length = static_cast<size_t>(size.QuadPart);
+#else
+		auto fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return;
+		struct stat status;
+		if (fstat(fd, &status) == 0 && status.st_size > 0)
+		{
+			auto view = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (view != MAP_FAILED)
+			{
+				begin = static_cast<const uint8_t*>(view);
+				length = static_cast<size_t>(status.st_size);
+			}
+		}
+		// the mapping outlives the descriptor
+		close(fd);
+#endif // _WIN32
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile()
+	{
+#ifdef _WIN32
+		if (begin != nullptr)
+			UnmapViewOfFile(begin);
+		if (mapping != nullptr)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+#else
+		if (begin != nullptr)
+			munmap(const_cast<uint8_t*>(begin), length);
+#endif // _WIN32
+	}
+
+	[[nodiscard]] const uint8_t* data()const noexcept { return begin; }
+	[[nodiscard]] size_t size()const noexcept { return length; }
+
+private:
+	const uint8_t* begin = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif // _WIN32
+};
+
+// Bounds checked cursor over a mapped cache. A read past the end sets failed
+// and yields zeroes, so a truncated file is noticed once, at the end.
+struct CacheReader
+{
+	const uint8_t* at;
+	const uint8_t* end;
+	bool failed = false;
+
+	[[nodiscard]] bool has(size_t count)noexcept
+	{
+		if (static_cast<size_t>(end - at) < count)
+			failed = true;
+		return !failed;
+	}
+
+	template<typename T>
+	[[nodiscard]] T read()noexcept
+	{
+		T value{};
+		if (has(sizeof(T)))
+		{
+			std::memcpy(&value, at, sizeof(T));
+			at += sizeof(T);
+		}
+		return value;
+	}
+
+	[[nodiscard]] std::string_view text()noexcept
+	{
+		auto length = read<uint32_t>();
+		if (!has(length))
+			return {};
+		std::string_view res(reinterpret_cast<const char*>(at), length);
+		at += length;
+		return res;
+	}
+};
+
+struct CacheWriter
+{
+	std::string bytes;
+
+	template<typename T>
+	void write(T value)
+	{
+		bytes.append(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+	void text(std::string_view text)
+	{
+		write(static_cast<uint32_t>(text.size()));
+		bytes.append(text);
+	}
+};
+
+[[nodiscard]] ObjFunction* load_function(VM& vm, CacheReader& reader, size_t depth);
+
+[[nodiscard]] bool load_constants(VM& vm, CacheReader& reader, Chunk& chunk, size_t depth)
+{
+	auto count = reader.read<uint32_t>();
+	for (uint32_t i = 0; i < count && !reader.failed; i++)
+	{
+		Value value;
+		switch (static_cast<ConstantTag>(reader.read<uint8_t>()))
+		{
+			case ConstantTag::Number:
+				value = reader.read<double>();
+				break;
+			case ConstantTag::String:
+				value = create_obj_string(reader.text(), vm);
+				break;
+			case ConstantTag::Function:
+			{
+				auto function = load_function(vm, reader, depth + 1);
+				if (function == nullptr)
+					return false;
+				value = function;
+				break;
+			}
+			default:
+				return false;
+		}
+		// adding the constant may collect, see Compilation::make_constant()
+		vm.push(value);
+		static_cast<void>(chunk.add_constant(value));
+		vm.pop();
+	}
+	return !reader.failed;
+}
+
+[[nodiscard]] ObjFunction* load_function(VM& vm, CacheReader& reader, size_t depth)
+{
+	if (depth > CACHE_MAX_NESTING)
+		return nullptr;
+
+	auto function = create_obj<ObjFunction>(vm.gc);
+	vm.push(function);
+	function->arity = reader.read<uint32_t>();
+	function->upvalue_count = reader.read<uint32_t>();
+	function->slot_count = reader.read<uint32_t>();
+	function->max_depth = reader.read<uint32_t>();
+	function->enclosing_slots = reader.read<uint32_t>();
+	if (reader.read<uint8_t>() != 0)
+		function->name = create_obj_string(reader.text(), vm);
+
+	auto& chunk = function->chunk;
+	auto code_count = reader.read<uint32_t>();
+	if (reader.has(code_count))
+	{
+		chunk.code.assign(reader.at, reader.at + code_count);
+		reader.at += code_count;
+	}
+	auto run_count = reader.read<uint32_t>();
+	if (reader.has(static_cast<size_t>(run_count) * sizeof(LineTable<>::Run)))
+	{
+		chunk.lines.runs.resize(run_count);
+		std::memcpy(chunk.lines.runs.data(), reader.at, chunk.lines.bytes());
+		reader.at += chunk.lines.bytes();
+	}
+	auto cache_count = reader.read<uint32_t>();
+	for (uint32_t i = 0; i < cache_count && !reader.failed; i++)
+		static_cast<void>(chunk.add_cache(reader.read<uint32_t>()));
+	auto loaded = load_constants(vm, reader, chunk, depth);
+	vm.pop();
+
+	// verify() takes these from the compiler on trust
+	if (function->arity >= function->slot_count || function->slot_count > UINT8_COUNT ||
+		function->upvalue_count > UINT8_COUNT)
+		return nullptr;
+	if (!loaded || reader.failed || verify(*function, vm.globals.count()).has_value())
+		return nullptr;
+	prepare_function(*function, vm.options);
+	if (!vm.options.line_info)
+	{
+		chunk.lines.strip();
+		if (function->register_chunk != nullptr)
+			function->register_chunk->lines.strip();
+	}
+	return function;
+}
+
+void save_function(CacheWriter& writer, const ObjFunction& function)
+{
+	writer.write(static_cast<uint32_t>(function.arity));
+	writer.write(static_cast<uint32_t>(function.upvalue_count));
+	writer.write(static_cast<uint32_t>(function.slot_count));
+	writer.write(static_cast<uint32_t>(function.max_depth));
+	writer.write(static_cast<uint32_t>(function.enclosing_slots));
+	writer.write(static_cast<uint8_t>(function.name != nullptr));
+	if (function.name != nullptr)
+		writer.text(function.name->text());
+
+	// superinstructions only replace the opcode they start with, so undoing
+	// that leaves the code verify() accepted
+	const auto& chunk = function.chunk;
+	writer.write(static_cast<uint32_t>(chunk.count()));
+	auto code_start = writer.bytes.size();
+	writer.bytes.append(reinterpret_cast<const char*>(chunk.code.data()), chunk.count());
+	for (size_t offset = 0; offset < chunk.count(); offset += instruction_length(chunk, offset))
+		writer.bytes[code_start + offset] = static_cast<char>(unfused(static_cast<OpCode>(chunk.code[offset])));
+
+	writer.write(static_cast<uint32_t>(chunk.lines.runs.size()));
+	writer.bytes.append(reinterpret_cast<const char*>(chunk.lines.runs.data()), chunk.lines.bytes());
+	writer.write(static_cast<uint32_t>(chunk.caches.size()));
+	for (const auto& cache : chunk.caches)
+		writer.write(static_cast<uint32_t>(cache.offset));
+
+	writer.write(static_cast<uint32_t>(chunk.constants.count()));
+	for (const auto& value : chunk.constants.values)
+	{
+		if (value.is_number())
+		{
+			writer.write(ConstantTag::Number);
+			writer.write(value.as<double>());
+		} else if (auto string = value.try_as_obj<ObjString>(); string != nullptr)
+		{
+			writer.write(ConstantTag::String);
+			writer.text(string->text());
+		} else
+		{
+			// the compiler makes no other constants
+			writer.write(ConstantTag::Function);
+			save_function(writer, *value.as_obj<ObjFunction>());
+		}
+	}
+}
+
+}
+
+fs::path cache_path(const fs::path& source_path)
+{
+	return fs::path(source_path).replace_extension(".loxc");
+}
+
+ObjFunction* load_cache(VM& vm, const fs::path& path, std::string_view source)
+{
+	MappedFile file(path);
+	if (file.data() == nullptr)
+		return nullptr;
+
+	CacheReader reader{ file.data(), file.data() + file.size() };
+	if (reader.read<uint32_t>() != CACHE_MAGIC ||
+		reader.read<uint32_t>() != CACHE_VERSION ||
+		reader.read<uint32_t>() != OPCODE_COUNT ||
+		reader.read<uint32_t>() != compile_flags(vm.options) ||
+		reader.read<uint64_t>() != hash_bytes(source))
+		return nullptr;
+	auto checksum = reader.read<uint64_t>();
+	if (reader.failed || checksum != hash_bytes(std::string_view(
+		reinterpret_cast<const char*>(reader.at), static_cast<size_t>(reader.end - reader.at))))
+		return nullptr;
+
+	// a fresh VM hands slots out in the order the compiling one did
+	auto global_count = reader.read<uint32_t>();
+	for (uint32_t slot = 0; slot < global_count && !reader.failed; slot++)
+	{
+		auto name = create_obj_string(reader.text(), vm);
+		if (vm.global_slot(name) != slot)
+			return nullptr;
+	}
+
+	auto script = load_function(vm, reader, 0);
+	if (script == nullptr || reader.at != reader.end ||
+		script->arity != 0 || script->upvalue_count != 0 || script->name != nullptr)
+		return nullptr;
+	return script;
+}
+
+void save_cache(const VM& vm, const fs::path& path, std::string_view source,
+	const ObjFunction& script)
+{
+	CacheWriter writer;
+	writer.write(CACHE_MAGIC);
+	writer.write(CACHE_VERSION);
+	writer.write(static_cast<uint32_t>(OPCODE_COUNT));
+	writer.write(compile_flags(vm.options));
+	writer.write(hash_bytes(source));
+	auto header_size = writer.bytes.size() + sizeof(uint64_t);
+	writer.write(uint64_t{ 0 }); // checksum of what follows, filled in below
+
+	std::vector<std::string_view> globals(vm.globals.count());
+	vm.global_slots.for_each([&globals](ObjString* name, const Value& slot)
+		{
+			globals[static_cast<size_t>(slot.as<double>())] = name->text();
+		});
+	writer.write(static_cast<uint32_t>(globals.size()));
+	for (auto name : globals)
+		writer.text(name);
+
+	save_function(writer, script);
+	auto checksum = hash_bytes(std::string_view(writer.bytes).substr(header_size));
+	std::memcpy(writer.bytes.data() + header_size - sizeof(checksum), &checksum, sizeof(checksum));
+
+	// written aside and renamed over, so that a concurrent run never maps half a cache
+	auto temporary = path;
+	temporary += ".tmp" + std::to_string(std::random_device()());
+	std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+	file.write(writer.bytes.data(), writer.bytes.size());
+	file.close();
+	std::error_code error;
+	if (file)
+		fs::rename(temporary, path, error);
+	if (!file || error)
+		fs::remove(temporary, error);
+}
+
+} // Clox
@@ -1,5 +1,11 @@
 #include "chunk.h"
 
+#include <algorithm>
+#include <array>
+#include <optional>
+
+#include "object.h"
+
 namespace Clox {
 
 std::string_view nameof(OpCode code)
@@ -43,11 +49,359 @@ std::string_view nameof(OpCode code)
 		case OpCode::Class: return "OpClass";
 		case OpCode::Inherit: return "OpInherit";
 		case OpCode::Method: return "OpMethod";
+		case OpCode::TailCall: return "OpTailCall";
+		case OpCode::TailInvoke: return "OpTailInvoke";
+		case OpCode::GetEnclosing: return "OpGetEnclosing";
+		case OpCode::SetEnclosing: return "OpSetEnclosing";
+		case OpCode::FrameClosure: return "OpFrameClosure";
+		case OpCode::PopUnder: return "OpPopUnder";
+		case OpCode::ConstantLong: return "OpConstantLong";
+		case OpCode::GetGlobalLong: return "OpGetGlobalLong";
+		case OpCode::DefineGlobalLong: return "OpDefineGlobalLong";
+		case OpCode::SetGlobalLong: return "OpSetGlobalLong";
+		case OpCode::GetPropertyLong: return "OpGetPropertyLong";
+		case OpCode::SetPropertyLong: return "OpSetPropertyLong";
+		case OpCode::GetSuperLong: return "OpGetSuperLong";
+		case OpCode::InvokeLong: return "OpInvokeLong";
+		case OpCode::SuperInvokeLong: return "OpSuperInvokeLong";
+		case OpCode::ClosureLong: return "OpClosureLong";
+		case OpCode::ClassLong: return "OpClassLong";
+		case OpCode::MethodLong: return "OpMethodLong";
+		case OpCode::FrameClosureLong: return "OpFrameClosureLong";
+		case OpCode::AddNumber: return "OpAddNumber";
+		case OpCode::AddString: return "OpAddString";
+		case OpCode::SubtractNumber: return "OpSubtractNumber";
+		case OpCode::MultiplyNumber: return "OpMultiplyNumber";
+		case OpCode::DivideNumber: return "OpDivideNumber";
+		case OpCode::GreaterNumber: return "OpGreaterNumber";
+		case OpCode::LessNumber: return "OpLessNumber";
+		case OpCode::NegateNumber: return "OpNegateNumber";
+		case OpCode::AddUnchecked: return "OpAddUnchecked";
+		case OpCode::SubtractUnchecked: return "OpSubtractUnchecked";
+		case OpCode::MultiplyUnchecked: return "OpMultiplyUnchecked";
+		case OpCode::DivideUnchecked: return "OpDivideUnchecked";
+		case OpCode::GreaterUnchecked: return "OpGreaterUnchecked";
+		case OpCode::LessUnchecked: return "OpLessUnchecked";
+		case OpCode::NegateUnchecked: return "OpNegateUnchecked";
+		case OpCode::GetLocalGetLocal: return "OpGetLocalGetLocal";
+		case OpCode::GetLocalConstant: return "OpGetLocalConstant";
+		case OpCode::GetLocalGetProperty: return "OpGetLocalGetProperty";
+		case OpCode::SetLocalPop: return "OpSetLocalPop";
+		case OpCode::PopLoop: return "OpPopLoop";
+		case OpCode::JumpIfFalsePop: return "OpJumpIfFalsePop";
+		case OpCode::LessJumpIfFalsePop: return "OpLessJumpIfFalsePop";
+		case OpCode::RegMove: return "OpRegMove";
+		case OpCode::RegConstant: return "OpRegConstant";
+		case OpCode::RegNil: return "OpRegNil";
+		case OpCode::RegTrue: return "OpRegTrue";
+		case OpCode::RegFalse: return "OpRegFalse";
+		case OpCode::RegGetGlobal: return "OpRegGetGlobal";
+		case OpCode::RegDefineGlobal: return "OpRegDefineGlobal";
+		case OpCode::RegSetGlobal: return "OpRegSetGlobal";
+		case OpCode::RegGetUpvalue: return "OpRegGetUpvalue";
+		case OpCode::RegSetUpvalue: return "OpRegSetUpvalue";
+		case OpCode::RegEqual: return "OpRegEqual";
+		case OpCode::RegGreater: return "OpRegGreater";
+		case OpCode::RegLess: return "OpRegLess";
+		case OpCode::RegAdd: return "OpRegAdd";
+		case OpCode::RegSubtract: return "OpRegSubtract";
+		case OpCode::RegMultiply: return "OpRegMultiply";
+		case OpCode::RegDivide: return "OpRegDivide";
+		case OpCode::RegNot: return "OpRegNot";
+		case OpCode::RegNegate: return "OpRegNegate";
+		case OpCode::RegPrint: return "OpRegPrint";
+		case OpCode::RegJump: return "OpRegJump";
+		case OpCode::RegJumpIfFalse: return "OpRegJumpIfFalse";
+		case OpCode::RegLoop: return "OpRegLoop";
+		case OpCode::RegCall: return "OpRegCall";
+		case OpCode::RegTailCall: return "OpRegTailCall";
+		case OpCode::RegClosure: return "OpRegClosure";
+		case OpCode::RegCloseUpvalue: return "OpRegCloseUpvalue";
+		case OpCode::RegReturn: return "OpRegReturn";
 		default:
 			throw std::invalid_argument("Unexpected OpCode: nameof");
 	}
 }
 
+OpCode long_form(OpCode op)noexcept
+{
+	switch (op)
+	{
+		case OpCode::Constant: return OpCode::ConstantLong;
+		case OpCode::GetGlobal: return OpCode::GetGlobalLong;
+		case OpCode::DefineGlobal: return OpCode::DefineGlobalLong;
+		case OpCode::SetGlobal: return OpCode::SetGlobalLong;
+		case OpCode::GetProperty: return OpCode::GetPropertyLong;
+		case OpCode::SetProperty: return OpCode::SetPropertyLong;
+		case OpCode::GetSuper: return OpCode::GetSuperLong;
+		case OpCode::Invoke: return OpCode::InvokeLong;
+		case OpCode::SuperInvoke: return OpCode::SuperInvokeLong;
+		case OpCode::Closure: return OpCode::ClosureLong;
+		case OpCode::Class: return OpCode::ClassLong;
+		case OpCode::Method: return OpCode::MethodLong;
+		case OpCode::FrameClosure: return OpCode::FrameClosureLong;
+		default: return op;
+	}
+}
+
+OpCode unfused(OpCode op)noexcept
+{
+	switch (op)
+	{
+		case OpCode::GetLocalGetLocal:
+		case OpCode::GetLocalConstant:
+		case OpCode::GetLocalGetProperty:
+			return OpCode::GetLocal;
+		case OpCode::SetLocalPop: return OpCode::SetLocal;
+		case OpCode::PopLoop: return OpCode::Pop;
+		case OpCode::JumpIfFalsePop: return OpCode::JumpIfFalse;
+		case OpCode::LessJumpIfFalsePop: return OpCode::Less;
+		default: return op;
+	}
+}
+
+OpCode checked(OpCode op)noexcept
+{
+	switch (op)
+	{
+		case OpCode::AddUnchecked: return OpCode::Add;
+		case OpCode::SubtractUnchecked: return OpCode::Subtract;
+		case OpCode::MultiplyUnchecked: return OpCode::Multiply;
+		case OpCode::DivideUnchecked: return OpCode::Divide;
+		case OpCode::GreaterUnchecked: return OpCode::Greater;
+		case OpCode::LessUnchecked: return OpCode::Less;
+		case OpCode::NegateUnchecked: return OpCode::Negate;
+		default: return op;
+	}
+}
+
+size_t instruction_length(const Chunk& chunk, size_t offset)
+{
+	switch (unfused(static_cast<OpCode>(chunk.code[offset])))
+	{
+		case OpCode::Constant:
+		case OpCode::GetLocal:
+		case OpCode::SetLocal:
+		case OpCode::GetUpvalue:
+		case OpCode::SetUpvalue:
+		case OpCode::GetEnclosing:
+		case OpCode::SetEnclosing:
+		case OpCode::PopUnder:
+		case OpCode::GetSuper:
+		case OpCode::Call:
+		case OpCode::TailCall:
+		case OpCode::Class:
+		case OpCode::Method:
+			return 2;
+		case OpCode::GetGlobal:
+		case OpCode::DefineGlobal:
+		case OpCode::SetGlobal:
+		case OpCode::Jump:
+		case OpCode::JumpIfFalse:
+		case OpCode::Loop:
+		case OpCode::SuperInvoke:
+			return 3;
+		case OpCode::GetProperty:
+		case OpCode::SetProperty:
+		case OpCode::ConstantLong:
+		case OpCode::GetGlobalLong:
+		case OpCode::DefineGlobalLong:
+		case OpCode::SetGlobalLong:
+		case OpCode::GetSuperLong:
+		case OpCode::ClassLong:
+		case OpCode::MethodLong:
+			return 4;
+		case OpCode::Invoke:
+		case OpCode::TailInvoke:
+		case OpCode::SuperInvokeLong:
+			return 5;
+		case OpCode::GetPropertyLong:
+		case OpCode::SetPropertyLong:
+			return 6;
+		case OpCode::InvokeLong:
+			return 7;
+		case OpCode::Closure:
+		case OpCode::FrameClosure:
+		{
+			auto constant = chunk.code[offset + 1];
+			auto function = chunk.constants.values[constant].as_obj<ObjFunction>();
+			return 2 + 2 * function->upvalue_count;
+		}
+		case OpCode::ClosureLong:
+		case OpCode::FrameClosureLong:
+		{
+			auto constant = chunk.code[offset + 1] << 16 | chunk.code[offset + 2] << 8 | chunk.code[offset + 3];
+			auto function = chunk.constants.values[constant].as_obj<ObjFunction>();
+			return 4 + 2 * function->upvalue_count;
+		}
+		default:
+			return 1;
+	}
+}
+
+int stack_effect(const Chunk& chunk, size_t offset)
+{
+	switch (unfused(static_cast<OpCode>(chunk.code[offset])))
+	{
+		case OpCode::Constant:
+		case OpCode::Nil:
+		case OpCode::True:
+		case OpCode::False:
+		case OpCode::GetLocal:
+		case OpCode::GetGlobal:
+		case OpCode::GetUpvalue:
+		case OpCode::GetEnclosing:
+		case OpCode::Closure:
+		case OpCode::FrameClosure:
+		case OpCode::Class:
+		case OpCode::ConstantLong:
+		case OpCode::GetGlobalLong:
+		case OpCode::ClosureLong:
+		case OpCode::FrameClosureLong:
+		case OpCode::ClassLong:
+			return 1;
+		case OpCode::Pop:
+		case OpCode::DefineGlobal:
+		case OpCode::SetProperty:
+		case OpCode::GetSuper:
+		case OpCode::Equal:
+		case OpCode::Greater:
+		case OpCode::Less:
+		case OpCode::Add:
+		case OpCode::Subtract:
+		case OpCode::Multiply:
+		case OpCode::Divide:
+		case OpCode::Print:
+		case OpCode::CloseUpvalue:
+		case OpCode::Return:
+		case OpCode::Inherit:
+		case OpCode::Method:
+		case OpCode::DefineGlobalLong:
+		case OpCode::SetPropertyLong:
+		case OpCode::GetSuperLong:
+		case OpCode::MethodLong:
+		case OpCode::AddNumber:
+		case OpCode::AddString:
+		case OpCode::SubtractNumber:
+		case OpCode::MultiplyNumber:
+		case OpCode::DivideNumber:
+		case OpCode::GreaterNumber:
+		case OpCode::LessNumber:
+		case OpCode::AddUnchecked:
+		case OpCode::SubtractUnchecked:
+		case OpCode::MultiplyUnchecked:
+		case OpCode::DivideUnchecked:
+		case OpCode::GreaterUnchecked:
+		case OpCode::LessUnchecked:
+			return -1;
+		// the callee and its arguments give way to the result
+		case OpCode::Call:
+		case OpCode::TailCall:
+		case OpCode::PopUnder:
+			return -chunk.code[offset + 1];
+		case OpCode::Invoke:
+		case OpCode::TailInvoke:
+			return -chunk.code[offset + 2];
+		case OpCode::InvokeLong:
+			return -chunk.code[offset + 4];
+		// which also take the superclass
+		case OpCode::SuperInvoke:
+			return -chunk.code[offset + 2] - 1;
+		case OpCode::SuperInvokeLong:
+			return -chunk.code[offset + 4] - 1;
+		default:
+			return 0;
+	}
+}
+
+std::vector<int> stack_depths(const Chunk& chunk, size_t end, int depth)
+{
+	std::vector<int> depths(end + 1, -1);
+	if (end > 0)
+		depths[0] = depth;
+	for (size_t offset = 0; offset < end; offset += instruction_length(chunk, offset))
+	{
+		if (depths[offset] < 0)
+			continue;
+		auto op = unfused(static_cast<OpCode>(chunk.code[offset]));
+		auto next = offset + instruction_length(chunk, offset);
+		auto after = depths[offset] + stack_effect(chunk, offset);
+		if (op == OpCode::Jump || op == OpCode::JumpIfFalse)
+		{
+			// a jump not yet patched lands past the code so far
+			auto target = next + (chunk.code[offset + 1] << 8 | chunk.code[offset + 2]);
+			if (target <= end)
+				depths[target] = after;
+		}
+		if (op != OpCode::Jump && op != OpCode::Loop && op != OpCode::Return && next <= end)
+			depths[next] = after;
+	}
+	return depths;
+}
+
+size_t max_stack_depth(const Chunk& chunk, int depth)
+{
+	auto depths = stack_depths(chunk, chunk.count(), depth);
+	auto deepest = std::max(*std::max_element(depths.begin(), depths.end()), 0);
+	return static_cast<size_t>(deepest);
+}
+
+namespace {
+
+struct Superinstruction
+{
+	OpCode fused;
+	std::array<OpCode, 3> sequence;
+	size_t length;
+};
+
+// tried in order at each instruction, so longer sequences come first
+constexpr Superinstruction SUPERINSTRUCTIONS[] = {
+	{ OpCode::LessJumpIfFalsePop, { OpCode::Less, OpCode::JumpIfFalse, OpCode::Pop }, 3 },
+	// checking again costs less than the two dispatches fusing saves
+	{ OpCode::LessJumpIfFalsePop, { OpCode::LessUnchecked, OpCode::JumpIfFalse, OpCode::Pop }, 3 },
+	{ OpCode::GetLocalGetLocal, { OpCode::GetLocal, OpCode::GetLocal }, 2 },
+	{ OpCode::GetLocalConstant, { OpCode::GetLocal, OpCode::Constant }, 2 },
+	{ OpCode::GetLocalGetProperty, { OpCode::GetLocal, OpCode::GetProperty }, 2 },
+	{ OpCode::SetLocalPop, { OpCode::SetLocal, OpCode::Pop }, 2 },
+	{ OpCode::PopLoop, { OpCode::Pop, OpCode::Loop }, 2 },
+	{ OpCode::JumpIfFalsePop, { OpCode::JumpIfFalse, OpCode::Pop }, 2 },
+};
+
+// one past the sequence of super starting at offset, if it does
+[[nodiscard]] std::optional<size_t> match(const Chunk& chunk, size_t offset,
+	const Superinstruction& super)
+{
+	for (size_t i = 0; i < super.length; i++)
+	{
+		if (offset >= chunk.count() || static_cast<OpCode>(chunk.code[offset]) != super.sequence[i])
+			return std::nullopt;
+		offset += instruction_length(chunk, offset);
+	}
+	return offset;
+}
+
+}
+
+void fuse_superinstructions(Chunk& chunk)
+{
+	for (size_t offset = 0; offset < chunk.count();)
+	{
+		auto next = offset + instruction_length(chunk, offset);
+		for (const auto& super : SUPERINSTRUCTIONS)
+		{
+			auto end = match(chunk, offset, super);
+			if (end.has_value())
+			{
+				chunk.code[offset] = static_cast<uint8_t>(super.fused);
+				next = end.value();
+				break;
+			}
+		}
+		offset = next;
+	}
+}
+
 std::ostream& operator<<(std::ostream& out, OpCode code)
 {
 	out << nameof(code);
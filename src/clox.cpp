@@ -1,9 +1,13 @@
-﻿#include <filesystem>
+﻿#include <charconv>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <vector>
 
+#include "bytecode_cache.h"
 #include "vm.h"
 
 namespace fs = std::filesystem;
@@ -13,14 +17,83 @@ int run_file(Clox::VM& vm, fs::path path);
 
 int main(int argc, char* argv[])
 {
-	Clox::VM vm;
-	if (argc == 1)
+	Clox::Options options;
+	std::vector<std::string_view> paths;
+	for (auto i = 1; i < argc; i++)
+	{
+		std::string_view arg = argv[i];
+		if (arg == "--jit")
+			options.jit = true;
+		else if (arg == "--registers")
+			options.registers = true;
+		else if (arg == "-O")
+			options.optimize = true;
+		else if (arg == "--dump-ir")
+		{
+			options.optimize = true;
+			options.dump_ir = true;
+		} else if (arg == "--no-peephole")
+			options.peephole = false;
+		else if (arg == "--no-inline")
+			options.inline_calls = false;
+		else if (arg == "--lazy")
+			options.lazy = true;
+		else if (arg == "--no-lines")
+			options.line_info = false;
+		else if (arg == "--cache")
+			options.bytecode_cache = true;
+		else if (arg.substr(0, 16) == "--jit-threshold=")
+		{
+			auto value = arg.substr(16);
+			auto [end, error] = std::from_chars(value.data(), value.data() + value.size(),
+				options.jit_threshold);
+			if (error != std::errc() || end != value.data() + value.size() || options.jit_threshold == 0)
+			{
+				std::cerr << "Invalid threshold " << value << '\n';
+				return 64;
+			}
+			options.jit = true;
+		} else if (arg.substr(0, 18) == "--compile-threads=")
+		{
+			auto value = arg.substr(18);
+			auto [end, error] = std::from_chars(value.data(), value.data() + value.size(),
+				options.compile_threads);
+			if (error != std::errc() || end != value.data() + value.size() || options.compile_threads == 0)
+			{
+				std::cerr << "Invalid thread count " << value << '\n';
+				return 64;
+			}
+		} else if (arg.substr(0, 13) == "--max-frames=")
+		{
+			auto value = arg.substr(13);
+			auto [end, error] = std::from_chars(value.data(), value.data() + value.size(),
+				options.max_frames);
+			if (error != std::errc() || end != value.data() + value.size() || options.max_frames == 0)
+			{
+				std::cerr << "Invalid frame limit " << value << '\n';
+				return 64;
+			}
+		} else if (arg.substr(0, 1) == "-")
+		{
+			std::cerr << "Unknown option " << arg << '\n';
+			return 64;
+		} else
+			paths.push_back(arg);
+	}
+
+	// a cached script would skip the compiler and print no IR, and a cache
+	// holds every function compiled, which --lazy leaves for later
+	if (options.dump_ir || options.lazy)
+		options.bytecode_cache = false;
+
+	Clox::VM vm(options);
+	if (paths.empty())
 		repl(vm);
-	else if (argc == 2)
-		return run_file(vm, argv[1]);
+	else if (paths.size() == 1)
+		return run_file(vm, paths.front());
 	else
 	{
-		std::cerr << "Usage: clox [path]\n";
+		std::cerr << "Usage: clox [--jit] [--jit-threshold=n] [--registers] [-O] [--dump-ir] [--no-peephole] [--no-inline] [--lazy] [--compile-threads=n] [--no-lines] [--cache] [--max-frames=n] [path]\n";
 		return 64;
 	}
 	return 0;
@@ -44,21 +117,19 @@ void repl(Clox::VM& vm)
 
 int run_file(Clox::VM& vm, fs::path path)
 {
-	std::string source;
-
-	try
-	{
-		std::ifstream file(path);
-		std::stringstream buffer;
-		buffer << file.rdbuf();
-		source = buffer.str();
-	} catch (...)
+	// streams report failure through their state, they do not throw by default
+	std::ifstream file(path);
+	if (!file)
 	{
 		std::cout << "Could not open or read file " << path << ".\n";
 		return 74;
 	}
+	std::stringstream buffer;
+	buffer << file.rdbuf();
+	auto source = buffer.str();
 
-	auto result = vm.interpret(source);
+	auto result = vm.options.bytecode_cache ?
+		vm.interpret(source, Clox::cache_path(path)) : vm.interpret(source);
 	switch (result)
 	{
 		case Clox::InterpretResult::CompileError:
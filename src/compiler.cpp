@@ -1,9 +1,19 @@
 #include "compiler.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
 
 #include "obj_string.h"
+#include "optimizer.h"
+#include "peephole.h"
+#include "verifier.h"
 #include "vm.h"
 
 #ifdef _DEBUG
@@ -35,17 +45,67 @@ void error_at(Parser& parser, const Token& token, std::string_view message)
 {
 	if (parser.panic_mode) return;
 	parser.panic_mode = true;
-	std::cerr << "[line " << token.line << "] Error";
+	auto& out = parser.errors != nullptr ? *parser.errors : std::cerr;
+	out << "[line " << token.line << "] Error";
 	if (token.type == TokenType::Eof)
-		std::cerr << " at end";
+		out << " at end";
 	else if (token.type == TokenType::Error)
 	{
 	} else
-		std::cerr << " at " << token.text;
-	std::cerr << ": " << message << '\n';
+		out << " at " << token.text;
+	out << ": " << message << '\n';
 	parser.had_error = true;
 }
 
+void prepare_function(ObjFunction& function, const Options& options)
+{
+	if (options.registers)
+		function.register_chunk = register_compile(function);
+	if (function.register_chunk != nullptr)
+		function.max_depth = std::max(function.max_depth, function.register_chunk->frame_size);
+#ifndef CLOX_NO_SUPERINSTRUCTIONS
+	// after verify() and register_compile(), which only know plain instructions
+	fuse_superinstructions(function.chunk);
+#endif // CLOX_NO_SUPERINSTRUCTIONS
+}
+
+// the most bytes of code a function inline_call() copies may have
+constexpr size_t INLINE_MAX_LENGTH = 32;
+
+// whether function is small and only does what the frame of its caller can
+[[nodiscard]] bool can_inline(const ObjFunction& function)
+{
+	const auto& chunk = function.chunk;
+	if (function.upvalue_count > 0 || chunk.count() > INLINE_MAX_LENGTH)
+		return false;
+	for (size_t offset = 0; offset < chunk.count(); offset += instruction_length(chunk, offset))
+	{
+		switch (unfused(static_cast<OpCode>(chunk.code[offset])))
+		{
+			case OpCode::GetUpvalue:
+			case OpCode::SetUpvalue:
+			case OpCode::GetSuper:
+			case OpCode::SuperInvoke:
+			case OpCode::Closure:
+			case OpCode::CloseUpvalue:
+			case OpCode::Class:
+			case OpCode::Inherit:
+			case OpCode::Method:
+			case OpCode::FrameClosure:
+			case OpCode::GetSuperLong:
+			case OpCode::SuperInvokeLong:
+			case OpCode::ClosureLong:
+			case OpCode::ClassLong:
+			case OpCode::MethodLong:
+			case OpCode::FrameClosureLong:
+				return false;
+			default:
+				break;
+		}
+	}
+	return true;
+}
+
 [[nodiscard]] Token synthetic_token(std::string_view text)
 {
 	auto token = Token();
@@ -116,16 +176,108 @@ void Parser::synchronize()
 
 ObjFunction* Compilation::compile(std::string_view source)
 {
+	// REPL lines do not outlive their interpret()
+	if (vm.options.lazy)
+		source = vm.sources.emplace_back(source);
 	parser = std::make_unique<Parser>(source);
 	init_compiler(FunctionType::Script);
 	parser->advance();
 	while (!parser->match(TokenType::Eof))
 		declaration();
+	if (!split.empty())
+		compile_parallel();
 
 	auto [function, done] = end_compiler();
 	return parser->had_error ? nullptr : function;
 }
 
+bool Compilation::compile_lazy(ObjFunction& function, std::ostream* errors)
+{
+	parser = std::make_unique<Parser>(function.lazy_source);
+	parser->scanner.line = function.lazy_line;
+	parser->errors = errors;
+	auto type = FunctionType::Function;
+	if (function.lazy_method)
+	{
+		// a class declared in the script without a superclass, see lazy_function()
+		type = function.name->text() == "init" ? FunctionType::Initializer : FunctionType::Method;
+		current_class = std::make_unique<ClassCompiler>();
+	}
+	function.arity = 0;
+	init_compiler(type, &function);
+	parser->advance();
+	function_body();
+	static_cast<void>(end_compiler());
+	current_class.reset();
+
+	if (parser->had_error)
+	{
+		function.chunk = Chunk();
+		function.register_chunk.reset();
+		return false;
+	}
+	function.lazy_source = std::string_view();
+	return true;
+}
+
+// Compiles the bodies Options::compile_threads split from the script, each
+// thread taking the next one left with a Compilation of its own, then
+// reports their errors in the order the script declares them. No thread
+// may collect while the others hold objects nothing roots yet, so each
+// counts what it allocates apart, a count that can wrap below zero if it
+// frees more than that, and the sum goes to the GC once all are done.
+void Compilation::compile_parallel()
+{
+	// the IR each would print interleaves
+	auto count = vm.options.dump_ir ? 1 : std::min(vm.options.compile_threads, split.size());
+	std::mutex mutex;
+	std::atomic<size_t> next = 0;
+	std::vector<std::string> errors(split.size());
+	std::vector<uint8_t> failed(split.size(), false); // one element a thread, unlike vector<bool>
+	std::vector<size_t> allocated(count, 0);
+	auto work = [&](size_t& bytes) {
+		AllocBase::detach(&bytes);
+		Compilation worker(vm);
+		worker.shared = &mutex;
+		for (auto i = next++; i < split.size(); i = next++)
+		{
+			std::ostringstream out;
+			failed[i] = !worker.compile_lazy(*split[i], &out);
+			errors[i] = out.str();
+		}
+		AllocBase::detach(nullptr);
+	};
+
+	std::vector<std::thread> threads;
+	threads.reserve(count - 1);
+	for (size_t i = 1; i < count; i++)
+		threads.emplace_back(work, std::ref(allocated[i]));
+	work(allocated[0]);
+	for (auto& thread : threads)
+		thread.join();
+
+	for (auto bytes : allocated)
+		vm.gc.bytes_allocated += bytes;
+	for (size_t i = 0; i < split.size(); i++)
+	{
+		std::cerr << errors[i];
+		if (failed[i])
+			parser->had_error = true;
+	}
+	split.clear();
+}
+
+std::unique_lock<std::mutex> Compilation::lock_vm()const
+{
+	return shared != nullptr ? std::unique_lock(*shared) : std::unique_lock<std::mutex>();
+}
+
+ObjString* Compilation::intern(std::string_view text)
+{
+	auto lock = lock_vm();
+	return create_obj_string(text, vm);
+}
+
 void Compilation::expression()
 {
 	parse_precedence(Precedence::Assignment);
@@ -142,8 +294,33 @@ void Compilation::and_([[maybe_unused]] bool can_assign)
 void Compilation::binary([[maybe_unused]] bool can_assign)
 {
 	auto op = parser->previous.type;
+	auto left = current->known;
 	const auto& rule = get_rule(op);
 	parse_precedence(rule.precedence + 1);
+	auto right = current->known;
+
+	if (left.value.has_value() && right.value.has_value())
+	{
+		auto folded = fold(op, left.value.value(), right.value.value());
+		if (folded.has_value())
+		{
+			truncate(left.start);
+			emit_folded(left.start, folded.value());
+			return;
+		}
+	}
+	// x * 1, x / 1 and x - 0 are x for any number, even NaN and -0, unlike x + 0
+	if (left.number && right.value.has_value() && right.value->is_number())
+	{
+		auto operand = right.value->as<double>();
+		if ((operand == 1 && (op == TokenType::Star || op == TokenType::Slash)) ||
+			(operand == 0 && !std::signbit(operand) && op == TokenType::Minus))
+		{
+			truncate(right.start);
+			current->known = left;
+			return;
+		}
+	}
 
 	switch (op)
 	{
@@ -160,11 +337,29 @@ void Compilation::binary([[maybe_unused]] bool can_assign)
 		default:
 			break;
 	}
+	// arithmetic leaves a number or raises an error, Add only when given two numbers
+	auto number = op == TokenType::Minus || op == TokenType::Star || op == TokenType::Slash ||
+		(op == TokenType::Plus && left.number && right.number);
+	current->known = KnownExpression{ left.start, current_chunk().count(), std::nullopt, number };
 }
 
 void Compilation::call([[maybe_unused]] bool can_assign)
 {
+	// a frame-bound callee needs the frame a tail call would drop below it
+	const auto& chunk = current_chunk();
+	auto start = current->known.start;
+	const Local* callee = nullptr;
+	if (current->known.end == chunk.count() && current->known.end == start + 2 &&
+		static_cast<OpCode>(chunk.code[start]) == OpCode::GetLocal &&
+		current->locals.at(chunk.code[start + 1]).frame_bound)
+		callee = &current->locals.at(chunk.code[start + 1]);
+
 	auto arg_count = argument_list();
+	if (callee != nullptr && callee->function != nullptr && vm.options.inline_calls &&
+		arg_count == callee->function->arity && inline_call(*callee->function, start))
+		return;
+	if (callee == nullptr)
+		current->last_call = current_chunk().count();
 	emit_byte(OpCode::Call, arg_count);
 }
 
@@ -176,14 +371,22 @@ void Compilation::dot(bool can_assign)
 	if (can_assign && parser->match(TokenType::Equal))
 	{
 		expression();
-		emit_byte(OpCode::SetProperty, name);
+		auto offset = current_chunk().count();
+		emit_constant_operand(OpCode::SetProperty, name);
+		emit_cache(offset);
 	} else if (parser->match(TokenType::LeftParen))
 	{
 		auto arg_count = argument_list();
-		emit_byte(OpCode::Invoke, name, arg_count);
+		auto offset = current_chunk().count();
+		current->last_call = offset;
+		emit_constant_operand(OpCode::Invoke, name);
+		emit_byte(arg_count);
+		emit_cache(offset);
 	} else
 	{
-		emit_byte(OpCode::GetProperty, name);
+		auto offset = current_chunk().count();
+		emit_constant_operand(OpCode::GetProperty, name);
+		emit_cache(offset);
 	}
 }
 
@@ -195,11 +398,12 @@ void Compilation::grouping([[maybe_unused]] bool can_assign)
 
 void Compilation::literal([[maybe_unused]] bool can_assign)
 {
+	auto start = current_chunk().count();
 	switch (parser->previous.type)
 	{
-		case TokenType::False: emit_byte(OpCode::False); break;
-		case TokenType::Nil: emit_byte(OpCode::Nil); break;
-		case TokenType::True: emit_byte(OpCode::True); break;
+		case TokenType::False: emit_folded(start, false); break;
+		case TokenType::Nil: emit_folded(start, Value()); break;
+		case TokenType::True: emit_folded(start, true); break;
 		default:
 			break;
 	}
@@ -208,7 +412,7 @@ void Compilation::literal([[maybe_unused]] bool can_assign)
 void Compilation::number([[maybe_unused]] bool can_assign)
 {
 	auto value = std::strtod(parser->previous.text.data(), nullptr);
-	emit_constant(value);
+	emit_folded(current_chunk().count(), value);
 }
 
 void Compilation::or_([[maybe_unused]] bool can_assign)
@@ -227,13 +431,29 @@ void Compilation::string([[maybe_unused]] bool can_assign)
 {
 	const auto& text = parser->previous.text;
 	auto str = text.substr(1, text.size() - 2);
-	emit_constant(create_obj_string(str, vm));
+	emit_folded(current_chunk().count(), intern(str));
 }
 
 void Compilation::unary([[maybe_unused]] bool can_assign)
 {
 	auto op = parser->previous.type;
 	parse_precedence(Precedence::Unary);
+	auto operand = current->known;
+
+	if (operand.value.has_value())
+	{
+		const auto& value = operand.value.value();
+		if (op == TokenType::Bang || (op == TokenType::Minus && value.is_number()))
+		{
+			truncate(operand.start);
+			if (op == TokenType::Bang)
+				emit_folded(operand.start, is_falsey(value));
+			else
+				emit_folded(operand.start, -value.as<double>());
+			return;
+		}
+	}
+
 	switch (op)
 	{
 		case TokenType::Bang: emit_byte(OpCode::Not); break;
@@ -241,6 +461,8 @@ void Compilation::unary([[maybe_unused]] bool can_assign)
 		default:
 			break;
 	}
+	current->known = KnownExpression{ operand.start, current_chunk().count(), std::nullopt,
+		op == TokenType::Minus };
 }
 
 void Compilation::variable(bool can_assign)
@@ -264,11 +486,12 @@ void Compilation::super_([[maybe_unused]] bool can_assign)
 	{
 		auto arg_count = argument_list();
 		named_variable(synthetic_token("super"), false);
-		emit_byte(OpCode::SuperInvoke, name, arg_count);
+		emit_constant_operand(OpCode::SuperInvoke, name);
+		emit_byte(arg_count);
 	} else
 	{
 		named_variable(synthetic_token("super"), false);
-		emit_byte(OpCode::GetSuper, name);
+		emit_constant_operand(OpCode::GetSuper, name);
 	}
 }
 
@@ -379,11 +602,11 @@ void Compilation::if_statement()
 	auto else_jump = emit_jump(OpCode::Jump);
 
 	patch_jump(then_jump);
+	emit_byte(OpCode::Pop);
 
 	if (parser->match(TokenType::Else))
 		statement();
 	patch_jump(else_jump);
-	emit_byte(OpCode::Pop);
 }
 
 void Compilation::print_statement()
@@ -406,6 +629,19 @@ void Compilation::return_statement()
 			error(*parser, "Cannot return a value from an initializer");
 		expression();
 		parser->consume(TokenType::Semicolon, "Expect ';' after return value.");
+		// a call the value ends with is in tail position, the Return stays
+		// behind it for the jumps of and/or that skip the call
+		auto& chunk = current_chunk();
+		auto call = current->last_call;
+		if (call.has_value() && call.value() + instruction_length(chunk, call.value()) == chunk.count())
+		{
+			// InvokeLong has no tail form and stays as it is
+			auto op = static_cast<OpCode>(chunk.code[call.value()]);
+			if (op == OpCode::Call)
+				chunk.code[call.value()] = static_cast<uint8_t>(OpCode::TailCall);
+			else if (op == OpCode::Invoke)
+				chunk.code[call.value()] = static_cast<uint8_t>(OpCode::TailInvoke);
+		}
 		emit_byte(OpCode::Return);
 	}
 }
@@ -449,9 +685,10 @@ void Compilation::class_declaration()
 	auto class_name = parser->previous;
 	auto name_constant = identifier_constant(parser->previous);
 	declare_variable();
+	auto global = current->scope_depth > 0 ? 0 : global_slot(class_name);
 
-	emit_byte(OpCode::Class, name_constant);
-	define_variable(name_constant);
+	emit_constant_operand(OpCode::Class, name_constant);
+	define_variable(global);
 
 	auto class_compiler = std::make_unique<ClassCompiler>();
 	class_compiler->name = parser->previous;
@@ -492,7 +729,13 @@ void Compilation::fun_declaration()
 {
 	auto global = parse_variable("Expect function name.");
 	mark_initializied();
-	function(FunctionType::Function);
+	auto frame_bound = current->scope_depth > 0 && stays_in_frame(parser->previous);
+	auto& local = current->locals.at(current->local_count - 1);
+	if (frame_bound)
+		local.frame_bound = true;
+	auto compiled = function(FunctionType::Function, frame_bound);
+	if (frame_bound)
+		local.function = compiled;
 	define_variable(global);
 }
 
@@ -508,11 +751,34 @@ void Compilation::var_declaration()
 	define_variable(global);
 }
 
-void Compilation::function(FunctionType type)
+ObjFunction* Compilation::function(FunctionType type, bool frame_bound)
 {
+	// what the script declares outside any block or subclass can capture nothing
+	if ((vm.options.lazy || vm.options.compile_threads > 0) &&
+		current->type == FunctionType::Script && current->scope_depth == 0)
+		return lazy_function(type);
+
 	init_compiler(type);
-	begin_scope();
+	current->frame_bound = frame_bound;
+	function_body();
+	// the locals it can reach, all declared by now
+	if (frame_bound)
+		current->function->enclosing_slots = current->enclosing->function->slot_count;
 
+	auto [function, done] = end_compiler();
+	emit_constant_operand(frame_bound ? OpCode::FrameClosure : OpCode::Closure, make_constant(function));
+
+	for (size_t i = 0; i < function->upvalue_count; i++)
+	{
+		emit_byte(static_cast<uint8_t>(done->upvalues.at(i).is_local ? 1 : 0));
+		emit_byte(done->upvalues.at(i).index);
+	}
+	return function;
+}
+
+void Compilation::function_body()
+{
+	begin_scope();
 	parser->consume(TokenType::LeftParen, "Expect '(' after function name.");
 	if (!parser->check(TokenType::RightParen))
 	{
@@ -529,14 +795,109 @@ void Compilation::function(FunctionType type)
 
 	parser->consume(TokenType::LeftBrace, "Expect '{' before function body.");
 	block();
+}
 
-	auto [function, done] = end_compiler();
-	emit_byte(OpCode::Closure, make_constant(function));
+// Takes the parameters for the arity and passes over the body to the brace
+// closing it, leaving the rest to compile_lazy(). Errors it would find there
+// are reported on the first call, if there is one.
+ObjFunction* Compilation::lazy_function(FunctionType type)
+{
+	auto function = create_obj<ObjFunction>(vm.gc);
+	vm.push(function);
+	function->name = create_obj_string(parser->previous.text, vm);
+	function->lazy_method = type != FunctionType::Function;
+	function->lazy_line = parser->current.line;
+	auto start = parser->current.text.data();
 
-	for (size_t i = 0; i < function->upvalue_count; i++)
+	parser->consume(TokenType::LeftParen, "Expect '(' after function name.");
+	if (!parser->check(TokenType::RightParen))
 	{
-		emit_byte(static_cast<uint8_t>(done->upvalues.at(i).is_local ? 1 : 0));
-		emit_byte(done->upvalues.at(i).index);
+		do
+		{
+			function->arity++;
+			if (function->arity > 255)
+				error_at_current(*parser, "Cannot have more than 255 parameters.");
+			parser->consume(TokenType::Identifier, "Expect parameter name.");
+		} while (parser->match(TokenType::Comma));
+	}
+	parser->consume(TokenType::RightParen, "Expect ')' after parameters.");
+	parser->consume(TokenType::LeftBrace, "Expect '{' before function body.");
+	size_t depth = 0; // of braces opened in the body
+	while (!parser->check(TokenType::Eof) && !(depth == 0 && parser->check(TokenType::RightBrace)))
+	{
+		if (parser->check(TokenType::LeftBrace))
+			depth++;
+		else if (parser->check(TokenType::RightBrace))
+			depth--;
+		parser->advance();
+	}
+	parser->consume(TokenType::RightBrace, "Expect '}' after block.");
+	auto end = parser->previous.text.data() + parser->previous.text.size();
+	function->lazy_source = std::string_view(start, static_cast<size_t>(end - start));
+	// unless passing over it reported an error, which compiling it would repeat
+	if (!vm.options.lazy && !parser->panic_mode)
+		split.push_back(function);
+
+	emit_constant_operand(OpCode::Closure, make_constant(function));
+	vm.pop();
+	return function;
+}
+
+// Whether the local function named name, whose parameters come next, is
+// only ever called by name in the rest of the block declaring it, and not
+// from a function or class body there. Each call then runs right above the
+// declaring frame, which outlives it. Any other use of the name, even one a
+// later declaration shadowing it would explain, could let it escape.
+bool Compilation::stays_in_frame(const Token& name)const
+{
+	auto scanner = parser->scanner;
+	auto previous = parser->current;
+	size_t depth = 0; // of braces opened after the name
+	std::optional<size_t> body; // depth the function or class body being passed over began at
+	auto declaring = true; // a fun or class before its body, this function's own first
+	while (true)
+	{
+		auto token = scanner.scan_token();
+		switch (token.type)
+		{
+			case TokenType::Eof:
+			case TokenType::Error:
+				return false;
+			case TokenType::Fun:
+			case TokenType::Class:
+				if (!body.has_value())
+					declaring = true;
+				break;
+			case TokenType::LeftBrace:
+				if (declaring && !body.has_value())
+				{
+					body = depth;
+					declaring = false;
+				}
+				depth++;
+				break;
+			case TokenType::RightBrace:
+				// the end of the declaring block
+				if (depth == 0)
+					return true;
+				if (body == --depth)
+					body.reset();
+				break;
+			case TokenType::Identifier:
+			{
+				if (token.text != name.text || previous.type == TokenType::Dot)
+					break;
+				if (declaring || body.has_value())
+					return false;
+				auto next = scanner;
+				if (next.scan_token().type != TokenType::LeftParen)
+					return false;
+				break;
+			}
+			default:
+				break;
+		}
+		previous = token;
 	}
 }
 
@@ -548,7 +909,7 @@ void Compilation::method()
 	if (parser->previous.text == "init")
 		type = FunctionType::Initializer;
 	function(type);
-	emit_byte(OpCode::Method, constant);
+	emit_constant_operand(OpCode::Method, constant);
 }
 
 uint8_t Compilation::argument_list()
@@ -586,7 +947,7 @@ void Compilation::declare_variable()
 	add_local(name);
 }
 
-void Compilation::define_variable(uint8_t global) const
+void Compilation::define_variable(size_t global) const
 {
 	if (current->scope_depth > 0)
 	{
@@ -594,12 +955,58 @@ void Compilation::define_variable(uint8_t global) const
 		return;
 	}
 
-	emit_byte(OpCode::DefineGlobal, global);
+	emit_global(OpCode::DefineGlobal, global);
+}
+
+std::optional<size_t> ConstantIndex::find(const Value& value)const
+{
+	if (value.is_number())
+	{
+		auto num = value.as<double>();
+		uint64_t bits = 0;
+		std::memcpy(&bits, &num, sizeof(bits));
+		auto found = numbers.find(bits);
+		if (found != numbers.end())
+			return found->second;
+	} else if (value.is_obj_type<ObjString>())
+	{
+		auto found = strings.find(value.as<Obj*>());
+		if (found != strings.end())
+			return found->second;
+	}
+	return std::nullopt;
+}
+
+void ConstantIndex::add(const Value& value, size_t index)
+{
+	if (value.is_number())
+	{
+		auto num = value.as<double>();
+		uint64_t bits = 0;
+		std::memcpy(&bits, &num, sizeof(bits));
+		numbers.emplace(bits, index);
+	} else if (value.is_obj_type<ObjString>())
+		strings.emplace(value.as<Obj*>(), index);
 }
 
-uint8_t Compilation::identifier_constant(const Token& name)
+size_t Compilation::identifier_constant(const Token& name)
 {
-	return make_constant(create_obj_string(name.text, vm));
+	return make_constant(intern(name.text));
+}
+
+size_t Compilation::global_slot(const Token& name)
+{
+	size_t slot = 0;
+	{
+		auto lock = lock_vm();
+		slot = vm.global_slot(create_obj_string(name.text, vm));
+	}
+	if (slot > LONG_OPERAND_MAX)
+	{
+		error(*parser, "Too many global variables.");
+		return 0;
+	}
+	return slot;
 }
 
 void Compilation::named_variable(const Token& name, bool can_assign)
@@ -612,16 +1019,31 @@ void Compilation::named_variable(const Token& name, bool can_assign)
 		set_op = OpCode::SetLocal;
 	} else
 	{
-		arg = resolve_upvalue(current, name);
+		if (current->frame_bound)
+			arg = resolve_local(current->enclosing, name);
 		if (arg.has_value())
 		{
-			get_op = OpCode::GetUpvalue;
-			set_op = OpCode::SetUpvalue;
+			// the declaring frame lies right below, its slot is used in place
+			get_op = OpCode::GetEnclosing;
+			set_op = OpCode::SetEnclosing;
 		} else
 		{
-			arg = identifier_constant(name);
-			get_op = OpCode::GetGlobal;
-			set_op = OpCode::SetGlobal;
+			arg = resolve_upvalue(current, name);
+			if (arg.has_value())
+			{
+				get_op = OpCode::GetUpvalue;
+				set_op = OpCode::SetUpvalue;
+			} else
+			{
+				auto global = global_slot(name);
+				if (can_assign && parser->match(TokenType::Equal))
+				{
+					expression();
+					emit_global(OpCode::SetGlobal, global);
+				} else
+					emit_global(OpCode::GetGlobal, global);
+				return;
+			}
 		}
 	}
 	if (can_assign && parser->match(TokenType::Equal))
@@ -634,25 +1056,163 @@ void Compilation::named_variable(const Token& name, bool can_assign)
 	}
 }
 
+// Copies the code of callee, a frame-bound function called with as many
+// arguments as it takes, in place of the Call, keeping its lines for errors.
+// The callee value sits at start, its slots become those from there up, and
+// the locals of the frame it ran above are those of this one. False, with
+// nothing emitted, when it is too large or does what only a frame of its
+// own could, or its slots would not fit.
+bool Compilation::inline_call(const ObjFunction& callee, size_t start)
+{
+	if (!can_inline(callee))
+		return false;
+	const auto& code = callee.chunk;
+	auto depths = stack_depths(code, code.count(), static_cast<int>(callee.arity) + 1);
+	auto base_depth = stack_depths(current_chunk(), start, static_cast<int>(current->function->arity) + 1)[start];
+	if (base_depth < 0)
+		return false;
+	auto base = static_cast<size_t>(base_depth);
+	auto deepest = std::max(static_cast<size_t>(*std::max_element(depths.begin(), depths.end())), callee.slot_count);
+	if (base + deepest > UINT8_COUNT)
+		return false;
+	current->function->slot_count = std::max(current->function->slot_count, base + callee.slot_count);
+
+	auto call_line = parser->previous.line;
+	std::vector<size_t> moved(code.count(), 0); // offset in this chunk of each of the callee's
+	std::vector<std::pair<size_t, size_t>> jumps; // target in the callee, operand here
+	std::vector<size_t> exits; // jumps to the code after the callee's
+	for (size_t offset = 0; offset < code.count(); offset += instruction_length(code, offset))
+	{
+		moved[offset] = current_chunk().count();
+		for (const auto& [target, operand] : jumps)
+		{
+			if (target == offset)
+				patch_jump(operand);
+		}
+		// code no path reaches, which the peephole pass did not run to remove
+		if (depths[offset] < 0)
+			continue;
+
+		auto line = code.lines.line_at(offset);
+		parser->previous.line = line > 0 ? line : call_line;
+		auto op = unfused(static_cast<OpCode>(code.code[offset]));
+		auto operand = [&](size_t index) { return code.code[offset + 1 + index]; };
+		auto long_operand = [&](size_t index)
+		{
+			return static_cast<size_t>(operand(index) << 16 | operand(index + 1) << 8 | operand(index + 2));
+		};
+		auto name = [&](size_t constant)
+		{
+			return make_constant(Value(code.constants.values[constant]));
+		};
+		switch (op)
+		{
+			case OpCode::GetLocal:
+			case OpCode::SetLocal:
+				emit_byte(op, static_cast<uint8_t>(base + operand(0)));
+				break;
+			case OpCode::GetEnclosing:
+				emit_byte(OpCode::GetLocal, operand(0));
+				break;
+			case OpCode::SetEnclosing:
+				emit_byte(OpCode::SetLocal, operand(0));
+				break;
+			case OpCode::Constant:
+				emit_constant_operand(op, name(operand(0)));
+				break;
+			case OpCode::ConstantLong:
+				emit_constant_operand(OpCode::Constant, name(long_operand(0)));
+				break;
+			case OpCode::GetGlobal:
+			case OpCode::DefineGlobal:
+			case OpCode::SetGlobal:
+				emit_global(op, static_cast<size_t>(operand(0) << 8 | operand(1)));
+				break;
+			case OpCode::GetGlobalLong:
+				emit_global(OpCode::GetGlobal, long_operand(0));
+				break;
+			case OpCode::DefineGlobalLong:
+				emit_global(OpCode::DefineGlobal, long_operand(0));
+				break;
+			case OpCode::SetGlobalLong:
+				emit_global(OpCode::SetGlobal, long_operand(0));
+				break;
+			case OpCode::GetProperty:
+			case OpCode::SetProperty:
+			case OpCode::GetPropertyLong:
+			case OpCode::SetPropertyLong:
+			{
+				auto is_long = op == OpCode::GetPropertyLong || op == OpCode::SetPropertyLong;
+				auto get = op == OpCode::GetProperty || op == OpCode::GetPropertyLong;
+				auto at = current_chunk().count();
+				emit_constant_operand(get ? OpCode::GetProperty : OpCode::SetProperty,
+					name(is_long ? long_operand(0) : operand(0)));
+				emit_cache(at);
+				break;
+			}
+			// the callee's Return follows a call in tail position, and ends it here
+			case OpCode::Invoke:
+			case OpCode::TailInvoke:
+			case OpCode::InvokeLong:
+			{
+				auto is_long = op == OpCode::InvokeLong;
+				auto at = current_chunk().count();
+				emit_constant_operand(OpCode::Invoke, name(is_long ? long_operand(0) : operand(0)));
+				emit_byte(operand(is_long ? 3 : 1));
+				emit_cache(at);
+				break;
+			}
+			case OpCode::Call:
+			case OpCode::TailCall:
+				emit_byte(OpCode::Call, operand(0));
+				break;
+			case OpCode::Jump:
+			case OpCode::JumpIfFalse:
+				jumps.emplace_back(offset + 3 + (operand(0) << 8 | operand(1)), emit_jump(OpCode{ op }));
+				break;
+			case OpCode::Loop:
+				emit_loop(moved[offset + 3 - (operand(0) << 8 | operand(1))]);
+				break;
+			// the result takes the callee value's place
+			case OpCode::Return:
+				emit_byte(OpCode::PopUnder, static_cast<uint8_t>(depths[offset] - 1));
+				if (offset + 1 < code.count())
+					exits.push_back(emit_jump(OpCode::Jump));
+				break;
+			default:
+				emit_byte(op);
+				break;
+		}
+	}
+	for (auto exit : exits)
+		patch_jump(exit);
+	parser->previous.line = call_line;
+	return true;
+}
+
 void Compilation::parse_precedence(Precedence precedence)
 {
 	parser->advance();
+	auto start = current_chunk().count();
 
 	auto prefix_rule = get_rule(parser->previous.type).prefix;
 	if (prefix_rule == nullptr)
 	{
 		error(*parser, "Expect expression.");
+		settle_known(start);
 		return;
 	}
 
 	bool can_assign = precedence <= Precedence::Assignment;
 	(this->*prefix_rule)(can_assign);
+	settle_known(start);
 
 	while (precedence <= get_rule(parser->current.type).precedence)
 	{
 		parser->advance();
 		auto infix_rule = get_rule(parser->previous.type).infix;
 		(this->*infix_rule)(can_assign);
+		settle_known(start);
 
 		if (can_assign && parser->match(TokenType::Equal))
 		{
@@ -662,28 +1222,94 @@ void Compilation::parse_precedence(Precedence precedence)
 	}
 }
 
-uint8_t Compilation::parse_variable(std::string_view error)
+void Compilation::settle_known(size_t start)
+{
+	// a rule that learned nothing leaves what an operand or an earlier
+	// expression set, which does not span the code from start
+	auto end = current_chunk().count();
+	if (current->known.start != start || current->known.end != end)
+		current->known = KnownExpression{ start, end, std::nullopt, false };
+}
+
+std::optional<Value> Compilation::fold(TokenType op, const Value& left, const Value& right)
+{
+	// only what VM::run() would compute, operands it raises an error on are left to it
+	if (op == TokenType::EqualEqual)
+		return left == right;
+	if (op == TokenType::BangEqual)
+		return left != right;
+	if (op == TokenType::Plus && left.is_obj_type<ObjString>() && right.is_obj_type<ObjString>())
+	{
+		auto lock = lock_vm();
+		return create_obj_string(*left.as_obj<ObjString>() + *right.as_obj<ObjString>(), vm);
+	}
+	if (!left.is_number() || !right.is_number())
+		return std::nullopt;
+
+	auto a = left.as<double>();
+	auto b = right.as<double>();
+	switch (op)
+	{
+		case TokenType::Greater: return a > b;
+		case TokenType::GreaterEqual: return !(a < b);
+		case TokenType::Less: return a < b;
+		case TokenType::LessEqual: return !(a > b);
+		case TokenType::Plus: return a + b;
+		case TokenType::Minus: return a - b;
+		case TokenType::Star: return a * b;
+		case TokenType::Slash: return a / b;
+		default:
+			return std::nullopt;
+	}
+}
+
+void Compilation::emit_folded(size_t start, const Value& value)
+{
+	if (value.is_nil())
+		emit_byte(OpCode::Nil);
+	else if (value.is_bool())
+		emit_byte(value.as<bool>() ? OpCode::True : OpCode::False);
+	else
+		emit_constant(value);
+	current->known = KnownExpression{ start, current_chunk().count(), value, value.is_number() };
+}
+
+void Compilation::truncate(size_t offset)const
+{
+	auto& chunk = current_chunk();
+	chunk.code.resize(offset);
+	chunk.lines.truncate(offset);
+}
+
+size_t Compilation::parse_variable(std::string_view error)
 {
 	parser->consume(TokenType::Identifier, error);
 
 	declare_variable();
 	if (current->scope_depth > 0) return 0;
 
-	return identifier_constant(parser->previous);
+	return global_slot(parser->previous);
 }
 
-void Compilation::init_compiler(FunctionType type)
+void Compilation::init_compiler(FunctionType type, ObjFunction* function)
 {
 	auto compiler = std::make_unique<Compiler>();
 	compiler->enclosing = std::move(current);
 	current = std::move(compiler);
-	current->function = create_obj<ObjFunction>(vm.gc);
+	auto created = function == nullptr;
+	if (created)
+	{
+		auto lock = lock_vm();
+		function = create_obj<ObjFunction>(vm.gc);
+	}
+	current->function = function;
 	current->type = type;
 
-	if (type != FunctionType::Script)
-		current->function->name = create_obj_string(parser->previous.text, vm);
+	if (type != FunctionType::Script && created)
+		current->function->name = intern(parser->previous.text);
 
 	auto& local = current->locals.at(current->local_count++);
+	current->function->slot_count = current->local_count;
 	local.depth = 0;
 	local.is_captured = false;
 	if (type != FunctionType::Function)
@@ -697,12 +1323,44 @@ auto Compilation::end_compiler()->std::pair<ObjFunction*, std::unique_ptr<Compil
 	emit_return();
 	auto function = current->function;
 
+	// before verify(), which then checks the rewritten code
+	if (!parser->had_error && vm.options.optimize)
+		optimize(*function, vm.options.dump_ir);
+	if (!parser->had_error && vm.options.peephole)
+		peephole(function->chunk);
+	if (!parser->had_error)
+	{
+		function->max_depth = std::max(function->slot_count,
+			max_stack_depth(function->chunk, static_cast<int>(function->arity) + 1));
+		size_t globals = 0;
+		{
+			auto lock = lock_vm();
+			globals = vm.globals.count();
+		}
+		auto failure = verify(*function, globals);
+		if (failure.has_value())
+			error(*parser, failure.value());
+	}
+	if (!parser->had_error)
+		prepare_function(*function, vm.options);
+
 #ifdef DEBUG_PRINT_CODE
 	if (!parser->had_error)
+	{
 		disassemble_chunk(current_chunk(),
 			function->name == nullptr ? "<script>" : function->name->text());
+		if (function->register_chunk != nullptr)
+			disassemble_registers(*function);
+	}
 #endif // DEBUG_PRINT_CODE
 
+	if (!vm.options.line_info)
+	{
+		function->chunk.lines.strip();
+		if (function->register_chunk != nullptr)
+			function->register_chunk->lines.strip();
+	}
+
 	// return ended compiler out to Compilation::function
 	// so that it has access to array<upvalue>
 	std::unique_ptr<Compiler> done = std::move(current);
@@ -718,9 +1376,12 @@ void Compilation::add_local(const Token& name)
 		return;
 	}
 	auto& local = current->locals.at(current->local_count++);
+	current->function->slot_count = std::max(current->function->slot_count, current->local_count);
 	local.name = name;
 	local.depth = -1;
 	local.is_captured = false;
+	local.frame_bound = false;
+	local.function = nullptr;
 }
 
 uint8_t Compilation::add_upvalue(const std::unique_ptr<Compiler>& compiler, uint8_t index, bool is_local)
@@ -802,6 +1463,46 @@ std::optional<uint8_t> Compilation::resolve_upvalue(const std::unique_ptr<Compil
 	return std::nullopt;
 }
 
+void Compilation::emit_cache(size_t offset)
+{
+	auto cache = current_chunk().add_cache(offset);
+	if (cache > UINT16_MAX)
+		error(*parser, "Too many property accesses in one chunk.");
+	emit_byte(static_cast<uint8_t>((cache >> 8) & 0xff));
+	emit_byte(static_cast<uint8_t>(cache & 0xff));
+}
+
+void Compilation::emit_global(OpCode op, size_t slot)const
+{
+	if (slot > UINT16_MAX)
+	{
+		emit_byte(long_form(op));
+		emit_long(slot);
+		return;
+	}
+	emit_byte(op);
+	emit_byte(static_cast<uint8_t>((slot >> 8) & 0xff));
+	emit_byte(static_cast<uint8_t>(slot & 0xff));
+}
+
+void Compilation::emit_constant_operand(OpCode op, size_t constant)const
+{
+	if (constant > UINT8_MAX)
+	{
+		emit_byte(long_form(op));
+		emit_long(constant);
+		return;
+	}
+	emit_byte(op, static_cast<uint8_t>(constant));
+}
+
+void Compilation::emit_long(size_t operand)const
+{
+	emit_byte(static_cast<uint8_t>((operand >> 16) & 0xff));
+	emit_byte(static_cast<uint8_t>((operand >> 8) & 0xff));
+	emit_byte(static_cast<uint8_t>(operand & 0xff));
+}
+
 void Compilation::emit_loop(size_t loop_start)
 {
 	emit_byte(OpCode::Loop);
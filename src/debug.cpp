@@ -1,8 +1,11 @@
 #include "debug.h"
 
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
+#include <numeric>
 
+#include "obj_string.h"
 #include "object.h"
 
 namespace Clox {
@@ -24,24 +27,75 @@ void disassemble_chunk(const Chunk& chunk, std::string_view name)
 	return offset + 2;
 }
 
-[[nodiscard]] size_t constant_instruction(std::string_view name, const Chunk& chunk, size_t offset)
+// a constant index or global slot of width bytes at offset
+[[nodiscard]] size_t read_operand(const Chunk& chunk, size_t offset, size_t width)
 {
-	auto constant = chunk.code.at(offset + 1);
+	size_t operand = 0;
+	for (size_t i = 0; i < width; i++)
+		operand = operand << 8 | chunk.code.at(offset + i);
+	return operand;
+}
+
+[[nodiscard]] size_t constant_instruction(std::string_view name, const Chunk& chunk, size_t offset,
+	size_t width = 1)
+{
+	auto constant = read_operand(chunk, offset + 1, width);
 	std::cout << std::setfill(' ') << std::left << std::setw(16) << name << ' ';
-	std::cout << std::setw(4) << static_cast<unsigned>(constant) << " '";
-	std::cout << chunk.constants.values.at(static_cast<size_t>(constant)) << '\n';
-	return offset + 2;
+	std::cout << std::setw(4) << constant << " '";
+	std::cout << chunk.constants.values.at(constant) << '\n';
+	return offset + 1 + width;
 }
 
-[[nodiscard]] size_t invoke_instruction(std::string_view name, const Chunk& chunk, size_t offset)
+[[nodiscard]] size_t invoke_instruction(std::string_view name, const Chunk& chunk, size_t offset,
+	size_t width = 1)
 {
-	auto constant = chunk.code.at(offset + 1);
-	auto arg_count = chunk.code.at(offset + 2);
+	auto constant = read_operand(chunk, offset + 1, width);
+	auto arg_count = chunk.code.at(offset + 1 + width);
 	std::cout << std::setfill(' ') << std::left << std::setw(16) << name << ' ';
 	std::cout << '(' << static_cast<unsigned>(arg_count) << " args) ";
-	std::cout << std::setw(4) << static_cast<unsigned>(constant) << " '";
-	std::cout << chunk.constants.values.at(static_cast<size_t>(constant)) << '\n';
-	return offset + 3;
+	std::cout << std::setw(4) << constant << " '";
+	std::cout << chunk.constants.values.at(constant) << '\n';
+	return offset + 2 + width;
+}
+
+[[nodiscard]] uint16_t read_cache(const Chunk& chunk, size_t offset)
+{
+	auto cache = static_cast<uint16_t>(chunk.code.at(offset) << 8);
+	cache |= chunk.code.at(offset + 1);
+	return cache;
+}
+
+[[nodiscard]] size_t global_instruction(std::string_view name, const Chunk& chunk, size_t offset,
+	size_t width = 2)
+{
+	auto slot = read_operand(chunk, offset + 1, width);
+	std::cout << std::setfill(' ') << std::left << std::setw(16) << name << ' ';
+	std::cout << "slot " << slot << '\n';
+	return offset + 1 + width;
+}
+
+[[nodiscard]] size_t property_instruction(std::string_view name, const Chunk& chunk, size_t offset,
+	size_t width = 1)
+{
+	auto constant = read_operand(chunk, offset + 1, width);
+	auto cache = read_cache(chunk, offset + 1 + width);
+	std::cout << std::setfill(' ') << std::left << std::setw(16) << name << ' ';
+	std::cout << std::setw(4) << constant << " '";
+	std::cout << chunk.constants.values.at(constant) << "' ic " << cache << '\n';
+	return offset + 3 + width;
+}
+
+[[nodiscard]] size_t cached_invoke_instruction(std::string_view name, const Chunk& chunk, size_t offset,
+	size_t width = 1)
+{
+	auto constant = read_operand(chunk, offset + 1, width);
+	auto arg_count = chunk.code.at(offset + 1 + width);
+	auto cache = read_cache(chunk, offset + 2 + width);
+	std::cout << std::setfill(' ') << std::left << std::setw(16) << name << ' ';
+	std::cout << '(' << static_cast<unsigned>(arg_count) << " args) ";
+	std::cout << std::setw(4) << constant << " '";
+	std::cout << chunk.constants.values.at(constant) << "' ic " << cache << '\n';
+	return offset + 4 + width;
 }
 
 [[nodiscard]] size_t jump_instruction(std::string_view name, int sign, const Chunk& chunk, size_t offset)
@@ -64,29 +118,34 @@ size_t disassemble_instruction(const Chunk& chunk, size_t offset)
 {
 	std::cout << std::setfill('0') << std::right << std::setw(4) << offset << ' ';
 	if (offset >= chunk.count())return offset - 1;
-	if (offset > 0 && chunk.lines.at(offset) == chunk.lines.at(offset - 1))
+	if (offset > 0 && chunk.lines.line_at(offset) == chunk.lines.line_at(offset - 1))
 	{
 		std::cout << "   | ";
 	} else
 	{
-		std::cout << std::setfill(' ') << std::setw(4) << chunk.lines.at(offset) << ' ';
+		std::cout << std::setfill(' ') << std::setw(4) << chunk.lines.line_at(offset) << ' ';
 	}
 
+	// a superinstruction is shown with the operands of its first instruction,
+	// the rest of its sequence follows as it is in the code
 	auto instruction = static_cast<OpCode>(chunk.code.at(offset));
-	switch (instruction)
+	switch (unfused(instruction))
 	{
 		case OpCode::Call:
+		case OpCode::TailCall:
 		case OpCode::GetLocal:
 		case OpCode::SetLocal:
 		case OpCode::GetUpvalue:
 		case OpCode::SetUpvalue:
+		case OpCode::GetEnclosing:
+		case OpCode::SetEnclosing:
+		case OpCode::PopUnder:
 			return byte_instruction(nameof(instruction), chunk, offset);
-		case OpCode::Constant:
 		case OpCode::GetGlobal:
 		case OpCode::DefineGlobal:
 		case OpCode::SetGlobal:
-		case OpCode::GetProperty:
-		case OpCode::SetProperty:
+			return global_instruction(nameof(instruction), chunk, offset);
+		case OpCode::Constant:
 		case OpCode::GetSuper:
 		case OpCode::Class:
 		case OpCode::Method:
@@ -113,16 +172,56 @@ size_t disassemble_instruction(const Chunk& chunk, size_t offset)
 		case OpCode::CloseUpvalue:
 		case OpCode::Return:
 		case OpCode::Inherit:
+		case OpCode::AddNumber:
+		case OpCode::AddString:
+		case OpCode::SubtractNumber:
+		case OpCode::MultiplyNumber:
+		case OpCode::DivideNumber:
+		case OpCode::GreaterNumber:
+		case OpCode::LessNumber:
+		case OpCode::NegateNumber:
+		case OpCode::AddUnchecked:
+		case OpCode::SubtractUnchecked:
+		case OpCode::MultiplyUnchecked:
+		case OpCode::DivideUnchecked:
+		case OpCode::GreaterUnchecked:
+		case OpCode::LessUnchecked:
+		case OpCode::NegateUnchecked:
 			return simple_instruction(nameof(instruction), offset);
+		case OpCode::GetProperty:
+		case OpCode::SetProperty:
+			return property_instruction(nameof(instruction), chunk, offset);
 		case OpCode::Invoke:
+		case OpCode::TailInvoke:
+			return cached_invoke_instruction(nameof(instruction), chunk, offset);
 		case OpCode::SuperInvoke:
 			return invoke_instruction(nameof(instruction), chunk, offset);
+		case OpCode::ConstantLong:
+		case OpCode::GetSuperLong:
+		case OpCode::ClassLong:
+		case OpCode::MethodLong:
+			return constant_instruction(nameof(instruction), chunk, offset, 3);
+		case OpCode::GetGlobalLong:
+		case OpCode::DefineGlobalLong:
+		case OpCode::SetGlobalLong:
+			return global_instruction(nameof(instruction), chunk, offset, 3);
+		case OpCode::GetPropertyLong:
+		case OpCode::SetPropertyLong:
+			return property_instruction(nameof(instruction), chunk, offset, 3);
+		case OpCode::InvokeLong:
+			return cached_invoke_instruction(nameof(instruction), chunk, offset, 3);
+		case OpCode::SuperInvokeLong:
+			return invoke_instruction(nameof(instruction), chunk, offset, 3);
 		case OpCode::Closure:
+		case OpCode::ClosureLong:
+		case OpCode::FrameClosure:
+		case OpCode::FrameClosureLong:
 		{
-			offset++;
-			auto constant = chunk.code.at(offset++);
-			std::cout << std::setfill(' ') << std::left << std::setw(16) << nameof(OpCode::Closure) << ' ';
-			std::cout << std::setw(4) << static_cast<unsigned>(constant) << ' ';
+			size_t width = instruction == OpCode::Closure || instruction == OpCode::FrameClosure ? 1 : 3;
+			auto constant = read_operand(chunk, offset + 1, width);
+			offset += 1 + width;
+			std::cout << std::setfill(' ') << std::left << std::setw(16) << nameof(instruction) << ' ';
+			std::cout << std::setw(4) << constant << ' ';
 			std::cout << chunk.constants.values.at(constant) << '\n';
 
 			auto function =
@@ -144,4 +243,232 @@ size_t disassemble_instruction(const Chunk& chunk, size_t offset)
 	}
 }
 
+void disassemble_registers(const ObjFunction& function)
+{
+	std::cout << "== " << function << " registers " << function.register_chunk->frame_size << " ==\n";
+	for (size_t offset = 0; offset < function.register_chunk->count();)
+	{
+		offset = disassemble_register_instruction(function, offset);
+	}
+}
+
+size_t disassemble_register_instruction(const ObjFunction& function, size_t offset)
+{
+	const auto& code = function.register_chunk->code;
+	const auto& lines = function.register_chunk->lines;
+	const auto& constants = function.chunk.constants.values;
+	std::cout << std::setfill('0') << std::right << std::setw(4) << offset << ' ';
+	if (offset > 0 && lines.line_at(offset) == lines.line_at(offset - 1))
+		std::cout << "   | ";
+	else
+		std::cout << std::setfill(' ') << std::setw(4) << lines.line_at(offset) << ' ';
+
+	auto instruction = static_cast<OpCode>(code.at(offset));
+	std::cout << std::setfill(' ') << std::left << std::setw(16) << nameof(instruction);
+	auto next = offset + 1;
+	auto reg = [&code, &next]() { std::cout << " r" << static_cast<unsigned>(code.at(next++)); };
+	auto byte = [&code, &next]() { std::cout << ' ' << static_cast<unsigned>(code.at(next++)); };
+	auto constant = [&code, &constants, &next]()
+	{
+		auto index = code.at(next++);
+		std::cout << ' ' << static_cast<unsigned>(index) << " '" << constants.at(index) << '\'';
+	};
+	auto slot = [&code, &next]()
+	{
+		auto value = static_cast<uint16_t>(code.at(next) << 8 | code.at(next + 1));
+		std::cout << " slot " << value;
+		next += 2;
+	};
+	auto jump = [&code, &next, offset](int sign)
+	{
+		auto distance = static_cast<uint16_t>(code.at(next) << 8 | code.at(next + 1));
+		next += 2;
+		std::cout << ' ' << offset << " -> " << next + sign * distance;
+	};
+
+	switch (instruction)
+	{
+		case OpCode::RegMove:
+		case OpCode::RegNot:
+		case OpCode::RegNegate:
+			reg(); reg();
+			break;
+		case OpCode::RegConstant:
+			reg(); constant();
+			break;
+		case OpCode::RegNil:
+		case OpCode::RegTrue:
+		case OpCode::RegFalse:
+		case OpCode::RegPrint:
+		case OpCode::RegCloseUpvalue:
+		case OpCode::RegReturn:
+			reg();
+			break;
+		case OpCode::RegGetGlobal:
+			reg(); slot();
+			break;
+		case OpCode::RegDefineGlobal:
+		case OpCode::RegSetGlobal:
+			slot(); reg();
+			break;
+		case OpCode::RegGetUpvalue:
+			reg(); byte();
+			break;
+		case OpCode::RegSetUpvalue:
+			byte(); reg();
+			break;
+		case OpCode::RegEqual:
+		case OpCode::RegGreater:
+		case OpCode::RegLess:
+		case OpCode::RegAdd:
+		case OpCode::RegSubtract:
+		case OpCode::RegMultiply:
+		case OpCode::RegDivide:
+			reg(); reg(); reg();
+			break;
+		case OpCode::RegJump:
+			jump(1);
+			break;
+		case OpCode::RegJumpIfFalse:
+			reg(); jump(1);
+			break;
+		case OpCode::RegLoop:
+			jump(-1);
+			break;
+		case OpCode::RegCall:
+		case OpCode::RegTailCall:
+			reg();
+			std::cout << " (" << static_cast<unsigned>(code.at(next++)) << " args)";
+			break;
+		case OpCode::RegClosure:
+		{
+			reg();
+			auto inner = constants.at(code.at(next)).as_obj<ObjFunction>();
+			constant();
+			std::cout << '\n';
+			for (size_t j = 0; j < inner->upvalue_count; j++)
+			{
+				auto is_local = code.at(next++);
+				auto index = code.at(next++);
+				std::cout << std::setfill('0') << std::right << std::setw(4) << next - 2;
+				std::cout << "      |                     ";
+				std::cout << (is_local > 0 ? "local" : "upvalue");
+				std::cout << ' ' << static_cast<unsigned>(index) << '\n';
+			}
+			return next;
+		}
+		default:
+			std::cout << " unknown\n";
+			return offset + 1;
+	}
+	std::cout << '\n';
+	return next;
+}
+
+void report_inline_caches(const ObjFunction& function)
+{
+	const auto& chunk = function.chunk;
+	if (!chunk.caches.empty())
+	{
+		std::cout << "== inline caches " << function << " ==\n";
+		for (const auto& cache : chunk.caches)
+		{
+			auto lookups = cache.hits + cache.misses;
+			auto constant = chunk.code.at(cache.offset + 1);
+			std::cout << std::setfill('0') << std::right << std::setw(4) << cache.offset << ' ';
+			std::cout << std::setfill(' ') << std::setw(4) << chunk.lines.line_at(cache.offset) << ' ';
+			std::cout << std::left << std::setw(16) << static_cast<OpCode>(chunk.code.at(cache.offset)) << ' ';
+			std::cout << std::setw(16) << chunk.constants.values.at(constant) << ' ';
+			if (cache.megamorphic)
+				std::cout << "megamorphic  ";
+			else if (cache.entry_count > 1)
+				std::cout << "polymorphic  ";
+			else if (cache.entry_count == 1)
+				std::cout << "monomorphic  ";
+			else
+				std::cout << "empty        ";
+			std::cout << cache.hits << '/' << lookups << " hits";
+			if (lookups > 0)
+				std::cout << " (" << 100.0 * cache.hits / lookups << "%)";
+			std::cout << '\n';
+		}
+	}
+
+	for (const auto& constant : chunk.constants.values)
+	{
+		if (constant.is_obj_type<ObjFunction>())
+			report_inline_caches(*constant.as_obj<ObjFunction>());
+	}
+}
+
+void report_line_tables(const ObjFunction& function)
+{
+	const auto& chunk = function.chunk;
+	// what one size_t per byte, the layout before LineTable, would take
+	auto flat = chunk.count() * sizeof(size_t);
+	std::cout << std::setfill(' ') << std::left << std::setw(16)
+		<< (function.name == nullptr ? "<script>" : function.name->text()) << ' ';
+	std::cout << std::right << std::setw(8) << chunk.count() << " bytes of code ";
+	std::cout << std::setw(6) << chunk.lines.runs.size() << " runs ";
+	std::cout << std::setw(8) << chunk.lines.bytes() << " bytes of lines, ";
+	std::cout << std::setw(8) << flat - chunk.lines.bytes() << " saved\n";
+
+	for (const auto& constant : chunk.constants.values)
+	{
+		if (constant.is_obj_type<ObjFunction>())
+			report_line_tables(*constant.as_obj<ObjFunction>());
+	}
+}
+
+OpcodeProfile::OpcodeProfile()
+	:pairs(OPCODE_COUNT * OPCODE_COUNT, 0), triples(OPCODE_COUNT * OPCODE_COUNT * OPCODE_COUNT, 0)
+{
+}
+
+void OpcodeProfile::record(uint8_t op)noexcept
+{
+	if (count > 0)
+		pairs[previous[1] * OPCODE_COUNT + op]++;
+	if (count > 1)
+		triples[(previous[0] * OPCODE_COUNT + previous[1]) * OPCODE_COUNT + op]++;
+	previous[0] = previous[1];
+	previous[1] = op;
+	count++;
+}
+
+void OpcodeProfile::report(size_t top)
+{
+	auto print = [this, top](const std::vector<size_t>& counts, size_t length)
+	{
+		std::vector<size_t> order(counts.size());
+		std::iota(order.begin(), order.end(), 0);
+		auto shown = std::min(top, order.size());
+		std::partial_sort(order.begin(), order.begin() + shown, order.end(),
+			[&counts](size_t a, size_t b) { return counts[a] > counts[b]; });
+		for (size_t i = 0; i < shown && counts[order[i]] > 0; i++)
+		{
+			std::cout << std::setfill(' ') << std::right << std::setw(12) << counts[order[i]];
+			std::cout << std::setw(7) << std::fixed << std::setprecision(2)
+				<< 100.0 * counts[order[i]] / count << "% ";
+			std::cout.unsetf(std::ios::fixed);
+			auto ops = order[i];
+			std::vector<OpCode> sequence(length);
+			for (size_t j = length; j > 0; j--, ops /= OPCODE_COUNT)
+				sequence[j - 1] = static_cast<OpCode>(ops % OPCODE_COUNT);
+			for (auto op : sequence)
+				std::cout << ' ' << op;
+			std::cout << '\n';
+		}
+	};
+
+	std::cout << "== opcode pairs of " << count << " dispatches ==\n";
+	print(pairs, 2);
+	std::cout << "== opcode triples ==\n";
+	print(triples, 3);
+
+	std::fill(pairs.begin(), pairs.end(), 0);
+	std::fill(triples.begin(), triples.end(), 0);
+	count = 0;
+}
+
 } //Clox
\ No newline at end of file
@@ -0,0 +1,521 @@
+#include "jit.h"
+
+#include "object.h"
+
+#ifdef CLOX_JIT_X64
+#include <cstring>
+#include <utility>
+
+#include <sys/mman.h>
+#endif // CLOX_JIT_X64
+
+namespace Clox {
+
+#ifdef CLOX_JIT_X64
+
+namespace {
+
+enum Reg :uint8_t
+{
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// Native code never calls out, so these keep their meaning for a whole run.
+constexpr auto STATE = RBX;
+constexpr auto SLOTS = R12;
+constexpr auto TOP = R13; // one past the top of the stack, like VM::stacktop
+constexpr auto GLOBALS = R14;
+constexpr auto QNAN_REG = R8;
+
+// Entering and leaving native code costs about as much as a few dispatches,
+// so it is only entered where it can run at least this many instructions.
+constexpr size_t MIN_NATIVE_RUN = 4;
+
+enum class Cond :uint8_t
+{
+	Equal = 0x4,
+	NotEqual = 0x5,
+	Above = 0x7,
+	NoParity = 0xb
+};
+
+// Encodes just the handful of instructions the templates below need, all
+// on 64-bit operands. xmm registers are passed by number.
+struct Assembler
+{
+	std::vector<uint8_t> bytes;
+
+	[[nodiscard]] size_t size()const noexcept { return bytes.size(); }
+
+	void byte(uint8_t b) { bytes.push_back(b); }
+	void dword(uint32_t d)
+	{
+		for (auto i = 0; i < 4; i++)
+			byte(static_cast<uint8_t>(d >> (8 * i)));
+	}
+	void qword(uint64_t q)
+	{
+		for (auto i = 0; i < 8; i++)
+			byte(static_cast<uint8_t>(q >> (8 * i)));
+	}
+
+	void rex_w(uint8_t reg, uint8_t rm) { byte(static_cast<uint8_t>(0x48 | (reg >> 3) << 2 | rm >> 3)); }
+	void modrm(uint8_t mod, uint8_t reg, uint8_t rm) { byte(static_cast<uint8_t>(mod << 6 | (reg & 7) << 3 | (rm & 7))); }
+	void mem(uint8_t reg, Reg base, int32_t disp)
+	{
+		modrm(2, reg, base);
+		if ((base & 7) == RSP)
+			byte(0x24);
+		dword(static_cast<uint32_t>(disp));
+	}
+
+	void push(Reg r)
+	{
+		if (r >= R8) byte(0x41);
+		byte(static_cast<uint8_t>(0x50 + (r & 7)));
+	}
+	void pop(Reg r)
+	{
+		if (r >= R8) byte(0x41);
+		byte(static_cast<uint8_t>(0x58 + (r & 7)));
+	}
+
+	void mov(Reg dst, Reg src) { rex_w(src, dst); byte(0x89); modrm(3, src, dst); }
+	void mov(Reg dst, uint64_t imm) { rex_w(0, dst); byte(static_cast<uint8_t>(0xb8 + (dst & 7))); qword(imm); }
+	void mov32(Reg dst, uint32_t imm)
+	{
+		if (dst >= R8) byte(0x41);
+		byte(static_cast<uint8_t>(0xb8 + (dst & 7)));
+		dword(imm);
+	}
+	void load(Reg dst, Reg base, int32_t disp) { rex_w(dst, base); byte(0x8b); mem(dst, base, disp); }
+	void store(Reg base, int32_t disp, Reg src) { rex_w(src, base); byte(0x89); mem(src, base, disp); }
+
+	void add(Reg dst, int32_t imm) { rex_w(0, dst); byte(0x81); modrm(3, 0, dst); dword(static_cast<uint32_t>(imm)); }
+	void sub(Reg dst, int32_t imm) { rex_w(0, dst); byte(0x81); modrm(3, 5, dst); dword(static_cast<uint32_t>(imm)); }
+	void add(Reg dst, Reg src) { rex_w(src, dst); byte(0x01); modrm(3, src, dst); }
+	void and_(Reg dst, Reg src) { rex_w(src, dst); byte(0x21); modrm(3, src, dst); }
+	void xor_(Reg dst, Reg src) { rex_w(src, dst); byte(0x31); modrm(3, src, dst); }
+	void cmp(Reg lhs, Reg rhs) { rex_w(rhs, lhs); byte(0x39); modrm(3, rhs, lhs); }
+
+	// byte registers, only al, cl and dl are used
+	void setcc(Cond cc, Reg dst) { byte(0x0f); byte(static_cast<uint8_t>(0x90 | static_cast<uint8_t>(cc))); modrm(3, 0, dst); }
+	void and8(Reg dst, Reg src) { byte(0x20); modrm(3, src, dst); }
+	void or8(Reg dst, Reg src) { byte(0x08); modrm(3, src, dst); }
+	void movzx8(Reg dst, Reg src) { byte(0x0f); byte(0xb6); modrm(3, dst, src); }
+
+	void movq_to_xmm(uint8_t xmm, Reg src) { byte(0x66); rex_w(xmm, src); byte(0x0f); byte(0x6e); modrm(3, xmm, src); }
+	void movq_from_xmm(Reg dst, uint8_t xmm) { byte(0x66); rex_w(xmm, dst); byte(0x0f); byte(0x7e); modrm(3, xmm, dst); }
+	// addsd 0x58, mulsd 0x59, subsd 0x5c, divsd 0x5e
+	void sse(uint8_t op, uint8_t dst, uint8_t src) { byte(0xf2); byte(0x0f); byte(op); modrm(3, dst, src); }
+	void ucomisd(uint8_t lhs, uint8_t rhs) { byte(0x66); byte(0x0f); byte(0x2e); modrm(3, lhs, rhs); }
+
+	// jumps return the position of their rel32, to be linked later
+	[[nodiscard]] size_t jmp() { byte(0xe9); dword(0); return size() - 4; }
+	[[nodiscard]] size_t jcc(Cond cc)
+	{
+		byte(0x0f);
+		byte(static_cast<uint8_t>(0x80 | static_cast<uint8_t>(cc)));
+		dword(0);
+		return size() - 4;
+	}
+	void jmp(Reg r)
+	{
+		if (r >= R8) byte(0x41);
+		byte(0xff);
+		modrm(3, 4, r);
+	}
+	void ret() { byte(0xc3); }
+
+	void link(size_t patch, size_t target)
+	{
+		auto rel = static_cast<uint32_t>(target - (patch + 4));
+		for (auto i = 0; i < 4; i++)
+			bytes[patch + i] = static_cast<uint8_t>(rel >> (8 * i));
+	}
+	void bind(size_t patch) { link(patch, size()); }
+};
+
+struct Translator
+{
+	const Chunk& chunk;
+	Assembler a;
+	std::vector<size_t> labels; // native offset of each instruction start
+	std::vector<bool> handled; // instructions with a native translation
+	std::vector<size_t> order; // instruction starts, in code order
+	std::vector<std::pair<size_t, size_t>> jumps; // rel32, bytecode target
+	std::vector<std::pair<size_t, size_t>> exits; // rel32, bytecode offset to resume at
+
+	explicit Translator(const Chunk& chunk)
+		:chunk(chunk), labels(chunk.count(), 0), handled(chunk.count(), false)
+	{
+	}
+
+	[[nodiscard]] uint16_t operand_short(size_t offset)const noexcept
+	{
+		return static_cast<uint16_t>(chunk.code[offset + 1] << 8 | chunk.code[offset + 2]);
+	}
+
+	void side_exit(size_t offset) { exits.emplace_back(a.jmp(), offset); }
+	void side_exit(Cond cc, size_t offset) { exits.emplace_back(a.jcc(cc), offset); }
+
+	void push(Reg r)
+	{
+		a.store(TOP, 0, r);
+		a.add(TOP, 8);
+	}
+
+	void guard_number(Reg r, size_t offset)
+	{
+		a.mov(R9, r);
+		a.and_(R9, QNAN_REG);
+		a.cmp(R9, QNAN_REG);
+		side_exit(Cond::Equal, offset);
+	}
+
+	// whether the instruction at offset is one the optimizer proved takes numbers
+	[[nodiscard]] bool is_unchecked(size_t offset)const noexcept
+	{
+		auto op = static_cast<OpCode>(chunk.code[offset]);
+		return checked(op) != op;
+	}
+
+	// loads both operands of a numeric binary instruction into xmm0 and xmm1
+	void load_numbers(size_t offset)
+	{
+		a.load(RAX, TOP, -16);
+		a.load(RDX, TOP, -8);
+		if (!is_unchecked(offset))
+		{
+			guard_number(RAX, offset);
+			guard_number(RDX, offset);
+		}
+		a.movq_to_xmm(0, RAX);
+		a.movq_to_xmm(1, RDX);
+	}
+
+	// turns the flag in al into a bool Value replacing the two operands
+	void store_bool(int32_t disp)
+	{
+		a.movzx8(RAX, RAX);
+		a.mov(RCX, FALSE_VAL);
+		a.add(RAX, RCX);
+		a.store(TOP, disp, RAX);
+	}
+
+	void prologue();
+	size_t epilogue();
+	void instruction(size_t offset);
+	[[nodiscard]] std::vector<uint8_t> run();
+};
+
+void Translator::prologue()
+{
+	// entry is EntryFn: rdi holds the JitState, rsi the address to start at
+	for (auto r : { RBX, RBP, R12, R13, R14, R15 })
+		a.push(r);
+	a.mov(STATE, RDI);
+	a.load(SLOTS, STATE, static_cast<int32_t>(offsetof(JitState, slots)));
+	a.load(TOP, STATE, static_cast<int32_t>(offsetof(JitState, stacktop)));
+	a.load(GLOBALS, STATE, static_cast<int32_t>(offsetof(JitState, globals)));
+	a.mov(QNAN_REG, QNAN);
+	a.jmp(RSI);
+}
+
+size_t Translator::epilogue()
+{
+	// eax holds the bytecode offset to resume at
+	auto start = a.size();
+	a.store(STATE, static_cast<int32_t>(offsetof(JitState, stacktop)), TOP);
+	for (auto r : { R15, R14, R13, R12, RBP, RBX })
+		a.pop(r);
+	a.ret();
+	return start;
+}
+
+void Translator::instruction(size_t offset)
+{
+	labels[offset] = a.size();
+	handled[offset] = true;
+	order.push_back(offset);
+
+	switch (unfused(static_cast<OpCode>(chunk.code[offset])))
+	{
+		case OpCode::Constant:
+			a.mov(RAX, chunk.constants.values[chunk.code[offset + 1]].value);
+			push(RAX);
+			break;
+		case OpCode::Nil:
+			a.mov(RAX, NIL_VAL);
+			push(RAX);
+			break;
+		case OpCode::True:
+			a.mov(RAX, TRUE_VAL);
+			push(RAX);
+			break;
+		case OpCode::False:
+			a.mov(RAX, FALSE_VAL);
+			push(RAX);
+			break;
+		case OpCode::Pop:
+			a.sub(TOP, 8);
+			break;
+		case OpCode::PopUnder:
+			a.load(RAX, TOP, -8);
+			a.sub(TOP, 8 * chunk.code[offset + 1]);
+			a.store(TOP, -8, RAX);
+			break;
+		case OpCode::GetLocal:
+			a.load(RAX, SLOTS, 8 * chunk.code[offset + 1]);
+			push(RAX);
+			break;
+		case OpCode::SetLocal:
+			a.load(RAX, TOP, -8);
+			a.store(SLOTS, 8 * chunk.code[offset + 1], RAX);
+			break;
+		case OpCode::GetGlobal:
+			a.load(RAX, GLOBALS, 8 * operand_short(offset));
+			a.mov(RCX, UNDEFINED_VAL);
+			a.cmp(RAX, RCX);
+			side_exit(Cond::Equal, offset);
+			push(RAX);
+			break;
+		case OpCode::DefineGlobal:
+			a.load(RAX, TOP, -8);
+			a.store(GLOBALS, 8 * operand_short(offset), RAX);
+			a.sub(TOP, 8);
+			break;
+		case OpCode::SetGlobal:
+			a.load(RAX, GLOBALS, 8 * operand_short(offset));
+			a.mov(RCX, UNDEFINED_VAL);
+			a.cmp(RAX, RCX);
+			side_exit(Cond::Equal, offset);
+			a.load(RAX, TOP, -8);
+			a.store(GLOBALS, 8 * operand_short(offset), RAX);
+			break;
+		case OpCode::Equal:
+		{
+			// numbers compare as doubles, everything else by bits
+			a.load(RAX, TOP, -16);
+			a.load(RDX, TOP, -8);
+			a.mov(R9, RAX);
+			a.and_(R9, QNAN_REG);
+			a.cmp(R9, QNAN_REG);
+			auto a_not_number = a.jcc(Cond::Equal);
+			a.mov(R9, RDX);
+			a.and_(R9, QNAN_REG);
+			a.cmp(R9, QNAN_REG);
+			auto b_not_number = a.jcc(Cond::Equal);
+			a.movq_to_xmm(0, RAX);
+			a.movq_to_xmm(1, RDX);
+			a.ucomisd(0, 1);
+			a.setcc(Cond::Equal, RAX);
+			a.setcc(Cond::NoParity, RCX);
+			a.and8(RAX, RCX);
+			auto done = a.jmp();
+			a.bind(a_not_number);
+			a.bind(b_not_number);
+			a.cmp(RAX, RDX);
+			a.setcc(Cond::Equal, RAX);
+			a.bind(done);
+			store_bool(-16);
+			a.sub(TOP, 8);
+			break;
+		}
+		case OpCode::Greater:
+		case OpCode::GreaterNumber:
+		case OpCode::GreaterUnchecked:
+			load_numbers(offset);
+			a.ucomisd(0, 1);
+			a.setcc(Cond::Above, RAX);
+			store_bool(-16);
+			a.sub(TOP, 8);
+			break;
+		case OpCode::Less:
+		case OpCode::LessNumber:
+		case OpCode::LessUnchecked:
+			load_numbers(offset);
+			a.ucomisd(1, 0);
+			a.setcc(Cond::Above, RAX);
+			store_bool(-16);
+			a.sub(TOP, 8);
+			break;
+		case OpCode::Add:
+		case OpCode::AddNumber:
+		case OpCode::Subtract:
+		case OpCode::SubtractNumber:
+		case OpCode::Multiply:
+		case OpCode::MultiplyNumber:
+		case OpCode::Divide:
+		case OpCode::DivideNumber:
+		case OpCode::AddUnchecked:
+		case OpCode::SubtractUnchecked:
+		case OpCode::MultiplyUnchecked:
+		case OpCode::DivideUnchecked:
+		{
+			uint8_t op = 0;
+			switch (checked(static_cast<OpCode>(chunk.code[offset])))
+			{
+				case OpCode::Add: case OpCode::AddNumber: op = 0x58; break;
+				case OpCode::Subtract: case OpCode::SubtractNumber: op = 0x5c; break;
+				case OpCode::Multiply: case OpCode::MultiplyNumber: op = 0x59; break;
+				default: op = 0x5e; break;
+			}
+			// string concatenation leaves through the guard
+			load_numbers(offset);
+			a.sse(op, 0, 1);
+			a.movq_from_xmm(RAX, 0);
+			a.store(TOP, -16, RAX);
+			a.sub(TOP, 8);
+			break;
+		}
+		case OpCode::Not:
+			a.load(RAX, TOP, -8);
+			a.mov(RCX, NIL_VAL);
+			a.cmp(RAX, RCX);
+			a.setcc(Cond::Equal, RDX);
+			a.mov(RCX, FALSE_VAL);
+			a.cmp(RAX, RCX);
+			a.setcc(Cond::Equal, RAX);
+			a.or8(RAX, RDX);
+			store_bool(-8);
+			break;
+		case OpCode::Negate:
+		case OpCode::NegateNumber:
+		case OpCode::NegateUnchecked:
+			a.load(RAX, TOP, -8);
+			if (!is_unchecked(offset))
+				guard_number(RAX, offset);
+			a.mov(RCX, SIGN_BIT);
+			a.xor_(RAX, RCX);
+			a.store(TOP, -8, RAX);
+			break;
+		case OpCode::Jump:
+			jumps.emplace_back(a.jmp(), offset + 3 + operand_short(offset));
+			break;
+		case OpCode::JumpIfFalse:
+		{
+			auto target = offset + 3 + operand_short(offset);
+			a.load(RAX, TOP, -8);
+			a.mov(RCX, NIL_VAL);
+			a.cmp(RAX, RCX);
+			jumps.emplace_back(a.jcc(Cond::Equal), target);
+			a.mov(RCX, FALSE_VAL);
+			a.cmp(RAX, RCX);
+			jumps.emplace_back(a.jcc(Cond::Equal), target);
+			break;
+		}
+		case OpCode::Loop:
+			jumps.emplace_back(a.jmp(), offset + 3 - operand_short(offset));
+			break;
+		default:
+			// calls, returns, upvalues and objects stay with the interpreter
+			handled[offset] = false;
+			side_exit(offset);
+			break;
+	}
+}
+
+std::vector<uint8_t> Translator::run()
+{
+	prologue();
+	for (size_t offset = 0; offset < chunk.count(); offset += instruction_length(chunk, offset))
+		instruction(offset);
+
+	for (auto [patch, target] : jumps)
+		a.link(patch, labels[target]);
+
+	// one stub per resume offset, loading it for the shared epilogue
+	std::vector<size_t> stubs(chunk.count(), 0);
+	std::vector<size_t> to_epilogue;
+	for (auto [patch, offset] : exits)
+	{
+		if (stubs[offset] == 0)
+		{
+			stubs[offset] = a.size();
+			a.mov32(RAX, static_cast<uint32_t>(offset));
+			to_epilogue.push_back(a.jmp());
+		}
+		a.link(patch, stubs[offset]);
+	}
+	auto exit = epilogue();
+	for (auto patch : to_epilogue)
+		a.link(patch, exit);
+
+	return std::move(a.bytes);
+}
+
+}
+
+std::unique_ptr<JitCode> jit_compile(ObjFunction& function)
+{
+	Translator translator(function.chunk);
+	auto bytes = translator.run();
+
+	auto memory = mmap(nullptr, bytes.size(), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+		return nullptr;
+	std::memcpy(memory, bytes.data(), bytes.size());
+	if (mprotect(memory, bytes.size(), PROT_READ | PROT_EXEC) != 0)
+	{
+		munmap(memory, bytes.size());
+		return nullptr;
+	}
+
+	auto res = std::make_unique<JitCode>();
+	res->memory = memory;
+	res->size = bytes.size();
+	res->code = function.chunk.code.data();
+	res->entries.resize(function.chunk.count(), nullptr);
+
+	// counts the handled instructions straight ahead of each one, a jump
+	// back into the loop is taken to be worth entering for
+	size_t run = 0;
+	for (auto it = translator.order.rbegin(); it != translator.order.rend(); ++it)
+	{
+		auto offset = *it;
+		if (!translator.handled[offset])
+			run = 0;
+		else if (static_cast<OpCode>(function.chunk.code[offset]) == OpCode::Loop)
+			run = MIN_NATIVE_RUN;
+		else
+			run++;
+
+		if (run >= MIN_NATIVE_RUN)
+			res->entries[offset] = static_cast<const uint8_t*>(memory) + translator.labels[offset];
+	}
+	return res;
+}
+
+JitCode::~JitCode()
+{
+	if (memory != nullptr)
+		munmap(memory, size);
+}
+
+#else
+
+std::unique_ptr<JitCode> jit_compile(ObjFunction&)
+{
+	return nullptr;
+}
+
+JitCode::~JitCode() = default;
+
+#endif // CLOX_JIT_X64
+
+uint8_t* JitCode::run(Value* slots, Value*& stacktop, Value* globals, uint8_t* ip)const
+{
+	auto target = entries[static_cast<size_t>(ip - code)];
+	if (target == nullptr)
+		return ip;
+
+	JitState state{ slots, stacktop, globals };
+	auto resume = reinterpret_cast<EntryFn>(memory)(&state, target);
+	stacktop = state.stacktop;
+	return code + resume;
+}
+
+} // Clox
\ No newline at end of file
@@ -45,7 +45,8 @@ void GC::mark_roots()
 	for (auto upvalue = vm.open_upvalues; upvalue != nullptr; upvalue = upvalue->next)
 		mark_object(upvalue);
 
-	mark_table(vm.globals);
+	mark_table(vm.global_slots);
+	mark_array(vm.globals);
 	mark_compiler_roots();
 	mark_object(vm.init_string);
 }
@@ -86,12 +87,22 @@ void GC::mark_value(const Value& value)
 		mark_object(value.as<Obj*>());
 }
 
-void GC::mark_table(const table& table)
+void GC::mark_table(const Table& table)
 {
-	for (auto& [key, value] : table)
+	table.for_each([this](ObjString* key, const Value& value)
+		{
+			mark_object(key);
+			mark_value(value);
+		});
+}
+
+void GC::mark_shape(const Shape& shape)
+{
+	// each transition appends one key, the rest belong to its ancestors
+	for (const auto& next : shape.transitions)
 	{
-		mark_object(key);
-		mark_value(value);
+		mark_object(next->key);
+		mark_shape(*next);
 	}
 }
 
@@ -126,6 +137,7 @@ void GC::blacken_object(Obj* ptr)
 			auto klass = static_cast<ObjClass*>(ptr);
 			mark_object(klass->name);
 			mark_table(klass->methods);
+			mark_shape(*klass->root_shape);
 			break;
 		}
 		case ObjType::Closure:
@@ -140,14 +152,26 @@ void GC::blacken_object(Obj* ptr)
 		{
 			auto function = static_cast<ObjFunction*>(ptr);
 			mark_object(function->name);
+			mark_object(function->shared_closure);
 			mark_array(function->chunk.constants);
+			// cached shapes die with their class, which must stay alive
+			// or a new class could reuse the shape addresses
+			for (const auto& cache : function->chunk.caches)
+			{
+				for (size_t i = 0; i < cache.entry_count; i++)
+				{
+					mark_object(cache.entries[i].shape->klass);
+					mark_object(cache.entries[i].method);
+				}
+			}
 			break;
 		}
 		case ObjType::Instance:
 		{
 			auto instance = static_cast<ObjInstance*>(ptr);
 			mark_object(instance->klass);
-			mark_table(instance->fields);
+			for (const auto& value : instance->fields)
+				mark_value(value);
 			break;
 		}
 		case ObjType::Upvalue:
@@ -162,12 +186,7 @@ void GC::blacken_object(Obj* ptr)
 
 void GC::remove_white_string()noexcept
 {
-	for (auto it = strings.begin(); it != strings.end();)
-	{
-		if (*it != nullptr && !(*it)->is_marked)
-			it = strings.erase(it);
-		else ++it;
-	}
+	strings.remove_white();
 }
 
 void GC::sweep()
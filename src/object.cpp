@@ -9,6 +9,9 @@ std::ostream& operator<<(std::ostream& out, const Obj& obj)
 {
 	switch (obj.type)
 	{
+		case ObjType::BoundMethod:
+			out << static_cast<const ObjBoundMethod&>(obj);
+			break;
 		case ObjType::Class:
 			out << static_cast<const ObjClass&>(obj);
 			break;
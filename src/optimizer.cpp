@@ -0,0 +1,728 @@
+#include "optimizer.h"
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "obj_string.h"
+#include "object.h"
+#include "ssa.h"
+
+namespace Clox {
+
+namespace {
+
+[[nodiscard]] constexpr bool has_side_effects(IrOp op)noexcept
+{
+	switch (op)
+	{
+		case IrOp::DefineGlobal:
+		case IrOp::SetGlobal:
+		case IrOp::SetUpvalue:
+		case IrOp::SetProperty:
+		case IrOp::Print:
+		case IrOp::Call:
+		case IrOp::TailCall:
+		case IrOp::Invoke:
+		case IrOp::TailInvoke:
+		case IrOp::Jump:
+		case IrOp::Branch:
+		case IrOp::Return:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// computes its result from its operands alone, the same every time
+[[nodiscard]] constexpr bool is_pure(IrOp op)noexcept
+{
+	switch (op)
+	{
+		case IrOp::Constant:
+		case IrOp::Nil:
+		case IrOp::True:
+		case IrOp::False:
+		case IrOp::Equal:
+		case IrOp::Greater:
+		case IrOp::Less:
+		case IrOp::Add:
+		case IrOp::Subtract:
+		case IrOp::Multiply:
+		case IrOp::Divide:
+		case IrOp::Not:
+		case IrOp::Negate:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// raises a runtime error unless every operand is a number
+[[nodiscard]] constexpr bool checks_numbers(IrOp op)noexcept
+{
+	switch (op)
+	{
+		case IrOp::Greater:
+		case IrOp::Less:
+		case IrOp::Subtract:
+		case IrOp::Multiply:
+		case IrOp::Divide:
+		case IrOp::Negate:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// a pure instruction by what it computes, two with the same key compute the same value
+struct Expression
+{
+	IrOp op;
+	uint32_t operand;
+	IrValue left;
+	IrValue right;
+
+	[[nodiscard]] bool operator==(const Expression& other)const noexcept
+	{
+		return op == other.op && operand == other.operand && left == other.left && right == other.right;
+	}
+};
+
+struct ExpressionHash
+{
+	[[nodiscard]] size_t operator()(const Expression& expression)const noexcept
+	{
+		auto hash = static_cast<size_t>(expression.op) * 0x9e3779b97f4a7c15ull;
+		for (auto part : { expression.operand, expression.left, expression.right })
+			hash = (hash ^ part) * 0x100000001b3ull;
+		return hash;
+	}
+};
+
+[[nodiscard]] constexpr bool is_call(IrOp op)noexcept
+{
+	return op == IrOp::Call || op == IrOp::TailCall || op == IrOp::Invoke || op == IrOp::TailInvoke;
+}
+
+// The dominator tree of an IrFunction, and what they tell
+// about the values in it. Moving an instruction up to a block dominating its
+// own keeps this sound, anything else needs a new Analysis.
+struct Analysis
+{
+	const IrFunction& ir;
+	std::vector<uint32_t> order; // reverse postorder
+	std::vector<uint32_t> idom;
+	std::vector<uint32_t> enter, leave; // of each block in a walk of the dominator tree
+	std::vector<std::vector<IrValue>> checked_by; // users that only accept a number
+	std::vector<size_t> index; // of each instruction in its block, after the phis
+	std::vector<bool> numbers; // values that are numbers whatever runs before them
+
+	static constexpr size_t END = SIZE_MAX; // index past the last instruction of a block
+
+	explicit Analysis(const IrFunction& ir);
+
+	[[nodiscard]] bool dominates(uint32_t a, uint32_t b)const noexcept
+	{
+		return enter[a] <= enter[b] && leave[b] <= leave[a];
+	}
+	// whether value has run whenever control reaches index of block
+	[[nodiscard]] bool runs_before(IrValue value, uint32_t block, size_t at)const noexcept
+	{
+		if (ir[value].block == block)
+			return index[value] < at;
+		return dominates(ir[value].block, block);
+	}
+	// a value some instruction that only accepts numbers has taken is one from there on
+	[[nodiscard]] bool is_number(IrValue value, uint32_t block, size_t at)const
+	{
+		if (numbers[value])
+			return true;
+		return std::any_of(checked_by[value].begin(), checked_by[value].end(),
+			[&](IrValue user) { return runs_before(user, block, at); });
+	}
+	[[nodiscard]] bool can_fail(IrValue value, uint32_t block, size_t at)const;
+	[[nodiscard]] bool can_fail(IrValue value)const
+	{
+		return can_fail(value, ir[value].block, index[value]);
+	}
+
+private:
+	void find_dominators();
+	void find_numbers();
+};
+
+Analysis::Analysis(const IrFunction& ir)
+	:ir(ir), order(ir.reverse_postorder()), checked_by(ir.values.size()), index(ir.values.size(), 0)
+{
+	find_dominators();
+	for (auto block : order)
+	{
+		const auto& code = ir.blocks[block].code;
+		for (size_t i = 0; i < code.size(); i++)
+		{
+			index[code[i]] = i + 1;
+			if (!checks_numbers(ir[code[i]].op))
+				continue;
+			for (auto arg : ir[code[i]].args)
+				checked_by[arg].push_back(code[i]);
+		}
+	}
+	find_numbers();
+}
+
+// Cooper, Harvey and Kennedy's iteration over the reverse postorder
+void Analysis::find_dominators()
+{
+	std::vector<uint32_t> rank(ir.blocks.size(), NO_BLOCK);
+	for (uint32_t i = 0; i < order.size(); i++)
+		rank[order[i]] = i;
+	idom.assign(ir.blocks.size(), NO_BLOCK);
+	idom[0] = 0;
+	auto intersect = [this, &rank](uint32_t a, uint32_t b)
+	{
+		while (a != b)
+		{
+			while (rank[a] > rank[b])
+				a = idom[a];
+			while (rank[b] > rank[a])
+				b = idom[b];
+		}
+		return a;
+	};
+	auto changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (auto block : order)
+		{
+			if (block == 0)
+				continue;
+			auto dominator = NO_BLOCK;
+			for (auto pred : ir.blocks[block].preds)
+			{
+				if (idom[pred] != NO_BLOCK)
+					dominator = dominator == NO_BLOCK ? pred : intersect(pred, dominator);
+			}
+			if (idom[block] != dominator)
+			{
+				idom[block] = dominator;
+				changed = true;
+			}
+		}
+	}
+
+	std::vector<std::vector<uint32_t>> children(ir.blocks.size());
+	for (auto block : order)
+	{
+		if (block != 0)
+			children[idom[block]].push_back(block);
+	}
+	enter.assign(ir.blocks.size(), 0);
+	leave.assign(ir.blocks.size(), 0);
+	uint32_t clock = 0;
+	std::vector<std::pair<uint32_t, size_t>> pending{ { 0, 0 } };
+	enter[0] = clock++;
+	while (!pending.empty())
+	{
+		auto [block, next] = pending.back();
+		if (next == children[block].size())
+		{
+			leave[block] = clock++;
+			pending.pop_back();
+			continue;
+		}
+		pending.back().second++;
+		auto child = children[block][next];
+		enter[child] = clock++;
+		pending.emplace_back(child, 0);
+	}
+}
+
+void Analysis::find_numbers()
+{
+	const auto& constants = ir.function.chunk.constants.values;
+	numbers.assign(ir.values.size(), false);
+	for (auto block : order)
+	{
+		for (auto phi : ir.blocks[block].phis)
+			numbers[phi] = true;
+		for (auto value : ir.blocks[block].code)
+		{
+			switch (ir[value].op)
+			{
+				case IrOp::Constant:
+					numbers[value] = constants[ir[value].operand].is_number();
+					break;
+				case IrOp::Subtract:
+				case IrOp::Multiply:
+				case IrOp::Divide:
+				case IrOp::Negate:
+				case IrOp::Add:
+					numbers[value] = true;
+					break;
+				default:
+					break;
+			}
+		}
+	}
+	// phis and sums start out hopeful, until an operand turns out not to be
+	// one where they take it: a phi's at the end of the pred it comes from,
+	// which a check there may have proven
+	auto changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (auto block : order)
+		{
+			const auto& preds = ir.blocks[block].preds;
+			for (auto phi : ir.blocks[block].phis)
+			{
+				if (!numbers[phi])
+					continue;
+				for (size_t i = 0; i < preds.size(); i++)
+				{
+					if (!is_number(ir[phi].args[i], preds[i], END))
+					{
+						numbers[phi] = false;
+						changed = true;
+						break;
+					}
+				}
+			}
+			for (auto value : ir.blocks[block].code)
+			{
+				if (!numbers[value] || ir[value].op != IrOp::Add)
+					continue;
+				const auto& args = ir[value].args;
+				if (!std::all_of(args.begin(), args.end(),
+					[&](IrValue arg) { return is_number(arg, block, index[value]); }))
+				{
+					numbers[value] = false;
+					changed = true;
+				}
+			}
+		}
+	}
+}
+
+bool Analysis::can_fail(IrValue value, uint32_t block, size_t at)const
+{
+	const auto& instruction = ir[value];
+	auto number = [&](size_t arg) { return is_number(instruction.args[arg], block, at); };
+	switch (instruction.op)
+	{
+		case IrOp::Greater:
+		case IrOp::Less:
+		case IrOp::Add:
+		case IrOp::Subtract:
+		case IrOp::Multiply:
+		case IrOp::Divide:
+			return !number(0) || !number(1);
+		case IrOp::Negate:
+			return !number(0);
+		case IrOp::GetGlobal: // undefined
+		case IrOp::SetGlobal:
+		case IrOp::GetProperty:
+		case IrOp::SetProperty:
+		case IrOp::Call:
+		case IrOp::TailCall:
+		case IrOp::Invoke:
+		case IrOp::TailInvoke:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Drops every value nothing that stays needs, stores to locals included.
+void remove_dead_code(IrFunction& ir)
+{
+	Analysis analysis(ir);
+	std::vector<bool> live(ir.values.size(), false);
+	std::vector<IrValue> pending;
+	for (auto block : analysis.order)
+	{
+		for (auto value : ir.blocks[block].code)
+		{
+			if (has_side_effects(ir[value].op) || analysis.can_fail(value))
+			{
+				live[value] = true;
+				pending.push_back(value);
+			}
+		}
+	}
+	while (!pending.empty())
+	{
+		auto value = pending.back();
+		pending.pop_back();
+		for (auto arg : ir[value].args)
+		{
+			if (!live[arg])
+			{
+				live[arg] = true;
+				pending.push_back(arg);
+			}
+		}
+	}
+
+	for (auto block : analysis.order)
+	{
+		for (auto phi : ir.blocks[block].phis)
+			ir[phi].dead = !live[phi];
+		for (auto value : ir.blocks[block].code)
+			ir[value].dead = !live[value];
+	}
+	ir.remove_dead();
+}
+
+// Walks the dominator tree keeping the pure values computed on the way
+// there, and within a block the last value loaded from or stored to each
+// global, upvalue and field until something could change it.
+void eliminate_common_subexpressions(IrFunction& ir)
+{
+	Analysis analysis(ir);
+	std::vector<std::vector<uint32_t>> children(ir.blocks.size());
+	for (auto block : analysis.order)
+	{
+		if (block != 0)
+			children[analysis.idom[block]].push_back(block);
+	}
+
+	std::vector<IrValue> replacements(ir.values.size(), NO_VALUE);
+	auto resolve = [&replacements](IrValue value)
+	{
+		while (replacements[value] != NO_VALUE)
+			value = replacements[value];
+		return value;
+	};
+	std::unordered_map<Expression, IrValue, ExpressionHash> available;
+	available.reserve(ir.values.size());
+	// the expressions each block on the path from the entry made available
+	std::vector<std::vector<Expression>> path;
+	std::vector<std::pair<uint32_t, size_t>> pending{ { 0, 0 } };
+	auto visit = [&](uint32_t block)
+	{
+		std::vector<Expression> added;
+		std::unordered_map<uint32_t, IrValue> globals;
+		std::unordered_map<uint32_t, IrValue> upvalues;
+		std::map<std::pair<IrValue, uint32_t>, IrValue> fields;
+		for (auto value : ir.blocks[block].code)
+		{
+			auto& instruction = ir[value];
+			for (auto& arg : instruction.args)
+				arg = resolve(arg);
+			auto op = instruction.op;
+			auto replace = [&](IrValue by)
+			{
+				replacements[value] = by;
+				instruction.dead = true;
+			};
+
+			if (is_pure(op))
+			{
+				const auto& args = instruction.args;
+				Expression key{ op, instruction.operand, args.empty() ? NO_VALUE : args[0],
+					args.size() < 2 ? NO_VALUE : args[1] };
+				// the same either way round, for any operands
+				if ((op == IrOp::Equal || op == IrOp::Multiply) && key.right < key.left)
+					std::swap(key.left, key.right);
+				auto [found, inserted] = available.emplace(key, value);
+				if (inserted)
+					added.push_back(key);
+				else
+					replace(found->second);
+				continue;
+			}
+			switch (op)
+			{
+				case IrOp::GetGlobal:
+				{
+					auto [found, inserted] = globals.emplace(instruction.operand, value);
+					if (!inserted)
+						replace(found->second);
+					break;
+				}
+				case IrOp::DefineGlobal:
+				case IrOp::SetGlobal:
+					globals[instruction.operand] = instruction.args[0];
+					break;
+				case IrOp::GetUpvalue:
+				{
+					auto [found, inserted] = upvalues.emplace(instruction.operand, value);
+					if (!inserted)
+						replace(found->second);
+					break;
+				}
+				case IrOp::SetUpvalue:
+					upvalues[instruction.operand] = instruction.args[0];
+					break;
+				case IrOp::GetProperty:
+				{
+					// only a stored field is reused: a method read twice makes two bound methods
+					auto found = fields.find({ instruction.args[0], instruction.operand });
+					if (found != fields.end())
+						replace(found->second);
+					break;
+				}
+				case IrOp::SetProperty:
+					// another value may name the same instance
+					fields.clear();
+					fields[{ instruction.args[0], instruction.operand }] = instruction.args[1];
+					break;
+				default:
+					if (is_call(op))
+					{
+						globals.clear();
+						upvalues.clear();
+						fields.clear();
+					}
+					break;
+			}
+		}
+		path.push_back(std::move(added));
+	};
+
+	visit(0);
+	while (!pending.empty())
+	{
+		auto [block, next] = pending.back();
+		if (next == children[block].size())
+		{
+			for (const auto& key : path.back())
+				available.erase(key);
+			path.pop_back();
+			pending.pop_back();
+			continue;
+		}
+		pending.back().second++;
+		auto child = children[block][next];
+		visit(child);
+		pending.emplace_back(child, 0);
+	}
+
+	ir.replace_uses(replacements);
+	ir.remove_dead();
+}
+
+struct Loop
+{
+	uint32_t header;
+	std::vector<bool> body;
+	size_t size = 0;
+};
+
+// Natural loops, those nested in another first
+[[nodiscard]] std::vector<Loop> find_loops(const IrFunction& ir, const Analysis& analysis)
+{
+	std::vector<Loop> loops;
+	for (auto block : analysis.order)
+	{
+		for (auto header : ir.blocks[block].succs)
+		{
+			if (!analysis.dominates(header, block))
+				continue;
+			auto loop = std::find_if(loops.begin(), loops.end(),
+				[header](const Loop& loop) { return loop.header == header; });
+			if (loop == loops.end())
+			{
+				loops.push_back(Loop{ header, std::vector<bool>(ir.blocks.size(), false) });
+				loop = loops.end() - 1;
+				loop->body[header] = true;
+				loop->size = 1;
+			}
+			std::vector<uint32_t> pending{ block };
+			while (!pending.empty())
+			{
+				auto current = pending.back();
+				pending.pop_back();
+				if (loop->body[current])
+					continue;
+				loop->body[current] = true;
+				loop->size++;
+				for (auto pred : ir.blocks[current].preds)
+					pending.push_back(pred);
+			}
+		}
+	}
+	std::stable_sort(loops.begin(), loops.end(),
+		[](const Loop& a, const Loop& b) { return a.size < b.size; });
+	return loops;
+}
+
+// Moves pure values and loads nothing in the loop stores to whose operands
+// come from outside a loop to the end of the block entering it. One that can
+// fail only moves when it would have been the first thing in the loop to
+// fail or have an effect, so the error comes out as it would have.
+void hoist_loop_invariants(IrFunction& ir)
+{
+	ir.split_critical_edges();
+	Analysis analysis(ir);
+	for (const auto& loop : find_loops(ir, analysis))
+	{
+		const auto& header = ir.blocks[loop.header];
+		auto outside = std::count_if(header.preds.begin(), header.preds.end(),
+			[&loop](uint32_t pred) { return !loop.body[pred]; });
+		if (outside != 1)
+			continue;
+		auto preheader = *std::find_if(header.preds.begin(), header.preds.end(),
+			[&loop](uint32_t pred) { return !loop.body[pred]; });
+		if (ir.blocks[preheader].succs.size() != 1)
+			continue;
+
+		auto stores_globals = false;
+		auto stores_upvalues = false;
+		for (auto block : analysis.order)
+		{
+			if (!loop.body[block])
+				continue;
+			for (auto value : ir.blocks[block].code)
+			{
+				auto op = ir[value].op;
+				stores_globals |= op == IrOp::DefineGlobal || op == IrOp::SetGlobal || is_call(op);
+				stores_upvalues |= op == IrOp::SetUpvalue || is_call(op);
+			}
+		}
+
+		std::vector<IrValue> hoisted;
+		for (auto block : analysis.order)
+		{
+			if (!loop.body[block])
+				continue;
+			// nothing in the header so far could fail or had an effect
+			auto first = block == loop.header;
+			std::vector<IrValue> kept;
+			for (auto value : ir.blocks[block].code)
+			{
+				const auto& instruction = ir[value];
+				auto op = instruction.op;
+				auto movable = is_pure(op) || (op == IrOp::GetGlobal && !stores_globals)
+					|| (op == IrOp::GetUpvalue && !stores_upvalues);
+				auto invariant = std::none_of(instruction.args.begin(), instruction.args.end(),
+					[&ir, &loop](IrValue arg) { return loop.body[ir[arg].block]; });
+				if (movable && invariant && (first || !analysis.can_fail(value, preheader, Analysis::END)))
+				{
+					hoisted.push_back(value);
+					ir[value].block = preheader;
+					continue;
+				}
+				kept.push_back(value);
+				first = first && !has_side_effects(op) && !analysis.can_fail(value);
+			}
+			ir.blocks[block].code = std::move(kept);
+		}
+		auto& code = ir.blocks[preheader].code;
+		code.insert(code.end() - 1, hoisted.begin(), hoisted.end());
+	}
+}
+
+// Drops a store to a global or upvalue that another store in the same block
+// overwrites before anything could read it or an error could stop the
+// script. A store to a global is only dropped once the global is known to
+// be defined, as storing to an undefined one is an error.
+void eliminate_dead_stores(IrFunction& ir)
+{
+	Analysis analysis(ir);
+	for (auto block : analysis.order)
+	{
+		std::unordered_map<uint32_t, IrValue> globals; // stores nothing has read yet
+		std::unordered_map<uint32_t, IrValue> upvalues;
+		std::unordered_set<uint32_t> defined;
+		for (auto value : ir.blocks[block].code)
+		{
+			auto& instruction = ir[value];
+			auto slot = instruction.operand;
+			switch (instruction.op)
+			{
+				case IrOp::SetGlobal:
+				{
+					auto stored = globals.find(slot);
+					if (stored != globals.end())
+						ir[stored->second].dead = true;
+					if (defined.count(slot) != 0)
+						globals[slot] = value;
+					else
+						globals.erase(slot);
+					defined.insert(slot);
+					break;
+				}
+				case IrOp::DefineGlobal:
+				case IrOp::GetGlobal:
+					globals.erase(slot);
+					defined.insert(slot);
+					break;
+				case IrOp::SetUpvalue:
+				{
+					auto stored = upvalues.find(slot);
+					if (stored != upvalues.end())
+						ir[stored->second].dead = true;
+					upvalues[slot] = value;
+					break;
+				}
+				case IrOp::GetUpvalue:
+					upvalues.erase(slot);
+					break;
+				default:
+					if (is_call(instruction.op) || instruction.op == IrOp::Return || analysis.can_fail(value))
+					{
+						globals.clear();
+						upvalues.clear();
+					}
+					break;
+			}
+		}
+	}
+	ir.remove_dead();
+}
+
+// Marks each arithmetic instruction and comparison whose operands are
+// numbers wherever it runs, so it is lowered to its unchecked form. A
+// parameter or the result of a call is only known to be one past the first
+// instruction that checks it, which stays checked and raises the error it
+// always did, so no guard of its own is needed.
+void specialize_numbers(IrFunction& ir)
+{
+	Analysis analysis(ir);
+	for (auto block : analysis.order)
+	{
+		for (auto value : ir.blocks[block].code)
+		{
+			auto& instruction = ir[value];
+			auto op = instruction.op;
+			if (!checks_numbers(op) && op != IrOp::Add)
+				continue;
+			instruction.unchecked = std::all_of(instruction.args.begin(), instruction.args.end(),
+				[&](IrValue arg) { return analysis.is_number(arg, block, analysis.index[value]); });
+		}
+	}
+}
+
+}
+
+void optimize(ObjFunction& function, bool dump)
+{
+	auto name = function.name == nullptr ? "<script>" : function.name->text();
+	auto ir = build_ir(function);
+	if (!ir.has_value())
+	{
+		if (dump)
+			std::cout << "== " << name << " ==\n    (not lowered to SSA form)\n";
+		return;
+	}
+
+	remove_dead_code(*ir);
+	eliminate_common_subexpressions(*ir);
+	hoist_loop_invariants(*ir);
+	// hoisting brings values from sibling loops together
+	eliminate_common_subexpressions(*ir);
+	eliminate_dead_stores(*ir);
+	remove_dead_code(*ir);
+	specialize_numbers(*ir);
+	if (dump)
+		print_ir(*ir, name);
+	static_cast<void>(lower_ir(*ir));
+}
+
+} // Clox
@@ -0,0 +1,371 @@
+#include "peephole.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "chunk.h"
+
+namespace Clox {
+
+namespace {
+
+constexpr uint32_t NO_TARGET = UINT32_MAX;
+// rewrites expose more rewrites, but a few rounds reach all that occur in practice
+constexpr size_t MAX_ROUNDS = 8;
+// Jump chains are short, this only stops a loop jumping to itself
+constexpr size_t MAX_THREADING = 16;
+
+// kept small, a script can compile to hundreds of thousands of them
+struct Instruction
+{
+	uint32_t start; // of its bytes in Peephole::bytes, the opcode is written back on encoding
+	uint16_t length;
+	OpCode op;
+	bool live = true;
+	uint32_t line;
+	uint32_t target = NO_TARGET; // index of the instruction a jump lands on
+
+	// Jump and Loop, encoded as whichever reaches the target
+	[[nodiscard]] bool is_goto()const noexcept { return op == OpCode::Jump || op == OpCode::Loop; }
+	[[nodiscard]] bool is_jump()const noexcept { return is_goto() || op == OpCode::JumpIfFalse; }
+};
+
+// where the index of an instruction's inline cache sits among its bytes
+[[nodiscard]] std::optional<size_t> cache_position(OpCode op)noexcept
+{
+	switch (op)
+	{
+		case OpCode::GetProperty:
+		case OpCode::SetProperty:
+			return 2;
+		case OpCode::Invoke:
+		case OpCode::TailInvoke:
+			return 3;
+		case OpCode::GetPropertyLong:
+		case OpCode::SetPropertyLong:
+			return 4;
+		case OpCode::InvokeLong:
+			return 5;
+		default:
+			return std::nullopt;
+	}
+}
+
+// pushes a value without side effects or errors, so a Pop right after undoes it
+[[nodiscard]] constexpr bool is_pure_push(OpCode op)noexcept
+{
+	switch (op)
+	{
+		case OpCode::Nil:
+		case OpCode::True:
+		case OpCode::False:
+		case OpCode::Constant:
+		case OpCode::ConstantLong:
+		case OpCode::GetLocal:
+		case OpCode::GetUpvalue:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// the load of what op stores to, when the two take the same operands
+[[nodiscard]] std::optional<OpCode> load_of(OpCode op)noexcept
+{
+	switch (op)
+	{
+		case OpCode::SetLocal: return OpCode::GetLocal;
+		case OpCode::SetUpvalue: return OpCode::GetUpvalue;
+		case OpCode::SetGlobal: return OpCode::GetGlobal;
+		case OpCode::SetGlobalLong: return OpCode::GetGlobalLong;
+		default: return std::nullopt;
+	}
+}
+
+struct Peephole
+{
+	Chunk& chunk;
+	std::vector<uint8_t> bytes; // a copy of the code, operands rewritten in place
+	std::vector<Instruction> code;
+	std::vector<bool> targeted; // by a live jump, so it must stay where it is
+
+	explicit Peephole(Chunk& chunk) :chunk(chunk) {}
+
+	void decode();
+	[[nodiscard]] bool encode();
+
+	// first live instruction at or after index, a removed jump target passes
+	// its jumps on to it
+	[[nodiscard]] size_t live_from(size_t index)const noexcept
+	{
+		while (index < code.size() && !code[index].live)
+			index++;
+		return index;
+	}
+	[[nodiscard]] size_t next(size_t index)const noexcept { return live_from(index + 1); }
+	[[nodiscard]] size_t target(size_t index)const noexcept { return live_from(code[index].target); }
+	[[nodiscard]] bool is(size_t index, OpCode op)const noexcept
+	{
+		return index < code.size() && code[index].op == op;
+	}
+
+	void find_targets();
+	// jumps to an instruction simplify() removed land on the next live one now
+	void pass_on_target(size_t index)
+	{
+		if (targeted[index])
+			targeted[live_from(index)] = true;
+	}
+	[[nodiscard]] bool thread(size_t index);
+	[[nodiscard]] bool simplify(size_t index);
+	[[nodiscard]] bool remove_unreachable();
+	void run();
+};
+
+void Peephole::decode()
+{
+	bytes.assign(chunk.code.begin(), chunk.code.end());
+	code.reserve(chunk.count());
+	auto run = chunk.lines.runs.begin();
+	uint32_t line = 0;
+	for (size_t offset = 0; offset < chunk.count(); offset += code.back().length)
+	{
+		while (run != chunk.lines.runs.end() && run->offset <= offset)
+			line = (run++)->line;
+		code.push_back(Instruction{ static_cast<uint32_t>(offset),
+			static_cast<uint16_t>(instruction_length(chunk, offset)), static_cast<OpCode>(bytes[offset]),
+			true, line });
+	}
+
+	// jump offsets become indices once every instruction's start is known
+	for (auto& instruction : code)
+	{
+		if (!instruction.is_jump())
+			continue;
+		auto jump = static_cast<size_t>(bytes[instruction.start + 1] << 8 | bytes[instruction.start + 2]);
+		auto after = size_t{ instruction.start } + 3;
+		auto to = instruction.op == OpCode::Loop ? after - jump : after + jump;
+		auto landing = std::lower_bound(code.begin(), code.end(), to,
+			[](const Instruction& instruction, size_t offset) { return instruction.start < offset; });
+		instruction.target = static_cast<uint32_t>(landing - code.begin());
+	}
+}
+
+void Peephole::find_targets()
+{
+	targeted.assign(code.size() + 1, false);
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		if (code[i].live && code[i].is_jump())
+			targeted[target(i)] = true;
+	}
+}
+
+bool Peephole::thread(size_t index)
+{
+	auto& jump = code[index];
+	auto conditional = jump.op == OpCode::JumpIfFalse;
+	auto destination = target(index);
+	for (size_t step = 0; step < MAX_THREADING && destination < code.size(); step++)
+	{
+		// a JumpIfFalse landing on another one finds the same condition on the
+		// stack and takes it too; there is no backward JumpIfFalse to go further
+		const auto& at = code[destination];
+		if (!at.is_goto() && !(conditional && at.op == OpCode::JumpIfFalse))
+			break;
+		auto further = target(destination);
+		if (conditional && further <= index)
+			break;
+		destination = further;
+	}
+
+	if (!conditional && is(destination, OpCode::Return))
+	{
+		// returns the same value the Return it jumped to would
+		jump.op = OpCode::Return;
+		jump.length = 1;
+		jump.target = NO_TARGET;
+		return true;
+	}
+	if (destination == next(index))
+	{
+		jump.live = false;
+		return true;
+	}
+	if (destination == target(index))
+		return false;
+	jump.target = static_cast<uint32_t>(destination);
+	return true;
+}
+
+bool Peephole::simplify(size_t index)
+{
+	auto op = code[index].op;
+	auto second = next(index);
+	if (second == code.size() || targeted[second])
+		return false;
+	auto third = next(second);
+	auto untargeted_third = third < code.size() && !targeted[third];
+
+	// Constant, Pop: the value is never used
+	if (is_pure_push(op) && is(second, OpCode::Pop))
+	{
+		code[index].live = false;
+		code[second].live = false;
+		pass_on_target(index);
+		return true;
+	}
+	// SetLocal, Pop, GetLocal of the same slot: the value is still on the stack
+	auto load = load_of(op);
+	if (load.has_value() && is(second, OpCode::Pop) && untargeted_third && is(third, load.value()))
+	{
+		const auto& store = code[index];
+		const auto& load = code[third];
+		auto same_operands = std::equal(&bytes[store.start + 1], &bytes[store.start + store.length],
+			&bytes[load.start + 1], &bytes[load.start + load.length]);
+		if (same_operands)
+		{
+			code[second].live = false;
+			code[third].live = false;
+			return true;
+		}
+	}
+	if (is(second, OpCode::JumpIfFalse))
+	{
+		// a condition known to hold: its test and the Pop on the taken arm go
+		if ((op == OpCode::True || op == OpCode::Constant || op == OpCode::ConstantLong) &&
+			untargeted_third && is(third, OpCode::Pop))
+		{
+			code[index].live = false;
+			code[second].live = false;
+			code[third].live = false;
+			pass_on_target(index);
+			return true;
+		}
+		// one known to fail: the arm it skips becomes unreachable
+		if (op == OpCode::Nil || op == OpCode::False)
+		{
+			code[second].op = OpCode::Jump;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Peephole::remove_unreachable()
+{
+	std::vector<bool> reached(code.size() + 1, false);
+	std::vector<size_t> pending{ live_from(0) };
+	while (!pending.empty())
+	{
+		auto index = pending.back();
+		pending.pop_back();
+		if (index >= code.size() || reached[index])
+			continue;
+		reached[index] = true;
+		const auto& instruction = code[index];
+		if (instruction.is_jump())
+			pending.push_back(target(index));
+		if (!instruction.is_goto() && instruction.op != OpCode::Return)
+			pending.push_back(next(index));
+	}
+
+	auto changed = false;
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		if (code[i].live && !reached[i])
+		{
+			code[i].live = false;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+bool Peephole::encode()
+{
+	std::vector<size_t> offsets(code.size() + 1, 0);
+	size_t offset = 0;
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		offsets[i] = offset;
+		if (code[i].live)
+			offset += code[i].length;
+	}
+	offsets[code.size()] = offset;
+
+	for (size_t i = 0; i < code.size(); i++)
+	{
+		auto& instruction = code[i];
+		if (!instruction.live || !instruction.is_jump())
+			continue;
+		auto from = offsets[i] + 3;
+		auto to = offsets[target(i)];
+		if (instruction.is_goto())
+			instruction.op = to < from ? OpCode::Loop : OpCode::Jump;
+		auto jump = to < from ? from - to : to - from;
+		if (jump > UINT16_MAX)
+			return false;
+		bytes[instruction.start + 1] = static_cast<uint8_t>(jump >> 8 & 0xff);
+		bytes[instruction.start + 2] = static_cast<uint8_t>(jump & 0xff);
+	}
+
+	chunk.code.clear();
+	chunk.code.reserve(offsets[code.size()]);
+	chunk.lines.strip();
+	chunk.caches.clear();
+	for (const auto& instruction : code)
+	{
+		if (!instruction.live)
+			continue;
+		auto* at = &bytes[instruction.start];
+		at[0] = static_cast<uint8_t>(instruction.op);
+		auto position = cache_position(instruction.op);
+		if (position.has_value())
+		{
+			auto cache = chunk.add_cache(chunk.count());
+			at[position.value()] = static_cast<uint8_t>(cache >> 8 & 0xff);
+			at[position.value() + 1] = static_cast<uint8_t>(cache & 0xff);
+		}
+		chunk.lines.add(chunk.count(), instruction.line);
+		chunk.code.insert(chunk.code.end(), at, at + instruction.length);
+	}
+	return true;
+}
+
+void Peephole::run()
+{
+	decode();
+	for (size_t round = 0; round < MAX_ROUNDS; round++)
+	{
+		auto changed = false;
+		for (size_t i = 0; i < code.size(); i++)
+		{
+			if (code[i].live && code[i].is_jump())
+				changed |= thread(i);
+		}
+		find_targets();
+		for (size_t i = 0; i < code.size(); i++)
+		{
+			if (code[i].live)
+				changed |= simplify(i);
+		}
+		changed |= remove_unreachable();
+		if (!changed)
+			break;
+	}
+
+	// encode() gives up before it touches the chunk, leaving it as compiled
+	static_cast<void>(encode());
+}
+
+}
+
+void peephole(Chunk& chunk)
+{
+	Peephole(chunk).run();
+}
+
+} // Clox
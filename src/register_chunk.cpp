@@ -0,0 +1,454 @@
+#include "register_chunk.h"
+
+#include <algorithm>
+#include <optional>
+#include <utility>
+
+#include "object.h"
+
+namespace Clox {
+
+namespace {
+
+[[nodiscard]] constexpr OpCode register_form(OpCode op)noexcept
+{
+	switch (op)
+	{
+		case OpCode::DefineGlobal: return OpCode::RegDefineGlobal;
+		case OpCode::SetGlobal: return OpCode::RegSetGlobal;
+		case OpCode::Equal: return OpCode::RegEqual;
+		case OpCode::Greater: return OpCode::RegGreater;
+		case OpCode::Less: return OpCode::RegLess;
+		case OpCode::Add: return OpCode::RegAdd;
+		case OpCode::Subtract: return OpCode::RegSubtract;
+		case OpCode::Multiply: return OpCode::RegMultiply;
+		case OpCode::Divide: return OpCode::RegDivide;
+		case OpCode::Not: return OpCode::RegNot;
+		case OpCode::Negate: return OpCode::RegNegate;
+		default: return op;
+	}
+}
+
+// What one stack slot holds at some point of the stack code. Only Slot
+// means the value is really there; the others are pushes not done yet,
+// which the instruction consuming them reads from where the value is.
+struct Operand
+{
+	enum class Kind :uint8_t
+	{
+		Slot,
+		Register, // a copy of register index
+		Constant, // constant index of the chunk
+		Nil,
+		True,
+		False
+	};
+
+	Kind kind = Kind::Slot;
+	uint8_t index = 0;
+};
+
+// Walks the stack code once, keeping the stack as Operands. A push only
+// records where its value comes from, and the instruction that pops it
+// names that place directly, so GetLocal/Constant/Pop and SetLocal of a
+// fresh result mostly cost nothing. Every stack slot is materialized
+// where control flow meets, so jump targets always see Slot operands.
+struct Lowering
+{
+	const ObjFunction& function;
+	const Chunk& chunk;
+	std::unique_ptr<RegisterChunk> res;
+	std::vector<Operand> stack;
+	std::vector<bool> labels; // stack offsets some jump lands on
+	std::vector<std::optional<size_t>> depths; // stack height at each label
+	std::vector<size_t> offsets; // register code offset of each stack offset
+	std::vector<std::pair<size_t, size_t>> jumps; // forward jump operand, stack target
+	std::optional<size_t> fresh; // destination operand of the previous instruction, if it pushed
+	bool reachable = true;
+	size_t line = 0;
+
+	explicit Lowering(const ObjFunction& function)
+		:function(function), chunk(function.chunk), res(std::make_unique<RegisterChunk>()),
+		stack(function.arity + 1), labels(chunk.count(), false),
+		depths(chunk.count()), offsets(chunk.count(), 0)
+	{
+	}
+
+	[[nodiscard]] uint8_t operand(size_t offset, size_t index)const noexcept
+	{
+		return chunk.code[offset + 1 + index];
+	}
+
+	[[nodiscard]] size_t jump_target(size_t offset)const noexcept
+	{
+		auto jump = static_cast<size_t>(operand(offset, 0) << 8 | operand(offset, 1));
+		if (static_cast<OpCode>(chunk.code[offset]) == OpCode::Loop)
+			return offset + 3 - jump;
+		return offset + 3 + jump;
+	}
+
+	[[nodiscard]] uint8_t top()const noexcept
+	{
+		return static_cast<uint8_t>(stack.size() - 1);
+	}
+
+	void emit(uint8_t byte)
+	{
+		res->code.push_back(byte);
+		res->lines.add(res->code.size() - 1, line);
+	}
+
+	void emit(OpCode op)
+	{
+		emit(static_cast<uint8_t>(op));
+	}
+
+	void emit_short(uint16_t value)
+	{
+		emit(static_cast<uint8_t>(value >> 8 & 0xff));
+		emit(static_cast<uint8_t>(value & 0xff));
+	}
+
+	// the instruction just emitted wrote the new top through the operand at destination
+	void produce(size_t destination)
+	{
+		stack.back() = Operand{};
+		fresh = destination;
+	}
+
+	void materialize(uint8_t slot);
+	void flush();
+	void flush_readers(uint8_t reg);
+	[[nodiscard]] uint8_t read(uint8_t slot);
+
+	[[nodiscard]] bool label(size_t offset);
+	[[nodiscard]] bool instruction(size_t offset);
+	[[nodiscard]] std::unique_ptr<RegisterChunk> run();
+};
+
+void Lowering::materialize(uint8_t slot)
+{
+	auto operand = stack[slot];
+	switch (operand.kind)
+	{
+		case Operand::Kind::Slot:
+			return;
+		case Operand::Kind::Register:
+			if (operand.index == slot)
+				break;
+			emit(OpCode::RegMove);
+			emit(slot);
+			emit(operand.index);
+			break;
+		case Operand::Kind::Constant:
+			emit(OpCode::RegConstant);
+			emit(slot);
+			emit(operand.index);
+			break;
+		case Operand::Kind::Nil:
+			emit(OpCode::RegNil);
+			emit(slot);
+			break;
+		case Operand::Kind::True:
+			emit(OpCode::RegTrue);
+			emit(slot);
+			break;
+		case Operand::Kind::False:
+			emit(OpCode::RegFalse);
+			emit(slot);
+			break;
+	}
+	stack[slot] = Operand{};
+}
+
+void Lowering::flush()
+{
+	for (size_t i = 0; i < stack.size(); i++)
+		materialize(static_cast<uint8_t>(i));
+}
+
+// before reg is written, the pushes still reading it take the old value
+void Lowering::flush_readers(uint8_t reg)
+{
+	for (size_t i = 0; i < stack.size(); i++)
+	{
+		if (stack[i].kind == Operand::Kind::Register && stack[i].index == reg)
+			materialize(static_cast<uint8_t>(i));
+	}
+}
+
+// the register holding the value of stack slot
+uint8_t Lowering::read(uint8_t slot)
+{
+	if (stack[slot].kind == Operand::Kind::Register)
+		return stack[slot].index;
+	materialize(slot);
+	return slot;
+}
+
+bool Lowering::label(size_t offset)
+{
+	if (reachable)
+		flush();
+	else
+		stack.assign(depths[offset].value_or(stack.size()), Operand{});
+	if (depths[offset].has_value() && depths[offset].value() != stack.size())
+		return false;
+	depths[offset] = stack.size();
+	fresh.reset();
+	return true;
+}
+
+bool Lowering::instruction(size_t offset)
+{
+	// the register forms check their operands, which costs little next to the dispatch they save
+	auto op = checked(static_cast<OpCode>(chunk.code[offset]));
+	line = chunk.lines.line_at(offset);
+	if (labels[offset] && !label(offset))
+		return false;
+	offsets[offset] = res->count();
+	reachable = true;
+	auto pushed = std::exchange(fresh, std::nullopt);
+
+	switch (op)
+	{
+		case OpCode::Constant:
+			stack.push_back(Operand{ Operand::Kind::Constant, operand(offset, 0) });
+			return true;
+		case OpCode::Nil:
+			stack.push_back(Operand{ Operand::Kind::Nil });
+			return true;
+		case OpCode::True:
+			stack.push_back(Operand{ Operand::Kind::True });
+			return true;
+		case OpCode::False:
+			stack.push_back(Operand{ Operand::Kind::False });
+			return true;
+		case OpCode::Pop:
+			stack.pop_back();
+			return true;
+		case OpCode::GetLocal:
+		{
+			auto slot = operand(offset, 0);
+			auto copy = stack[slot];
+			if (copy.kind == Operand::Kind::Slot)
+				copy = Operand{ Operand::Kind::Register, slot };
+			stack.push_back(copy);
+			return true;
+		}
+		case OpCode::SetLocal:
+		{
+			auto slot = operand(offset, 0);
+			auto readers = false;
+			for (size_t i = 0; i + 1 < stack.size(); i++)
+				readers |= stack[i].kind == Operand::Kind::Register && stack[i].index == slot;
+			if (pushed.has_value() && !readers)
+			{
+				// the instruction that computed the value writes the local instead
+				res->code[pushed.value()] = slot;
+				stack.back() = Operand{ Operand::Kind::Register, slot };
+				stack[slot] = Operand{};
+				return true;
+			}
+			flush_readers(slot);
+			auto value = stack.back();
+			if (value.kind == Operand::Kind::Slot)
+				value = Operand{ Operand::Kind::Register, top() };
+			stack[slot] = value;
+			materialize(slot);
+			return true;
+		}
+		case OpCode::GetGlobal:
+		{
+			stack.emplace_back();
+			emit(OpCode::RegGetGlobal);
+			auto destination = res->count();
+			emit(top());
+			emit(operand(offset, 0));
+			emit(operand(offset, 1));
+			produce(destination);
+			return true;
+		}
+		case OpCode::DefineGlobal:
+		case OpCode::SetGlobal:
+		{
+			auto source = read(top());
+			emit(register_form(op));
+			emit(operand(offset, 0));
+			emit(operand(offset, 1));
+			emit(source);
+			if (op == OpCode::DefineGlobal)
+				stack.pop_back();
+			return true;
+		}
+		case OpCode::GetUpvalue:
+		{
+			stack.emplace_back();
+			emit(OpCode::RegGetUpvalue);
+			auto destination = res->count();
+			emit(top());
+			emit(operand(offset, 0));
+			produce(destination);
+			return true;
+		}
+		case OpCode::SetUpvalue:
+		{
+			auto source = read(top());
+			emit(OpCode::RegSetUpvalue);
+			emit(operand(offset, 0));
+			emit(source);
+			return true;
+		}
+		case OpCode::Equal:
+		case OpCode::Greater:
+		case OpCode::Less:
+		case OpCode::Add:
+		case OpCode::Subtract:
+		case OpCode::Multiply:
+		case OpCode::Divide:
+		{
+			auto a = read(top() - 1);
+			auto b = read(top());
+			stack.pop_back();
+			emit(register_form(op));
+			auto destination = res->count();
+			emit(top());
+			emit(a);
+			emit(b);
+			produce(destination);
+			return true;
+		}
+		case OpCode::Not:
+		case OpCode::Negate:
+		{
+			auto a = read(top());
+			emit(register_form(op));
+			auto destination = res->count();
+			emit(top());
+			emit(a);
+			produce(destination);
+			return true;
+		}
+		case OpCode::Print:
+		{
+			auto a = read(top());
+			emit(OpCode::RegPrint);
+			emit(a);
+			stack.pop_back();
+			return true;
+		}
+		case OpCode::Jump:
+		case OpCode::JumpIfFalse:
+		{
+			auto target = jump_target(offset);
+			if (depths[target].has_value() && depths[target].value() != stack.size())
+				return false;
+			depths[target] = stack.size();
+			flush();
+			if (op == OpCode::Jump)
+				emit(OpCode::RegJump);
+			else
+			{
+				emit(OpCode::RegJumpIfFalse);
+				emit(top());
+			}
+			jumps.emplace_back(res->count(), target);
+			emit_short(0);
+			reachable = op == OpCode::JumpIfFalse;
+			return true;
+		}
+		case OpCode::Loop:
+		{
+			auto target = jump_target(offset);
+			if (depths[target].value_or(0) != stack.size())
+				return false;
+			flush();
+			emit(OpCode::RegLoop);
+			auto jump = res->count() + 2 - offsets[target];
+			if (jump > UINT16_MAX)
+				return false;
+			emit_short(static_cast<uint16_t>(jump));
+			reachable = false;
+			return true;
+		}
+		case OpCode::Call:
+		case OpCode::TailCall:
+		{
+			auto arg_count = operand(offset, 0);
+			flush();
+			auto base = static_cast<uint8_t>(top() - arg_count);
+			emit(op == OpCode::Call ? OpCode::RegCall : OpCode::RegTailCall);
+			emit(base);
+			emit(arg_count);
+			stack.resize(base + static_cast<size_t>(1));
+			return true;
+		}
+		case OpCode::Closure:
+		{
+			// captured locals must be in their slots
+			flush();
+			stack.emplace_back();
+			emit(OpCode::RegClosure);
+			emit(top());
+			auto length = instruction_length(chunk, offset);
+			for (size_t i = 1; i < length; i++)
+				emit(chunk.code[offset + i]);
+			return true;
+		}
+		case OpCode::CloseUpvalue:
+			materialize(top());
+			emit(OpCode::RegCloseUpvalue);
+			emit(top());
+			stack.pop_back();
+			return true;
+		case OpCode::Return:
+		{
+			auto a = read(top());
+			emit(OpCode::RegReturn);
+			emit(a);
+			stack.pop_back();
+			reachable = false;
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+std::unique_ptr<RegisterChunk> Lowering::run()
+{
+	for (size_t offset = 0; offset < chunk.count(); offset += instruction_length(chunk, offset))
+	{
+		auto op = static_cast<OpCode>(chunk.code[offset]);
+		if (op == OpCode::Jump || op == OpCode::JumpIfFalse || op == OpCode::Loop)
+			labels[jump_target(offset)] = true;
+	}
+
+	for (size_t offset = 0; offset < chunk.count(); offset += instruction_length(chunk, offset))
+	{
+		if (!instruction(offset))
+			return nullptr;
+		res->frame_size = std::max(res->frame_size, stack.size());
+		if (res->frame_size > UINT8_COUNT)
+			return nullptr;
+	}
+
+	for (auto [patch, target] : jumps)
+	{
+		auto jump = offsets[target] - (patch + 2);
+		if (jump > UINT16_MAX)
+			return nullptr;
+		res->code[patch] = static_cast<uint8_t>(jump >> 8 & 0xff);
+		res->code[patch + 1] = static_cast<uint8_t>(jump & 0xff);
+	}
+	return std::move(res);
+}
+
+}
+
+std::unique_ptr<RegisterChunk> register_compile(const ObjFunction& function)
+{
+	return Lowering(function).run();
+}
+
+} // Clox
\ No newline at end of file
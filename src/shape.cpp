@@ -0,0 +1,52 @@
+#include "shape.h"
+
+#include "memory.h"
+
+namespace Clox {
+
+namespace {
+
+Allocator<Shape> shape_allocator;
+using AllocTraits = std::allocator_traits<Allocator<Shape>>;
+
+ShapePtr make_shape(ObjClass* klass, const Shape* parent, ObjString* key)
+{
+	auto p = AllocTraits::allocate(shape_allocator, 1);
+	AllocTraits::construct(shape_allocator, p, klass, parent, key);
+	return ShapePtr(p);
+}
+
+} // namespace
+
+void ShapeDeleter::operator()(Shape* shape) const noexcept
+{
+	AllocTraits::destroy(shape_allocator, shape);
+	AllocTraits::deallocate(shape_allocator, shape, 1);
+}
+
+ShapePtr Shape::root(ObjClass* klass)
+{
+	return make_shape(klass, nullptr, nullptr);
+}
+
+std::optional<size_t> Shape::slot_of(const ObjString* name) const noexcept
+{
+	// each shape's key sits in the slot its depth counts up to
+	for (auto shape = this; shape->key != nullptr; shape = shape->parent)
+		if (shape->key == name)
+			return shape->depth - 1;
+	return std::nullopt;
+}
+
+Shape* Shape::add(ObjString* name)
+{
+	for (const auto& next : transitions)
+		if (next->key == name)
+			return next.get();
+	// allocating can collect, which marks the tree as it stands so far
+	auto next = make_shape(klass, this, name);
+	transitions.push_back(std::move(next));
+	return transitions.back().get();
+}
+
+} // Clox
\ No newline at end of file
@@ -0,0 +1,1314 @@
+#include "ssa.h"
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <utility>
+
+#include "vm.h"
+
+namespace Clox {
+
+std::string_view nameof(IrOp op)
+{
+	switch (op)
+	{
+		case IrOp::Param: return "param";
+		case IrOp::Phi: return "phi";
+		case IrOp::Constant: return "constant";
+		case IrOp::Nil: return "nil";
+		case IrOp::True: return "true";
+		case IrOp::False: return "false";
+		case IrOp::GetGlobal: return "get_global";
+		case IrOp::DefineGlobal: return "define_global";
+		case IrOp::SetGlobal: return "set_global";
+		case IrOp::GetUpvalue: return "get_upvalue";
+		case IrOp::SetUpvalue: return "set_upvalue";
+		case IrOp::GetProperty: return "get_property";
+		case IrOp::SetProperty: return "set_property";
+		case IrOp::Equal: return "equal";
+		case IrOp::Greater: return "greater";
+		case IrOp::Less: return "less";
+		case IrOp::Add: return "add";
+		case IrOp::Subtract: return "subtract";
+		case IrOp::Multiply: return "multiply";
+		case IrOp::Divide: return "divide";
+		case IrOp::Not: return "not";
+		case IrOp::Negate: return "negate";
+		case IrOp::Print: return "print";
+		case IrOp::Call: return "call";
+		case IrOp::TailCall: return "tail_call";
+		case IrOp::Invoke: return "invoke";
+		case IrOp::TailInvoke: return "tail_invoke";
+		case IrOp::Closure: return "closure";
+		case IrOp::Jump: return "jump";
+		case IrOp::Branch: return "branch";
+		case IrOp::Return: return "return";
+		default: return "unknown";
+	}
+}
+
+bool pushes(IrOp op)noexcept
+{
+	switch (op)
+	{
+		case IrOp::DefineGlobal:
+		case IrOp::Print:
+		case IrOp::Jump:
+		case IrOp::Branch:
+		case IrOp::Return:
+			return false;
+		default:
+			return true;
+	}
+}
+
+bool produces(IrOp op)noexcept
+{
+	switch (op)
+	{
+		case IrOp::SetGlobal:
+		case IrOp::SetUpvalue:
+		case IrOp::SetProperty:
+			return false;
+		default:
+			return pushes(op);
+	}
+}
+
+IrValue IrFunction::append(uint32_t block, IrInstruction instruction)
+{
+	auto value = static_cast<IrValue>(values.size());
+	instruction.block = block;
+	values.push_back(std::move(instruction));
+	blocks[block].code.push_back(value);
+	return value;
+}
+
+std::vector<uint32_t> IrFunction::reverse_postorder()const
+{
+	std::vector<uint32_t> order;
+	std::vector<bool> seen(blocks.size(), false);
+	// a block and how many of its successors are left to visit; the last are
+	// visited first, which puts the first straight after the block
+	std::vector<std::pair<uint32_t, size_t>> pending{ { 0, blocks[0].succs.size() } };
+	seen[0] = true;
+	while (!pending.empty())
+	{
+		auto [block, left] = pending.back();
+		if (left == 0)
+		{
+			order.push_back(block);
+			pending.pop_back();
+			continue;
+		}
+		pending.back().second--;
+		auto succ = blocks[block].succs[left - 1];
+		if (!seen[succ])
+		{
+			seen[succ] = true;
+			pending.emplace_back(succ, blocks[succ].succs.size());
+		}
+	}
+	std::reverse(order.begin(), order.end());
+	return order;
+}
+
+void IrFunction::split_critical_edges()
+{
+	for (uint32_t from = 0; from < blocks.size(); from++)
+	{
+		for (size_t i = 0; blocks[from].succs.size() > 1 && i < blocks[from].succs.size(); i++)
+		{
+			auto to = blocks[from].succs[i];
+			if (blocks[to].preds.size() < 2)
+				continue;
+			auto edge = static_cast<uint32_t>(blocks.size());
+			blocks.emplace_back();
+			blocks[edge].preds.push_back(from);
+			blocks[edge].succs.push_back(to);
+			append(edge, IrInstruction{ IrOp::Jump, false, 0, 0, NO_BLOCK, values[terminator(from)].line, 0, {} });
+			blocks[from].succs[i] = edge;
+			*std::find(blocks[to].preds.begin(), blocks[to].preds.end(), from) = edge;
+		}
+	}
+}
+
+void IrFunction::merge_blocks()
+{
+	for (auto block : reverse_postorder())
+	{
+		// blocks are merged into ones before them, which reach on to later ones
+		while (blocks[block].succs.size() == 1)
+		{
+			auto next = blocks[block].succs.front();
+			if (next == block || next == 0 || blocks[next].preds.size() != 1 || !blocks[next].phis.empty())
+				break;
+			values[blocks[block].code.back()].dead = true;
+			blocks[block].code.pop_back();
+			for (auto value : blocks[next].code)
+			{
+				values[value].block = block;
+				blocks[block].code.push_back(value);
+			}
+			blocks[block].succs = std::move(blocks[next].succs);
+			for (auto succ : blocks[block].succs)
+				std::replace(blocks[succ].preds.begin(), blocks[succ].preds.end(), next, block);
+			blocks[next] = IrBlock{};
+		}
+	}
+}
+
+void IrFunction::replace_uses(std::vector<IrValue>& replacements)
+{
+	auto resolve = [&replacements](IrValue value)
+	{
+		while (replacements[value] != NO_VALUE)
+			value = replacements[value];
+		return value;
+	};
+	for (auto& instruction : values)
+	{
+		if (instruction.dead)
+			continue;
+		for (auto& arg : instruction.args)
+			arg = resolve(arg);
+	}
+}
+
+void IrFunction::remove_dead()
+{
+	auto dead = [this](IrValue value) { return values[value].dead; };
+	for (auto& block : blocks)
+	{
+		block.phis.erase(std::remove_if(block.phis.begin(), block.phis.end(), dead), block.phis.end());
+		block.code.erase(std::remove_if(block.code.begin(), block.code.end(), dead), block.code.end());
+	}
+}
+
+namespace {
+
+[[nodiscard]] constexpr bool is_rematerialized(IrOp op)noexcept
+{
+	return op == IrOp::Constant || op == IrOp::Nil || op == IrOp::True || op == IrOp::False;
+}
+
+// Symbolic execution of the stack code, one block at a time in reverse
+// postorder: the stack holds the values its slots would, and a block with
+// several predecessors starts with a phi for each slot.
+struct Builder
+{
+	IrFunction ir;
+	const Chunk& chunk;
+	std::vector<uint32_t> block_at; // block starting at each offset, else NO_BLOCK
+	std::vector<size_t> starts; // offset of each block, the entry's unused
+	std::vector<size_t> lasts; // offset of each block's last instruction
+	std::vector<std::vector<IrValue>> exits; // stack at the end of each block
+	std::vector<IrValue> stack;
+	bool underflow = false;
+
+	explicit Builder(ObjFunction& function)
+		:ir(function), chunk(function.chunk), block_at(function.chunk.count() + 1, NO_BLOCK)
+	{
+	}
+
+	[[nodiscard]] uint8_t byte(size_t offset, size_t index)const noexcept
+	{
+		return chunk.code[offset + 1 + index];
+	}
+	[[nodiscard]] uint32_t operand(size_t offset, size_t width)const noexcept
+	{
+		uint32_t value = 0;
+		for (size_t i = 0; i < width; i++)
+			value = value << 8 | byte(offset, i);
+		return value;
+	}
+	[[nodiscard]] size_t jump_target(size_t offset)const noexcept
+	{
+		auto jump = operand(offset, 2);
+		if (static_cast<OpCode>(chunk.code[offset]) == OpCode::Loop)
+			return offset + 3 - jump;
+		return offset + 3 + jump;
+	}
+
+	[[nodiscard]] std::vector<IrValue> take(size_t count)
+	{
+		if (stack.size() < count)
+		{
+			underflow = true;
+			return {};
+		}
+		std::vector<IrValue> args(stack.end() - static_cast<std::ptrdiff_t>(count), stack.end());
+		stack.resize(stack.size() - count);
+		return args;
+	}
+	void push(uint32_t block, IrOp op, std::vector<IrValue> args, size_t offset, uint32_t operand = 0,
+		uint8_t arg_count = 0)
+	{
+		auto value = ir.append(block, IrInstruction{ op, false, arg_count, operand, NO_BLOCK,
+			chunk.lines.line_at(offset), offset, std::move(args) });
+		if (produces(op))
+			stack.push_back(value);
+	}
+
+	[[nodiscard]] bool find_blocks();
+	void link_blocks();
+	[[nodiscard]] bool instruction(uint32_t block, size_t offset);
+	[[nodiscard]] bool fill_phis();
+	void remove_trivial_phis();
+	[[nodiscard]] std::optional<IrFunction> run();
+};
+
+bool Builder::find_blocks()
+{
+	std::vector<bool> leaders(chunk.count() + 1, false);
+	leaders[0] = true;
+	for (size_t offset = 0; offset < chunk.count(); offset += instruction_length(chunk, offset))
+	{
+		switch (static_cast<OpCode>(chunk.code[offset]))
+		{
+			case OpCode::Jump:
+			case OpCode::JumpIfFalse:
+			case OpCode::Loop:
+			{
+				auto target = jump_target(offset);
+				if (target >= chunk.count())
+					return false;
+				leaders[target] = true;
+				leaders[offset + 3] = true;
+				break;
+			}
+			case OpCode::Return:
+				leaders[offset + 1] = true;
+				break;
+			case OpCode::Closure:
+			case OpCode::ClosureLong:
+			{
+				// captured locals would have to stay in their slots
+				auto width = static_cast<OpCode>(chunk.code[offset]) == OpCode::Closure ? 1 : 3;
+				for (auto i = offset + 1 + width; i < offset + instruction_length(chunk, offset); i += 2)
+				{
+					if (chunk.code[i] == 1)
+						return false;
+				}
+				break;
+			}
+			case OpCode::GetSuper:
+			case OpCode::GetSuperLong:
+			case OpCode::SuperInvoke:
+			case OpCode::SuperInvokeLong:
+			case OpCode::CloseUpvalue:
+			case OpCode::Class:
+			case OpCode::ClassLong:
+			case OpCode::Inherit:
+			case OpCode::Method:
+			case OpCode::MethodLong:
+			// a frame-bound function uses its declarer's locals in their slots
+			case OpCode::GetEnclosing:
+			case OpCode::SetEnclosing:
+			case OpCode::FrameClosure:
+			case OpCode::FrameClosureLong:
+				return false;
+			default:
+				break;
+		}
+	}
+
+	ir.blocks.emplace_back();
+	starts.push_back(0);
+	lasts.push_back(0);
+	for (size_t offset = 0; offset < chunk.count(); offset += instruction_length(chunk, offset))
+	{
+		if (leaders[offset])
+		{
+			block_at[offset] = static_cast<uint32_t>(ir.blocks.size());
+			ir.blocks.emplace_back();
+			starts.push_back(offset);
+			lasts.push_back(offset);
+		}
+		lasts.back() = offset;
+	}
+	return true;
+}
+
+void Builder::link_blocks()
+{
+	ir.blocks[0].succs.push_back(block_at[0]);
+	for (uint32_t block = 1; block < ir.blocks.size(); block++)
+	{
+		auto last = lasts[block];
+		auto next = block_at[last + instruction_length(chunk, last)];
+		auto& succs = ir.blocks[block].succs;
+		switch (static_cast<OpCode>(chunk.code[last]))
+		{
+			case OpCode::Jump:
+			case OpCode::Loop:
+				succs.push_back(block_at[jump_target(last)]);
+				break;
+			case OpCode::JumpIfFalse:
+				succs.push_back(next);
+				if (block_at[jump_target(last)] != next)
+					succs.push_back(block_at[jump_target(last)]);
+				break;
+			case OpCode::Return:
+				break;
+			default:
+				succs.push_back(next);
+				break;
+		}
+	}
+
+	// only reachable blocks count as predecessors, and only they get code
+	auto order = ir.reverse_postorder();
+	std::vector<bool> reachable(ir.blocks.size(), false);
+	for (auto block : order)
+		reachable[block] = true;
+	for (uint32_t block = 0; block < ir.blocks.size(); block++)
+	{
+		if (!reachable[block])
+		{
+			ir.blocks[block].succs.clear();
+			continue;
+		}
+		for (auto succ : ir.blocks[block].succs)
+			ir.blocks[succ].preds.push_back(block);
+	}
+}
+
+bool Builder::instruction(uint32_t block, size_t offset)
+{
+	auto op = static_cast<OpCode>(chunk.code[offset]);
+	switch (op)
+	{
+		case OpCode::Constant: push(block, IrOp::Constant, {}, offset, operand(offset, 1)); break;
+		case OpCode::ConstantLong: push(block, IrOp::Constant, {}, offset, operand(offset, 3)); break;
+		case OpCode::Nil: push(block, IrOp::Nil, {}, offset); break;
+		case OpCode::True: push(block, IrOp::True, {}, offset); break;
+		case OpCode::False: push(block, IrOp::False, {}, offset); break;
+		case OpCode::Pop: static_cast<void>(take(1)); break;
+		case OpCode::GetLocal:
+			if (byte(offset, 0) >= stack.size())
+				return false;
+			stack.push_back(stack[byte(offset, 0)]);
+			break;
+		case OpCode::SetLocal:
+			if (byte(offset, 0) >= stack.size())
+				return false;
+			stack[byte(offset, 0)] = stack.back();
+			break;
+		case OpCode::GetGlobal: push(block, IrOp::GetGlobal, {}, offset, operand(offset, 2)); break;
+		case OpCode::GetGlobalLong: push(block, IrOp::GetGlobal, {}, offset, operand(offset, 3)); break;
+		case OpCode::DefineGlobal: push(block, IrOp::DefineGlobal, take(1), offset, operand(offset, 2)); break;
+		case OpCode::DefineGlobalLong: push(block, IrOp::DefineGlobal, take(1), offset, operand(offset, 3)); break;
+		case OpCode::SetGlobal:
+		case OpCode::SetGlobalLong:
+		{
+			auto width = op == OpCode::SetGlobal ? 2 : 3;
+			if (stack.empty())
+				return false;
+			push(block, IrOp::SetGlobal, { stack.back() }, offset, operand(offset, width));
+			break;
+		}
+		case OpCode::GetUpvalue: push(block, IrOp::GetUpvalue, {}, offset, operand(offset, 1)); break;
+		case OpCode::SetUpvalue:
+			if (stack.empty())
+				return false;
+			push(block, IrOp::SetUpvalue, { stack.back() }, offset, operand(offset, 1));
+			break;
+		case OpCode::GetProperty: push(block, IrOp::GetProperty, take(1), offset, operand(offset, 1)); break;
+		case OpCode::GetPropertyLong: push(block, IrOp::GetProperty, take(1), offset, operand(offset, 3)); break;
+		case OpCode::SetProperty:
+		case OpCode::SetPropertyLong:
+		{
+			auto args = take(2);
+			if (underflow)
+				return false;
+			push(block, IrOp::SetProperty, args, offset, operand(offset, op == OpCode::SetProperty ? 1 : 3));
+			stack.push_back(args[1]);
+			break;
+		}
+		case OpCode::Equal: push(block, IrOp::Equal, take(2), offset); break;
+		case OpCode::Greater: push(block, IrOp::Greater, take(2), offset); break;
+		case OpCode::Less: push(block, IrOp::Less, take(2), offset); break;
+		case OpCode::Add: push(block, IrOp::Add, take(2), offset); break;
+		case OpCode::Subtract: push(block, IrOp::Subtract, take(2), offset); break;
+		case OpCode::Multiply: push(block, IrOp::Multiply, take(2), offset); break;
+		case OpCode::Divide: push(block, IrOp::Divide, take(2), offset); break;
+		case OpCode::Not: push(block, IrOp::Not, take(1), offset); break;
+		case OpCode::Negate: push(block, IrOp::Negate, take(1), offset); break;
+		case OpCode::Print: push(block, IrOp::Print, take(1), offset); break;
+		case OpCode::Call:
+		case OpCode::TailCall:
+			push(block, op == OpCode::Call ? IrOp::Call : IrOp::TailCall, take(byte(offset, 0) + size_t{ 1 }),
+				offset, 0, byte(offset, 0));
+			break;
+		case OpCode::Invoke:
+		case OpCode::TailInvoke:
+			push(block, op == OpCode::Invoke ? IrOp::Invoke : IrOp::TailInvoke,
+				take(byte(offset, 1) + size_t{ 1 }), offset, operand(offset, 1), byte(offset, 1));
+			break;
+		case OpCode::InvokeLong:
+			push(block, IrOp::Invoke, take(byte(offset, 3) + size_t{ 1 }), offset, operand(offset, 3),
+				byte(offset, 3));
+			break;
+		case OpCode::Closure: push(block, IrOp::Closure, {}, offset, operand(offset, 1)); break;
+		case OpCode::ClosureLong: push(block, IrOp::Closure, {}, offset, operand(offset, 3)); break;
+		case OpCode::Jump:
+		case OpCode::Loop:
+			push(block, IrOp::Jump, {}, offset);
+			break;
+		case OpCode::JumpIfFalse:
+			if (stack.empty())
+				return false;
+			// the condition stays on the stack either way
+			if (ir.blocks[block].succs.size() == 2)
+				push(block, IrOp::Branch, { stack.back() }, offset);
+			else
+				push(block, IrOp::Jump, {}, offset);
+			break;
+		case OpCode::Return: push(block, IrOp::Return, take(1), offset); break;
+		default:
+			return false;
+	}
+	return !underflow;
+}
+
+bool Builder::fill_phis()
+{
+	for (auto& block : ir.blocks)
+	{
+		for (auto pred : block.preds)
+		{
+			if (exits[pred].size() != block.phis.size() && !block.phis.empty())
+				return false;
+		}
+		for (size_t slot = 0; slot < block.phis.size(); slot++)
+		{
+			for (auto pred : block.preds)
+				ir[block.phis[slot]].args.push_back(exits[pred][slot]);
+		}
+	}
+	return true;
+}
+
+// A phi whose args are all one value, or itself, is that value. Dropping
+// one can make others trivial, so this runs until none are left.
+void Builder::remove_trivial_phis()
+{
+	std::vector<IrValue> replacements(ir.values.size(), NO_VALUE);
+	auto resolve = [&replacements](IrValue value)
+	{
+		while (replacements[value] != NO_VALUE)
+			value = replacements[value];
+		return value;
+	};
+	auto changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (const auto& block : ir.blocks)
+		{
+			for (auto phi : block.phis)
+			{
+				if (ir[phi].dead)
+					continue;
+				auto same = NO_VALUE;
+				auto trivial = true;
+				for (auto arg : ir[phi].args)
+				{
+					arg = resolve(arg);
+					if (arg == phi || arg == same)
+						continue;
+					if (same != NO_VALUE)
+					{
+						trivial = false;
+						break;
+					}
+					same = arg;
+				}
+				if (trivial && same != NO_VALUE)
+				{
+					replacements[phi] = same;
+					ir[phi].dead = true;
+					changed = true;
+				}
+			}
+		}
+	}
+	ir.replace_uses(replacements);
+	ir.remove_dead();
+}
+
+std::optional<IrFunction> Builder::run()
+{
+	if (!find_blocks())
+		return std::nullopt;
+	link_blocks();
+
+	exits.resize(ir.blocks.size());
+	ir.values.reserve(chunk.count() / 2); // instructions average more than two bytes
+	std::vector<bool> done(ir.blocks.size(), false);
+	const auto& function = ir.function;
+	for (auto block : ir.reverse_postorder())
+	{
+		stack.clear();
+		if (block == 0)
+		{
+			for (uint32_t slot = 0; slot <= function.arity; slot++)
+				push(0, IrOp::Param, {}, 0, slot);
+			push(0, IrOp::Jump, {}, 0);
+			exits[0] = stack;
+			done[0] = true;
+			continue;
+		}
+
+		const auto& preds = ir.blocks[block].preds;
+		auto first = *std::find_if(preds.begin(), preds.end(), [&done](uint32_t pred) { return done[pred]; });
+		if (preds.size() == 1)
+			stack = exits[first];
+		else
+		{
+			for (size_t slot = 0; slot < exits[first].size(); slot++)
+			{
+				auto phi = static_cast<IrValue>(ir.values.size());
+				ir.values.push_back(IrInstruction{ IrOp::Phi, false, 0, static_cast<uint32_t>(slot), block,
+					chunk.lines.line_at(starts[block]), starts[block], {} });
+				ir.blocks[block].phis.push_back(phi);
+				stack.push_back(phi);
+			}
+		}
+
+		for (auto offset = starts[block]; offset <= lasts[block]; offset += instruction_length(chunk, offset))
+		{
+			if (!instruction(block, offset))
+				return std::nullopt;
+		}
+		// falling through into the next block
+		const auto& code = ir.blocks[block].code;
+		auto last = code.empty() ? IrOp::Param : ir[code.back()].op;
+		if (last != IrOp::Jump && last != IrOp::Branch && last != IrOp::Return)
+			push(block, IrOp::Jump, {}, lasts[block]);
+		exits[block] = stack;
+		done[block] = true;
+	}
+
+	if (!fill_phis())
+		return std::nullopt;
+	remove_trivial_phis();
+	ir.merge_blocks();
+	return std::move(ir);
+}
+
+// Puts the blocks in reverse postorder and gives a slot of the frame to each
+// value that is not left on the stack for its only use, nor a literal
+// pushed again wherever it is needed. Slots are handed out first fit over
+// the segments of the layout each value is live in, a phi and the values
+// copied into it trying each other's slot first so the copy goes away.
+struct StackLowering
+{
+	IrFunction& ir;
+	const Chunk& chunk; // Closure copies its captures from the original code
+	std::vector<uint32_t> layout;
+	std::vector<uint32_t> placed; // index in layout of each block
+	std::vector<uint32_t> use_count;
+	std::vector<uint32_t> use_block; // where a value used once is used, a phi's arg at its pred's end
+	std::vector<bool> inlined; // computed where its one use needs it, the stack hands it over
+	std::vector<size_t> starts, ends; // positions of each block's entry and terminator
+	std::vector<size_t> written; // where each value is written to its slot
+	std::vector<std::vector<std::pair<size_t, size_t>>> ranges; // a slot value holds its slot in
+	std::vector<uint32_t> segment_walk; // the walk of live_until() that last reached each block
+	std::vector<size_t> segment_of; // and the segment it made there
+	uint32_t walk = 0;
+	std::vector<uint32_t> slots;
+	size_t frame_size = 0;
+
+	std::vector<uint8_t> code;
+	LineTable<> lines;
+	std::vector<size_t> caches; // offset of the instruction owning each
+	std::vector<size_t> offsets; // of each block
+	std::vector<std::pair<size_t, uint32_t>> jumps; // forward jump operand, target block
+	size_t line = 0;
+	bool overflow = false;
+
+	static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+	explicit StackLowering(IrFunction& ir) :ir(ir), chunk(ir.function.chunk) {}
+
+	[[nodiscard]] bool needs_slot(IrValue value)const
+	{
+		const auto& instruction = ir[value];
+		return produces(instruction.op) && !is_rematerialized(instruction.op) && !inlined[value]
+			&& (use_count[value] > 0 || instruction.op == IrOp::Param);
+	}
+	// the arg of phi coming from pred
+	[[nodiscard]] IrValue incoming(IrValue phi, uint32_t pred)const
+	{
+		const auto& preds = ir.blocks[ir[phi].block].preds;
+		return ir[phi].args[static_cast<size_t>(std::find(preds.begin(), preds.end(), pred) - preds.begin())];
+	}
+
+	void count_uses();
+	void order(IrValue value, std::vector<IrValue>& emitted)const;
+	void schedule(uint32_t block);
+	void live_until(IrValue value, uint32_t block, size_t at);
+	void find_ranges();
+	[[nodiscard]] bool allocate_slots();
+
+	void emit(uint8_t byte)
+	{
+		code.push_back(byte);
+		lines.add(code.size() - 1, line);
+	}
+	void emit(OpCode op) { emit(static_cast<uint8_t>(op)); }
+	void emit_operand(size_t operand, size_t width)
+	{
+		for (auto i = width; i > 0; i--)
+			emit(static_cast<uint8_t>(operand >> (8 * (i - 1)) & 0xff));
+	}
+	// for the instruction emitted from start
+	void emit_cache(size_t start)
+	{
+		auto cache = caches.size();
+		caches.push_back(start);
+		overflow |= cache > UINT16_MAX;
+		emit_operand(cache, 2);
+	}
+
+	void push_value(IrValue value);
+	void emit_tree(IrValue value);
+	void emit_operation(IrValue value);
+	void emit_jump(uint32_t from, uint32_t to);
+	void emit_copies(uint32_t from, uint32_t to);
+	void emit_block(uint32_t block);
+	[[nodiscard]] bool run();
+};
+
+void StackLowering::count_uses()
+{
+	use_count.assign(ir.values.size(), 0);
+	use_block.assign(ir.values.size(), NO_BLOCK);
+	for (auto block : layout)
+	{
+		for (auto value : ir.blocks[block].code)
+		{
+			for (auto arg : ir[value].args)
+			{
+				use_count[arg]++;
+				use_block[arg] = block;
+			}
+		}
+		for (auto phi : ir.blocks[block].phis)
+		{
+			for (size_t i = 0; i < ir[phi].args.size(); i++)
+			{
+				use_count[ir[phi].args[i]]++;
+				use_block[ir[phi].args[i]] = ir.blocks[block].preds[i];
+			}
+		}
+	}
+
+	inlined.assign(ir.values.size(), false);
+	for (IrValue value = 0; value < ir.values.size(); value++)
+	{
+		const auto& instruction = ir[value];
+		inlined[value] = !instruction.dead && produces(instruction.op) && !is_rematerialized(instruction.op)
+			&& instruction.op != IrOp::Param && instruction.op != IrOp::Phi
+			&& use_count[value] == 1 && use_block[value] == instruction.block;
+	}
+}
+
+// the order emitting value runs the instructions it computes in
+void StackLowering::order(IrValue value, std::vector<IrValue>& emitted)const
+{
+	for (auto arg : ir[value].args)
+	{
+		if (inlined[arg])
+			order(arg, emitted);
+	}
+	emitted.push_back(value);
+}
+
+// An inlined value runs where its use is emitted rather than where it is
+// defined, which must not move it past anything else in the block. Values
+// that would move are given slots until the block runs in its own order.
+void StackLowering::schedule(uint32_t block)
+{
+	const auto& instructions = ir.blocks[block].code;
+	std::vector<IrValue> original;
+	for (auto value : instructions)
+	{
+		if (!is_rematerialized(ir[value].op))
+			original.push_back(value);
+	}
+
+	std::vector<IrValue> emitted;
+	while (true)
+	{
+		emitted.clear();
+		for (size_t i = 0; i + 1 < instructions.size(); i++)
+		{
+			if (!is_rematerialized(ir[instructions[i]].op) && !inlined[instructions[i]])
+				order(instructions[i], emitted);
+		}
+		for (auto succ : ir.blocks[block].succs)
+		{
+			for (auto phi : ir.blocks[succ].phis)
+			{
+				auto arg = incoming(phi, block);
+				if (inlined[arg])
+					order(arg, emitted);
+			}
+		}
+		order(instructions.back(), emitted);
+
+		auto [expected, got] = std::mismatch(original.begin(), original.end(), emitted.begin(), emitted.end());
+		if (expected == original.end())
+			return;
+		if (got != emitted.end() && inlined[*got])
+			inlined[*got] = false;
+		else if (inlined[*expected])
+			inlined[*expected] = false;
+		else
+		{
+			for (auto value : instructions)
+				inlined[value] = false;
+		}
+	}
+}
+
+// value is read at the position at in block, so live on every path from its
+// definition there
+void StackLowering::live_until(IrValue value, uint32_t block, size_t at)
+{
+	const auto& instruction = ir[value];
+	auto from = [this, &instruction, value](uint32_t block)
+	{
+		return block == instruction.block ? written[value] : 2 * starts[block];
+	};
+	auto& segments = ranges[value];
+	auto extend = [this, &segments](uint32_t block, size_t start, size_t end)
+	{
+		if (segment_walk[block] != walk)
+		{
+			segment_walk[block] = walk;
+			segment_of[block] = segments.size();
+			segments.emplace_back(start, end);
+		} else
+			segments[segment_of[block]].second = std::max(segments[segment_of[block]].second, end);
+	};
+
+	extend(block, from(block), at);
+	if (block == instruction.block)
+		return;
+	std::vector<uint32_t> pending(ir.blocks[block].preds);
+	while (!pending.empty())
+	{
+		auto current = pending.back();
+		pending.pop_back();
+		auto reached = segment_walk[current] == walk && segments[segment_of[current]].second == 2 * ends[current] + 1;
+		extend(current, from(current), 2 * ends[current] + 1);
+		if (reached || current == instruction.block)
+			continue;
+		pending.insert(pending.end(), ir.blocks[current].preds.begin(), ir.blocks[current].preds.end());
+	}
+}
+
+void StackLowering::find_ranges()
+{
+	// an instruction at n reads its operands at 2n and writes its result at
+	// 2n + 1, so one value may take the slot of another it reads last
+	written.assign(ir.values.size(), 0);
+	ranges.assign(ir.values.size(), {});
+	starts.assign(ir.blocks.size(), 0);
+	ends.assign(ir.blocks.size(), 0);
+	size_t at = 0;
+	for (auto block : layout)
+	{
+		starts[block] = at++;
+		for (auto phi : ir.blocks[block].phis)
+			written[phi] = 2 * starts[block];
+		for (auto value : ir.blocks[block].code)
+			written[value] = 2 * at++ + 1;
+		ends[block] = at - 1;
+	}
+
+	std::vector<std::vector<std::pair<uint32_t, size_t>>> reads(ir.values.size());
+	for (auto block : layout)
+	{
+		for (auto value : ir.blocks[block].code)
+		{
+			for (auto arg : ir[value].args)
+			{
+				if (needs_slot(arg))
+					reads[arg].emplace_back(block, written[value] - 1);
+			}
+		}
+		// copies at the end of each predecessor read the args, then write the phis
+		for (auto phi : ir.blocks[block].phis)
+		{
+			for (size_t i = 0; i < ir[phi].args.size(); i++)
+			{
+				auto pred = ir.blocks[block].preds[i];
+				if (needs_slot(ir[phi].args[i]))
+					reads[ir[phi].args[i]].emplace_back(pred, 2 * ends[pred]);
+				if (needs_slot(phi))
+					ranges[phi].emplace_back(2 * ends[pred] + 1, 2 * ends[pred] + 1);
+			}
+		}
+	}
+
+	segment_walk.assign(ir.blocks.size(), 0);
+	segment_of.assign(ir.blocks.size(), 0);
+	for (IrValue value = 0; value < ir.values.size(); value++)
+	{
+		if (ir[value].dead || ir[value].block == NO_BLOCK || !needs_slot(value))
+			continue;
+		walk++;
+		ranges[value].emplace_back(written[value], written[value]);
+		for (auto [block, at] : reads[value])
+			live_until(value, block, at);
+
+		auto& segments = ranges[value];
+		std::sort(segments.begin(), segments.end());
+		size_t merged = 0;
+		for (size_t i = 1; i < segments.size(); i++)
+		{
+			if (segments[i].first <= segments[merged].second + 1)
+				segments[merged].second = std::max(segments[merged].second, segments[i].second);
+			else
+				segments[++merged] = segments[i];
+		}
+		segments.resize(merged + 1);
+	}
+}
+
+bool StackLowering::allocate_slots()
+{
+	slots.assign(ir.values.size(), NO_SLOT);
+	std::vector<IrValue> values;
+	for (auto block : layout)
+	{
+		for (auto phi : ir.blocks[block].phis)
+		{
+			if (needs_slot(phi))
+				values.push_back(phi);
+		}
+		for (auto value : ir.blocks[block].code)
+		{
+			if (needs_slot(value))
+				values.push_back(value);
+		}
+	}
+	std::stable_sort(values.begin(), values.end(),
+		[this](IrValue a, IrValue b) { return ranges[a].front().first < ranges[b].front().first; });
+
+	// the phi each value is copied into, whose slot saves the copy
+	std::vector<IrValue> copied_to(ir.values.size(), NO_VALUE);
+	for (auto block : layout)
+	{
+		for (auto phi : ir.blocks[block].phis)
+		{
+			for (auto arg : ir[phi].args)
+				copied_to[arg] = phi;
+		}
+	}
+
+	// the segments each slot is taken for, by where they start
+	std::vector<std::map<size_t, size_t>> taken;
+	auto fits = [this, &taken](IrValue value, uint32_t slot)
+	{
+		for (auto [start, end] : ranges[value])
+		{
+			auto after = taken[slot].upper_bound(end);
+			if (after != taken[slot].begin() && std::prev(after)->second >= start)
+				return false;
+		}
+		return true;
+	};
+	frame_size = ir.function.arity + 1;
+	taken.resize(frame_size);
+	for (auto value : values)
+	{
+		const auto& instruction = ir[value];
+		std::vector<uint32_t> preferred;
+		if (instruction.op == IrOp::Param)
+			preferred.push_back(instruction.operand);
+		if (instruction.op == IrOp::Phi)
+		{
+			for (auto arg : instruction.args)
+				preferred.push_back(slots[arg]);
+		}
+		if (copied_to[value] != NO_VALUE)
+			preferred.push_back(slots[copied_to[value]]);
+
+		auto slot = NO_SLOT;
+		for (auto candidate : preferred)
+		{
+			if (candidate != NO_SLOT && fits(value, candidate))
+			{
+				slot = candidate;
+				break;
+			}
+		}
+		for (uint32_t candidate = 0; slot == NO_SLOT && candidate < frame_size; candidate++)
+		{
+			if (fits(value, candidate))
+				slot = candidate;
+		}
+		if (slot == NO_SLOT)
+		{
+			slot = static_cast<uint32_t>(frame_size++);
+			taken.emplace_back();
+		}
+		slots[value] = slot;
+		for (auto [start, end] : ranges[value])
+			taken[slot].emplace(start, end);
+	}
+	return frame_size <= UINT8_COUNT;
+}
+
+void StackLowering::push_value(IrValue value)
+{
+	const auto& instruction = ir[value];
+	switch (instruction.op)
+	{
+		case IrOp::Constant:
+			if (instruction.operand <= UINT8_MAX)
+			{
+				emit(OpCode::Constant);
+				emit_operand(instruction.operand, 1);
+			} else
+			{
+				emit(OpCode::ConstantLong);
+				emit_operand(instruction.operand, 3);
+			}
+			return;
+		case IrOp::Nil: emit(OpCode::Nil); return;
+		case IrOp::True: emit(OpCode::True); return;
+		case IrOp::False: emit(OpCode::False); return;
+		default:
+			break;
+	}
+	if (inlined[value])
+	{
+		emit_tree(value);
+		return;
+	}
+	emit(OpCode::GetLocal);
+	emit(static_cast<uint8_t>(slots[value]));
+}
+
+void StackLowering::emit_tree(IrValue value)
+{
+	const auto& instruction = ir[value];
+	for (auto arg : instruction.args)
+		push_value(arg);
+	line = instruction.line;
+	emit_operation(value);
+}
+
+void StackLowering::emit_operation(IrValue value)
+{
+	const auto& instruction = ir[value];
+	auto start = code.size();
+	auto unchecked = instruction.unchecked;
+	auto global = [this, &instruction](OpCode op)
+	{
+		auto wide = instruction.operand > UINT16_MAX;
+		emit(wide ? long_form(op) : op);
+		emit_operand(instruction.operand, wide ? 3 : 2);
+	};
+	auto named = [this, &instruction](OpCode op)
+	{
+		auto wide = instruction.operand > UINT8_MAX;
+		emit(wide ? long_form(op) : op);
+		emit_operand(instruction.operand, wide ? 3 : 1);
+		return wide;
+	};
+
+	switch (instruction.op)
+	{
+		case IrOp::GetGlobal: global(OpCode::GetGlobal); break;
+		case IrOp::DefineGlobal: global(OpCode::DefineGlobal); break;
+		case IrOp::SetGlobal: global(OpCode::SetGlobal); break;
+		case IrOp::GetUpvalue:
+			emit(OpCode::GetUpvalue);
+			emit_operand(instruction.operand, 1);
+			break;
+		case IrOp::SetUpvalue:
+			emit(OpCode::SetUpvalue);
+			emit_operand(instruction.operand, 1);
+			break;
+		case IrOp::GetProperty:
+			static_cast<void>(named(OpCode::GetProperty));
+			emit_cache(start);
+			break;
+		case IrOp::SetProperty:
+			static_cast<void>(named(OpCode::SetProperty));
+			emit_cache(start);
+			break;
+		case IrOp::Equal: emit(OpCode::Equal); break;
+		case IrOp::Greater: emit(unchecked ? OpCode::GreaterUnchecked : OpCode::Greater); break;
+		case IrOp::Less: emit(unchecked ? OpCode::LessUnchecked : OpCode::Less); break;
+		case IrOp::Add: emit(unchecked ? OpCode::AddUnchecked : OpCode::Add); break;
+		case IrOp::Subtract: emit(unchecked ? OpCode::SubtractUnchecked : OpCode::Subtract); break;
+		case IrOp::Multiply: emit(unchecked ? OpCode::MultiplyUnchecked : OpCode::Multiply); break;
+		case IrOp::Divide: emit(unchecked ? OpCode::DivideUnchecked : OpCode::Divide); break;
+		case IrOp::Not: emit(OpCode::Not); break;
+		case IrOp::Negate: emit(unchecked ? OpCode::NegateUnchecked : OpCode::Negate); break;
+		case IrOp::Print: emit(OpCode::Print); break;
+		case IrOp::Call:
+		case IrOp::TailCall:
+			emit(instruction.op == IrOp::Call ? OpCode::Call : OpCode::TailCall);
+			emit(instruction.arg_count);
+			break;
+		case IrOp::Invoke:
+		case IrOp::TailInvoke:
+		{
+			// InvokeLong has no tail form, the Return after it returns its result
+			auto wide = instruction.operand > UINT8_MAX;
+			emit(wide ? OpCode::InvokeLong :
+				instruction.op == IrOp::Invoke ? OpCode::Invoke : OpCode::TailInvoke);
+			emit_operand(instruction.operand, wide ? 3 : 1);
+			emit(instruction.arg_count);
+			emit_cache(start);
+			break;
+		}
+		case IrOp::Closure:
+		{
+			named(OpCode::Closure);
+			auto source = instruction.source;
+			auto captures = static_cast<OpCode>(chunk.code[source]) == OpCode::Closure ? source + 2 : source + 4;
+			for (auto i = captures; i < source + instruction_length(chunk, source); i++)
+				emit(chunk.code[i]);
+			break;
+		}
+		case IrOp::Return: emit(OpCode::Return); break;
+		default:
+			break;
+	}
+}
+
+void StackLowering::emit_jump(uint32_t from, uint32_t to)
+{
+	if (placed[to] == placed[from] + 1)
+		return;
+	if (placed[to] <= placed[from])
+	{
+		emit(OpCode::Loop);
+		auto jump = code.size() + 2 - offsets[to];
+		overflow |= jump > UINT16_MAX;
+		emit_operand(jump, 2);
+		return;
+	}
+	emit(OpCode::Jump);
+	jumps.emplace_back(code.size(), to);
+	emit_operand(0, 2);
+}
+
+// Phis take their values all at once: every arg is pushed before any slot is
+// written, so a phi's arg may be another phi of the same block.
+void StackLowering::emit_copies(uint32_t from, uint32_t to)
+{
+	std::vector<IrValue> written;
+	for (auto phi : ir.blocks[to].phis)
+	{
+		if (!needs_slot(phi))
+			continue;
+		auto arg = incoming(phi, from);
+		if (!is_rematerialized(ir[arg].op) && !inlined[arg] && slots[arg] == slots[phi])
+			continue;
+		push_value(arg);
+		written.push_back(phi);
+	}
+	for (auto phi = written.rbegin(); phi != written.rend(); ++phi)
+	{
+		emit(OpCode::SetLocal);
+		emit(static_cast<uint8_t>(slots[*phi]));
+		emit(OpCode::Pop);
+	}
+}
+
+void StackLowering::emit_block(uint32_t block)
+{
+	const auto& preds = ir.blocks[block].preds;
+	offsets[block] = code.size();
+	line = ir[ir.blocks[block].code.front()].line;
+	if (block == 0)
+	{
+		// the slots past the arguments, all in place before the first value is stored
+		for (auto slot = ir.function.arity + 1; slot < frame_size; slot++)
+			emit(OpCode::Nil);
+	}
+	// a Branch leaves its condition for both successors to pop
+	if (preds.size() == 1 && ir[ir.terminator(preds.front())].op == IrOp::Branch)
+		emit(OpCode::Pop);
+
+	const auto& instructions = ir.blocks[block].code;
+	for (size_t i = 0; i + 1 < instructions.size(); i++)
+	{
+		auto value = instructions[i];
+		if (is_rematerialized(ir[value].op) || inlined[value] || ir[value].op == IrOp::Param)
+			continue;
+		emit_tree(value);
+		if (!pushes(ir[value].op))
+			continue;
+		if (needs_slot(value))
+		{
+			emit(OpCode::SetLocal);
+			emit(static_cast<uint8_t>(slots[value]));
+		}
+		emit(OpCode::Pop);
+	}
+
+	auto terminator = ir.terminator(block);
+	const auto& succs = ir.blocks[block].succs;
+	line = ir[terminator].line;
+	switch (ir[terminator].op)
+	{
+		case IrOp::Jump:
+			emit_copies(block, succs[0]);
+			line = ir[terminator].line;
+			emit_jump(block, succs[0]);
+			break;
+		case IrOp::Branch:
+			push_value(ir[terminator].args[0]);
+			line = ir[terminator].line;
+			overflow |= placed[succs[1]] <= placed[block];
+			emit(OpCode::JumpIfFalse);
+			jumps.emplace_back(code.size(), succs[1]);
+			emit_operand(0, 2);
+			emit_jump(block, succs[0]);
+			break;
+		default:
+			emit_tree(terminator);
+			break;
+	}
+}
+
+bool StackLowering::run()
+{
+	ir.merge_blocks();
+	ir.split_critical_edges();
+	layout = ir.reverse_postorder();
+	placed.assign(ir.blocks.size(), NO_BLOCK);
+	for (uint32_t i = 0; i < layout.size(); i++)
+		placed[layout[i]] = i;
+
+	count_uses();
+	for (auto block : layout)
+		schedule(block);
+	find_ranges();
+	if (!allocate_slots())
+		return false;
+
+	offsets.assign(ir.blocks.size(), 0);
+	for (auto block : layout)
+		emit_block(block);
+	for (auto [patch, target] : jumps)
+	{
+		auto jump = offsets[target] - (patch + 2);
+		overflow |= jump > UINT16_MAX;
+		code[patch] = static_cast<uint8_t>(jump >> 8 & 0xff);
+		code[patch + 1] = static_cast<uint8_t>(jump & 0xff);
+	}
+	if (overflow)
+		return false;
+
+	auto& function = ir.function;
+	function.chunk.code.assign(code.begin(), code.end());
+	function.chunk.lines.strip();
+	for (const auto& run : lines.runs)
+		function.chunk.lines.add(run.offset, run.line);
+	function.chunk.caches.clear();
+	for (auto offset : caches)
+		static_cast<void>(function.chunk.add_cache(offset));
+	function.slot_count = frame_size;
+	return true;
+}
+
+}
+
+std::optional<IrFunction> build_ir(ObjFunction& function)
+{
+	return Builder(function).run();
+}
+
+bool lower_ir(IrFunction& ir)
+{
+	return StackLowering(ir).run();
+}
+
+void print_ir(const IrFunction& ir, std::string_view name)
+{
+	std::cout << "== " << name << " ==\n";
+	const auto& constants = ir.function.chunk.constants.values;
+	auto print = [&ir, &constants](IrValue value)
+	{
+		const auto& instruction = ir[value];
+		std::cout << "    ";
+		if (produces(instruction.op))
+			std::cout << 'v' << value << " = ";
+		std::cout << nameof(instruction.op);
+		if (instruction.unchecked)
+			std::cout << " unchecked";
+		switch (instruction.op)
+		{
+			case IrOp::Param:
+			case IrOp::Phi:
+				std::cout << " slot " << instruction.operand;
+				break;
+			case IrOp::Constant:
+			case IrOp::GetProperty:
+			case IrOp::SetProperty:
+			case IrOp::Invoke:
+			case IrOp::TailInvoke:
+				std::cout << " '" << constants.at(instruction.operand) << '\'';
+				break;
+			case IrOp::GetGlobal:
+			case IrOp::DefineGlobal:
+			case IrOp::SetGlobal:
+				std::cout << " slot " << instruction.operand;
+				break;
+			case IrOp::GetUpvalue:
+			case IrOp::SetUpvalue:
+				std::cout << ' ' << instruction.operand;
+				break;
+			case IrOp::Closure:
+				std::cout << ' ' << constants.at(instruction.operand);
+				break;
+			default:
+				break;
+		}
+		for (auto arg : instruction.args)
+			std::cout << " v" << arg;
+		std::cout << '\n';
+	};
+
+	for (auto block : ir.reverse_postorder())
+	{
+		std::cout << 'b' << block << ':';
+		if (!ir.blocks[block].preds.empty())
+		{
+			std::cout << " <-";
+			for (auto pred : ir.blocks[block].preds)
+				std::cout << " b" << pred;
+		}
+		std::cout << '\n';
+		for (auto phi : ir.blocks[block].phis)
+			print(phi);
+		for (const auto& value : ir.blocks[block].code)
+		{
+			print(value);
+			if (&value == &ir.blocks[block].code.back() && !ir.blocks[block].succs.empty())
+			{
+				std::cout << "     ";
+				for (auto succ : ir.blocks[block].succs)
+					std::cout << " -> b" << succ;
+				std::cout << '\n';
+			}
+		}
+	}
+}
+
+} // Clox
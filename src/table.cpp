@@ -0,0 +1,136 @@
+#include "table.h"
+
+#include "obj_string.h"
+
+namespace Clox {
+
+constexpr auto TABLE_MAX_LOAD = 0.75;
+
+Value* Table::find(const ObjString* key)noexcept
+{
+	if (count == 0)
+		return nullptr;
+
+	auto& entry = find_entry(entries, key);
+	if (entry.key == nullptr)
+		return nullptr;
+	return &entry.value;
+}
+
+const Value* Table::find(const ObjString* key)const noexcept
+{
+	return const_cast<Table*>(this)->find(key);
+}
+
+bool Table::set(ObjString* key, const Value& value)
+{
+	if (count + 1 > entries.size() * TABLE_MAX_LOAD)
+		adjust_capacity(entries.size() < 8 ? 8 : entries.size() * 2);
+
+	auto& entry = find_entry(entries, key);
+	auto is_new = entry.key == nullptr;
+	// reusing a tombstone leaves count unchanged, it was counted already
+	if (is_new && entry.value.is_nil())
+		count++;
+
+	entry.key = key;
+	entry.value = value;
+	return is_new;
+}
+
+bool Table::erase(const ObjString* key)noexcept
+{
+	if (count == 0)
+		return false;
+
+	auto& entry = find_entry(entries, key);
+	if (entry.key == nullptr)
+		return false;
+
+	entry.key = nullptr;
+	entry.value = Value(true);
+	return true;
+}
+
+void Table::add_all(const Table& from)
+{
+	from.for_each([this](ObjString* key, const Value& value) { set(key, value); });
+}
+
+ObjString* Table::find_string(std::string_view text, uint32_t hash)const noexcept
+{
+	if (count == 0)
+		return nullptr;
+
+	auto mask = entries.size() - 1;
+	auto index = hash & mask;
+	for (;;)
+	{
+		auto& entry = entries[index];
+		if (entry.key == nullptr)
+		{
+			// stop at an empty slot, probe on past a tombstone
+			if (entry.value.is_nil())
+				return nullptr;
+		} else if (entry.key->hash == hash && entry.key->text() == text)
+			return entry.key;
+
+		index = (index + 1) & mask;
+	}
+}
+
+void Table::remove_white()noexcept
+{
+	for (auto& entry : entries)
+	{
+		if (entry.key != nullptr && !entry.key->is_marked)
+		{
+			entry.key = nullptr;
+			entry.value = Value(true);
+		}
+	}
+}
+
+Entry& Table::find_entry(std::vector<Entry, Allocator<Entry>>& entries,
+	const ObjString* key)const noexcept
+{
+	// capacity is always a power of two
+	auto mask = entries.size() - 1;
+	auto index = key->hash & mask;
+	Entry* tombstone = nullptr;
+
+	for (;;)
+	{
+		auto& entry = entries[index];
+		if (entry.key == nullptr)
+		{
+			if (entry.value.is_nil())
+				return tombstone != nullptr ? *tombstone : entry;
+			if (tombstone == nullptr)
+				tombstone = &entry;
+		} else if (entry.key == key)
+			return entry;
+
+		index = (index + 1) & mask;
+	}
+}
+
+void Table::adjust_capacity(size_t capacity)
+{
+	// may collect, the old entries stay reachable until the swap below
+	std::vector<Entry, Allocator<Entry>> resized(capacity);
+
+	count = 0;
+	for (auto& entry : entries)
+	{
+		if (entry.key == nullptr)
+			continue;
+		auto& dest = find_entry(resized, entry.key);
+		dest.key = entry.key;
+		dest.value = entry.value;
+		count++;
+	}
+	entries.swap(resized);
+}
+
+} // Clox
\ No newline at end of file
@@ -1,10 +1,26 @@
 #include "value.h"
 
+#include <cmath>
+
 #include "object.h"
 #include "obj_string.h"
 
 namespace Clox {
 
+namespace {
+
+// the sign of a NaN depends on how it was computed, which differs between
+// VM::run, the JIT and constant folding, so every NaN prints the same
+void print_number(std::ostream& out, double number)
+{
+	if (std::isnan(number))
+		out << "nan";
+	else
+		out << number;
+}
+
+} // namespace
+
 std::ostream& operator<<(std::ostream& out, const Value& value)
 {
 #ifdef NAN_BOXING
@@ -14,7 +30,7 @@ std::ostream& operator<<(std::ostream& out, const Value& value)
 	else if (value.is_nil())
 		out << "nil";
 	else if (value.is_number())
-		out << value.as<double>();
+		print_number(out, value.as<double>());
 	else if (value.is_obj())
 		out << *value.as<Obj*>();
 
@@ -27,7 +43,7 @@ std::ostream& operator<<(std::ostream& out, const Value& value)
 			else if constexpr (std::is_same_v<T, std::monostate>)
 				std::cout << "nil";
 			else if constexpr (std::is_same_v<T, double>)
-				std::cout << arg;
+				print_number(std::cout, arg);
 			else if constexpr (std::is_same_v<T, Obj*>)
 				out << *arg;
 		}, value.value);
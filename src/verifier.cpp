@@ -0,0 +1,353 @@
+#include "verifier.h"
+
+#include <vector>
+
+#include "object.h"
+#include "obj_string.h"
+
+namespace Clox {
+
+namespace {
+
+struct Verifier
+{
+	const ObjFunction& function;
+	const Chunk& chunk;
+	const size_t global_count;
+	std::vector<bool> starts; // offsets where an instruction begins
+	std::vector<size_t> targets; // jump destinations, checked once all starts are known
+
+	Verifier(const ObjFunction& function, size_t global_count)
+		:function(function), chunk(function.chunk), global_count(global_count),
+		starts(function.chunk.count(), false)
+	{
+	}
+
+	[[nodiscard]] bool has_operands(size_t offset, size_t count)const noexcept
+	{
+		return offset + count < chunk.count();
+	}
+
+	[[nodiscard]] uint8_t operand(size_t offset, size_t index)const noexcept
+	{
+		return chunk.code[offset + 1 + index];
+	}
+
+	[[nodiscard]] size_t long_operand(size_t offset, size_t index)const noexcept
+	{
+		return static_cast<size_t>(operand(offset, index) << 16 | operand(offset, index + 1) << 8
+			| operand(offset, index + 2));
+	}
+
+	[[nodiscard]] bool is_constant(size_t index)const noexcept
+	{
+		return index < chunk.constants.count();
+	}
+
+	[[nodiscard]] bool is_cache(size_t offset, size_t index)const noexcept
+	{
+		auto cache = static_cast<size_t>(operand(offset, index) << 8 | operand(offset, index + 1));
+		return cache < chunk.caches.size() && chunk.caches[cache].offset == offset;
+	}
+
+	[[nodiscard]] bool is_string_constant(size_t index)const
+	{
+		return is_constant(index) && chunk.constants.values[index].is_obj_type<ObjString>();
+	}
+
+	[[nodiscard]] std::optional<std::string_view> closure(size_t& offset, size_t constant, size_t operands);
+	[[nodiscard]] std::optional<std::string_view> run();
+	[[nodiscard]] std::optional<std::string_view> instruction(size_t& offset);
+};
+
+std::optional<std::string_view> Verifier::run()
+{
+	if (chunk.count() == 0)
+		return "Empty chunk.";
+
+	size_t last = 0;
+	for (size_t offset = 0; offset < chunk.count();)
+	{
+		last = offset;
+		starts[offset] = true;
+		auto failure = instruction(offset);
+		if (failure.has_value())
+			return failure;
+	}
+
+	for (auto target : targets)
+	{
+		if (target >= chunk.count() || !starts[target])
+			return "Jump target is not an instruction.";
+	}
+
+	// VM::call only makes room for max_depth slots
+	if (function.slot_count > function.max_depth
+		|| max_stack_depth(chunk, static_cast<int>(function.arity) + 1) > function.max_depth)
+		return "Stack depth exceeds the frame.";
+
+	// execution must never run past the end of the code
+	switch (static_cast<OpCode>(chunk.code[last]))
+	{
+		case OpCode::Return:
+		case OpCode::Jump:
+		case OpCode::Loop:
+			return std::nullopt;
+		default:
+			return "Chunk does not end in a return or jump.";
+	}
+}
+
+// Closure, FrameClosure and their long forms, whose upvalue captures follow the operands bytes
+// of the function's constant index
+std::optional<std::string_view> Verifier::closure(size_t& offset, size_t constant, size_t operands)
+{
+	if (!is_constant(constant)
+		|| !chunk.constants.values[constant].is_obj_type<ObjFunction>())
+		return "Closure constant is not a function.";
+
+	auto inner = chunk.constants.values[constant].as_obj<ObjFunction>();
+	// only a frame-bound closure is sure to run right above this frame
+	auto op = static_cast<OpCode>(chunk.code[offset]);
+	auto frame_bound = op == OpCode::FrameClosure || op == OpCode::FrameClosureLong;
+	if (inner->enclosing_slots > (frame_bound ? function.slot_count : 0))
+		return "Enclosing slots out of the declaring frame.";
+	if (!has_operands(offset, operands + 2 * inner->upvalue_count))
+		return "Truncated instruction.";
+	for (size_t i = 0; i < inner->upvalue_count; i++)
+	{
+		auto is_local = operand(offset, operands + 2 * i);
+		auto index = operand(offset, operands + 1 + 2 * i);
+		if (is_local > 1)
+			return "Malformed upvalue capture.";
+		if (is_local == 1 && index >= function.slot_count)
+			return "Captured local slot out of range.";
+		if (is_local == 0 && index >= function.upvalue_count)
+			return "Captured upvalue index out of range.";
+	}
+	offset += 1 + operands + 2 * inner->upvalue_count;
+	return std::nullopt;
+}
+
+std::optional<std::string_view> Verifier::instruction(size_t& offset)
+{
+	auto code = chunk.code[offset];
+	if (code >= OPCODE_COUNT)
+		return "Unknown opcode.";
+
+	switch (static_cast<OpCode>(code))
+	{
+		case OpCode::Nil:
+		case OpCode::True:
+		case OpCode::False:
+		case OpCode::Pop:
+		case OpCode::Equal:
+		case OpCode::Greater:
+		case OpCode::Less:
+		case OpCode::Add:
+		case OpCode::Subtract:
+		case OpCode::Multiply:
+		case OpCode::Divide:
+		case OpCode::Not:
+		case OpCode::Negate:
+		case OpCode::Print:
+		case OpCode::CloseUpvalue:
+		case OpCode::Return:
+		case OpCode::Inherit:
+		case OpCode::AddNumber:
+		case OpCode::AddString:
+		case OpCode::SubtractNumber:
+		case OpCode::MultiplyNumber:
+		case OpCode::DivideNumber:
+		case OpCode::GreaterNumber:
+		case OpCode::LessNumber:
+		case OpCode::NegateNumber:
+		case OpCode::AddUnchecked:
+		case OpCode::SubtractUnchecked:
+		case OpCode::MultiplyUnchecked:
+		case OpCode::DivideUnchecked:
+		case OpCode::GreaterUnchecked:
+		case OpCode::LessUnchecked:
+		case OpCode::NegateUnchecked:
+			offset += 1;
+			return std::nullopt;
+		case OpCode::Call:
+		case OpCode::TailCall:
+		case OpCode::PopUnder:
+			if (!has_operands(offset, 1))
+				return "Truncated instruction.";
+			offset += 2;
+			return std::nullopt;
+		case OpCode::GetLocal:
+		case OpCode::SetLocal:
+			if (!has_operands(offset, 1))
+				return "Truncated instruction.";
+			if (operand(offset, 0) >= function.slot_count)
+				return "Local slot out of range.";
+			offset += 2;
+			return std::nullopt;
+		case OpCode::GetUpvalue:
+		case OpCode::SetUpvalue:
+			if (!has_operands(offset, 1))
+				return "Truncated instruction.";
+			if (operand(offset, 0) >= function.upvalue_count)
+				return "Upvalue index out of range.";
+			offset += 2;
+			return std::nullopt;
+		case OpCode::GetEnclosing:
+		case OpCode::SetEnclosing:
+			if (!has_operands(offset, 1))
+				return "Truncated instruction.";
+			// zero for any function not frame-bound, the script included
+			if (operand(offset, 0) >= function.enclosing_slots)
+				return "Enclosing slot out of range.";
+			offset += 2;
+			return std::nullopt;
+		case OpCode::Constant:
+			if (!has_operands(offset, 1))
+				return "Truncated instruction.";
+			if (!is_constant(operand(offset, 0)))
+				return "Constant index out of range.";
+			offset += 2;
+			return std::nullopt;
+		case OpCode::GetGlobal:
+		case OpCode::DefineGlobal:
+		case OpCode::SetGlobal:
+		{
+			if (!has_operands(offset, 2))
+				return "Truncated instruction.";
+			auto slot = static_cast<size_t>(operand(offset, 0) << 8 | operand(offset, 1));
+			if (slot >= global_count)
+				return "Global slot out of range.";
+			offset += 3;
+			return std::nullopt;
+		}
+		case OpCode::GetSuper:
+		case OpCode::Class:
+		case OpCode::Method:
+			if (!has_operands(offset, 1))
+				return "Truncated instruction.";
+			if (!is_string_constant(operand(offset, 0)))
+				return "Name constant out of range.";
+			offset += 2;
+			return std::nullopt;
+		case OpCode::GetProperty:
+		case OpCode::SetProperty:
+			if (!has_operands(offset, 3))
+				return "Truncated instruction.";
+			if (!is_string_constant(operand(offset, 0)))
+				return "Name constant out of range.";
+			if (!is_cache(offset, 1))
+				return "Inline cache out of range.";
+			offset += 4;
+			return std::nullopt;
+		case OpCode::Invoke:
+		case OpCode::TailInvoke:
+			if (!has_operands(offset, 4))
+				return "Truncated instruction.";
+			if (!is_string_constant(operand(offset, 0)))
+				return "Name constant out of range.";
+			if (!is_cache(offset, 2))
+				return "Inline cache out of range.";
+			offset += 5;
+			return std::nullopt;
+		case OpCode::SuperInvoke:
+			if (!has_operands(offset, 2))
+				return "Truncated instruction.";
+			if (!is_string_constant(operand(offset, 0)))
+				return "Name constant out of range.";
+			offset += 3;
+			return std::nullopt;
+		case OpCode::Jump:
+		case OpCode::JumpIfFalse:
+		case OpCode::Loop:
+		{
+			if (!has_operands(offset, 2))
+				return "Truncated instruction.";
+			auto jump = static_cast<size_t>(operand(offset, 0) << 8 | operand(offset, 1));
+			auto next = offset + 3;
+			if (static_cast<OpCode>(code) == OpCode::Loop)
+			{
+				if (jump > next)
+					return "Loop target before start of chunk.";
+				targets.push_back(next - jump);
+			} else
+				targets.push_back(next + jump);
+			offset = next;
+			return std::nullopt;
+		}
+		case OpCode::Closure:
+		case OpCode::FrameClosure:
+			if (!has_operands(offset, 1))
+				return "Truncated instruction.";
+			return closure(offset, operand(offset, 0), 1);
+		case OpCode::ConstantLong:
+			if (!has_operands(offset, 3))
+				return "Truncated instruction.";
+			if (!is_constant(long_operand(offset, 0)))
+				return "Constant index out of range.";
+			offset += 4;
+			return std::nullopt;
+		case OpCode::GetGlobalLong:
+		case OpCode::DefineGlobalLong:
+		case OpCode::SetGlobalLong:
+			if (!has_operands(offset, 3))
+				return "Truncated instruction.";
+			if (long_operand(offset, 0) >= global_count)
+				return "Global slot out of range.";
+			offset += 4;
+			return std::nullopt;
+		case OpCode::GetSuperLong:
+		case OpCode::ClassLong:
+		case OpCode::MethodLong:
+			if (!has_operands(offset, 3))
+				return "Truncated instruction.";
+			if (!is_string_constant(long_operand(offset, 0)))
+				return "Name constant out of range.";
+			offset += 4;
+			return std::nullopt;
+		case OpCode::GetPropertyLong:
+		case OpCode::SetPropertyLong:
+			if (!has_operands(offset, 5))
+				return "Truncated instruction.";
+			if (!is_string_constant(long_operand(offset, 0)))
+				return "Name constant out of range.";
+			if (!is_cache(offset, 3))
+				return "Inline cache out of range.";
+			offset += 6;
+			return std::nullopt;
+		case OpCode::InvokeLong:
+			if (!has_operands(offset, 6))
+				return "Truncated instruction.";
+			if (!is_string_constant(long_operand(offset, 0)))
+				return "Name constant out of range.";
+			if (!is_cache(offset, 4))
+				return "Inline cache out of range.";
+			offset += 7;
+			return std::nullopt;
+		case OpCode::SuperInvokeLong:
+			if (!has_operands(offset, 4))
+				return "Truncated instruction.";
+			if (!is_string_constant(long_operand(offset, 0)))
+				return "Name constant out of range.";
+			offset += 5;
+			return std::nullopt;
+		case OpCode::ClosureLong:
+		case OpCode::FrameClosureLong:
+			if (!has_operands(offset, 3))
+				return "Truncated instruction.";
+			return closure(offset, long_operand(offset, 0), 3);
+		default:
+			// the Reg* forms are only ever found in a RegisterChunk
+			return "Unknown opcode.";
+	}
+}
+
+}
+
+std::optional<std::string_view> verify(const ObjFunction& function, size_t global_count)
+{
+	return Verifier(function, global_count).run();
+}
+
+} // Clox
\ No newline at end of file
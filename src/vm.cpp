@@ -1,47 +1,105 @@
 #include "vm.h"
 
+#include <algorithm>
 #include <chrono>
+#include <iterator>
 
+#include "bytecode_cache.h"
 #include "obj_string.h"
 
 #ifdef _DEBUG
 //#define DEBUG_TRACE_EXECUTION
+//#define DEBUG_PRINT_INLINE_CACHES
+//#define DEBUG_COUNT_DISPATCHES
+//#define DEBUG_PROFILE_OPCODES
+//#define DEBUG_PRINT_LINE_TABLES
 #endif // _DEBUG
 
-#ifdef DEBUG_TRACE_EXECUTION
+#if defined(DEBUG_TRACE_EXECUTION) || defined(DEBUG_PRINT_INLINE_CACHES) \
+	|| defined(DEBUG_PROFILE_OPCODES) || defined(DEBUG_PRINT_LINE_TABLES)
 #include "debug.h"
-#endif // DEBUG_TRACE_EXECUTION
+#endif // DEBUG_TRACE_EXECUTION || DEBUG_PRINT_INLINE_CACHES || DEBUG_PROFILE_OPCODES || DEBUG_PRINT_LINE_TABLES
+
+// Threaded dispatch through a table of label addresses is a GNU extension,
+// MSVC and builds configured with CLOX_NO_COMPUTED_GOTO use the switch instead
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(CLOX_NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
 
 namespace Clox {
 
+#ifdef DEBUG_COUNT_DISPATCHES
+// instructions run by the last interpret(), to compare stack and register code
+static size_t dispatch_count = 0;
+#define COUNT_DISPATCH() (dispatch_count++)
+#else
+#define COUNT_DISPATCH() static_cast<void>(0)
+#endif // DEBUG_COUNT_DISPATCHES
+
+#ifdef DEBUG_PROFILE_OPCODES
+static OpcodeProfile opcode_profile;
+#define PROFILE_OPCODE(op) opcode_profile.record(op)
+#else
+#define PROFILE_OPCODE(op) static_cast<void>(0)
+#endif // DEBUG_PROFILE_OPCODES
+
 Value clock_native([[maybe_unused]] uint8_t arg_count, [[maybe_unused]] Value* args)noexcept
 {
 	auto tp = std::chrono::high_resolution_clock::now().time_since_epoch();
 	return std::chrono::duration<double>(tp).count();
 }
 
-[[nodiscard]] constexpr bool is_falsey(const Value& value)
-{
-	return value.is_nil() ||
-		(value.is_bool() && !value.as<bool>());
-}
-
 InterpretResult VM::interpret(std::string_view source)
 {
 	auto function = cu.compile(source);
 	if (function == nullptr)
 		return InterpretResult::CompileError;
+	return run_script(function);
+}
+
+InterpretResult VM::interpret(std::string_view source, const std::filesystem::path& cache)
+{
+	auto function = load_cache(*this, cache, source);
+	if (function == nullptr)
+	{
+		function = cu.compile(source);
+		if (function == nullptr)
+			return InterpretResult::CompileError;
+		// a stripped script would report every later error without lines
+		if (options.line_info)
+			save_cache(*this, cache, source, *function);
+	}
+	return run_script(function);
+}
 
+InterpretResult VM::run_script(ObjFunction* function)
+{
 	push(function);
 	auto closure = create_obj<ObjClosure>(gc, function);
 	pop();
 	push(closure);
 	static_cast<void>(call_value(closure, 0));
-	return run();
+#ifdef DEBUG_PRINT_LINE_TABLES
+	report_line_tables(*function);
+#endif // DEBUG_PRINT_LINE_TABLES
+	auto result = run();
+
+#ifdef DEBUG_PRINT_INLINE_CACHES
+	report_inline_caches(*function);
+#endif // DEBUG_PRINT_INLINE_CACHES
+#ifdef DEBUG_COUNT_DISPATCHES
+	std::cerr << "dispatches: " << dispatch_count << '\n';
+	dispatch_count = 0;
+#endif // DEBUG_COUNT_DISPATCHES
+#ifdef DEBUG_PROFILE_OPCODES
+	opcode_profile.report(20);
+#endif // DEBUG_PROFILE_OPCODES
+
+	return result;
 }
 
-VM::VM()
-	:cu(*this), gc(*this)
+VM::VM(const Options& options)
+	:frames(FRAMES_INITIAL), stack(STACK_INITIAL), cu(*this), gc(*this), options(options)
 {
 	AllocBase::init(&gc);
 	reset_stack();
@@ -49,307 +107,930 @@ VM::VM()
 	define_native("clock", clock_native);
 }
 
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif // COMPUTED_GOTO
+
 InterpretResult VM::run()
 {
 
-#define BINARY_OP(op) \
+	// frame->ip is only written back when something outside this loop
+	// needs it: calls, and runtime errors reporting the current line
+#define RUNTIME_ERROR(...) \
+do{\
+		frame->ip = ip;\
+		runtime_error(__VA_ARGS__);\
+		return InterpretResult::RuntimeError;\
+} while (false)
+
+	// A generic arithmetic instruction rewrites itself into the form for the
+	// operand types it just saw. That form only checks those types, and on a
+	// mismatch turns the instruction back into the generic one and runs it
+	// again, which then quickens to whatever the new operands call for.
+#ifdef CLOX_NO_QUICKENING
+#define QUICKEN(op) static_cast<void>(0)
+#else
+#define QUICKEN(op) (ip[-1] = static_cast<uint8_t>(OpCode::op))
+#endif // CLOX_NO_QUICKENING
+#define DEOPTIMIZE(op) (ip[-1] = static_cast<uint8_t>(OpCode::op), ip--)
+
+#define BINARY_OP(quickened, op) \
 do{\
 		if(!peek(0).is_number() || !peek(1).is_number()){\
-			runtime_error("Operands must be numbers.");\
-			return InterpretResult::RuntimeError;\
+			RUNTIME_ERROR("Operands must be numbers.");\
 		}\
+		QUICKEN(quickened);\
 		double b = pop().as<double>(); \
 		double a = pop().as<double>(); \
 		push(a op b); \
 } while (false);
+// a block rather than do/while, so that NEXT can leave the switch
+#define NUMBER_OP(generic, op) \
+{\
+		if (!peek(0).is_number() || !peek(1).is_number())\
+		{\
+			DEOPTIMIZE(generic);\
+			NEXT;\
+		}\
+		double b = peek(0).as<double>(); \
+		double a = peek(1).as<double>(); \
+		stacktop--; \
+		stacktop[-1] = a op b; \
+}
+#define UNCHECKED_OP(op) \
+do{\
+		double b = peek(0).as<double>(); \
+		double a = peek(1).as<double>(); \
+		stacktop--; \
+		stacktop[-1] = a op b; \
+} while (false);
+	// operands of register instructions are slots of the frame, destination first
+#define READ_REGISTER() (slots[READ_BYTE()])
+#define REGISTER_OP(op) \
+{\
+		auto& a = READ_REGISTER();\
+		const auto& b = READ_REGISTER();\
+		const auto& c = READ_REGISTER();\
+		if (!b.is_number() || !c.is_number())\
+			RUNTIME_ERROR("Operands must be numbers.");\
+		a = b.as<double>() op c.as<double>();\
+}
 
-	auto* frame = &frames.at(frame_count - 1);
-
-	while (true)
-	{
 #ifdef DEBUG_TRACE_EXECUTION
-		std::cout << "          ";
-		for (auto slot = stack.data(); slot < stacktop; ++slot)
-		{
-			std::cout << "[ " << *slot << " ]";
-		}
-		std::cout << '\n';
-		static_cast<void>(disassemble_instruction(frame->chunk(), frame->ip));
+#define TRACE_INSTRUCTION() \
+do{\
+		std::cout << "          ";\
+		for (auto slot = stack.data(); slot < stacktop; ++slot)\
+		{\
+			std::cout << "[ " << *slot << " ]";\
+		}\
+		std::cout << '\n';\
+		if (frame->top != nullptr)\
+			static_cast<void>(disassemble_register_instruction(*frame->closure->function,\
+				ip - frame->closure->function->register_chunk->code.data()));\
+		else\
+			static_cast<void>(disassemble_instruction(frame->chunk(), ip - frame->chunk().code.data()));\
+} while (false)
+#else
+#define TRACE_INSTRUCTION() do{} while (false)
 #endif // DEBUG_TRACE_EXECUTION
 
-		auto instruction = static_cast<OpCode>(frame->read_byte());
+	// Every function has passed verify() before it can run, so operands are
+	// decoded straight from the code without bounds checks, and ip and slots
+	// live in locals for the duration of a frame. A frame running register
+	// code keeps stacktop at the end of its registers so that they are all
+	// GC roots; what a callee left above its result is dead and cleared.
+#define LOAD_FRAME() \
+do{\
+		frame = &frames[frame_count - 1];\
+		ip = frame->ip;\
+		slots = frame->slots;\
+		if (frame->top != nullptr)\
+		{\
+			std::fill(stacktop, frame->top, Value());\
+			stacktop = frame->top;\
+		}\
+} while (false)
+	// Functions Options::jit has compiled continue in native code from here
+	// until it meets an instruction it leaves to the interpreter.
+#define JIT_ENTER() \
+do{\
+		if (options.jit && frame->closure->function->jit_code != nullptr)\
+			ip = frame->closure->function->jit_code->run(slots, stacktop, globals.values.data(), ip);\
+} while (false)
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, static_cast<uint16_t>(ip[-2] << 8 | ip[-1]))
+#define READ_CONSTANT() (frame->chunk().constants.values[READ_BYTE()])
+#define READ_STRING() static_cast<ObjString*>(READ_CONSTANT().as<Obj*>())
+#define READ_CACHE() (frame->closure->function->chunk.caches[READ_SHORT()])
+#define READ_LONG() (ip += 3, static_cast<size_t>(ip[-3] << 16 | ip[-2] << 8 | ip[-1]))
+#define READ_CONSTANT_LONG() (frame->chunk().constants.values[READ_LONG()])
+#define READ_STRING_LONG() static_cast<ObjString*>(READ_CONSTANT_LONG().as<Obj*>())
+	// the operands of Closure, FrameClosure and their long forms after the function
+#define CAPTURE_UPVALUES(closure) \
+do{\
+		for (size_t i = 0; i < closure->upvalue_count(); i++)\
+		{\
+			auto is_local = READ_BYTE();\
+			auto index = READ_BYTE();\
+			if (is_local > 0)\
+				closure->upvalues[i] = captured_upvalue(slots + index);\
+			else\
+				closure->upvalues[i] = frame->closure->upvalues[index];\
+		}\
+} while (false)
+
+	CallFrame* frame = nullptr;
+	uint8_t* ip = nullptr;
+	Value* slots = nullptr;
+	LOAD_FRAME();
+
+#ifdef COMPUTED_GOTO
+
+	// one label per OpCode, in declaration order
+	static void* dispatch_table[] = {
+		&&op_Constant, &&op_Nil, &&op_True, &&op_False, &&op_Pop,
+		&&op_GetLocal, &&op_SetLocal, &&op_GetGlobal, &&op_DefineGlobal, &&op_SetGlobal,
+		&&op_GetUpvalue, &&op_SetUpvalue, &&op_GetProperty, &&op_SetProperty, &&op_GetSuper,
+		&&op_Equal, &&op_Greater, &&op_Less, &&op_Add, &&op_Subtract,
+		&&op_Multiply, &&op_Divide, &&op_Not, &&op_Negate, &&op_Print,
+		&&op_Jump, &&op_JumpIfFalse, &&op_Loop, &&op_Call, &&op_Invoke,
+		&&op_SuperInvoke, &&op_Closure, &&op_CloseUpvalue, &&op_Return, &&op_Class,
+		&&op_Inherit, &&op_Method, &&op_TailCall, &&op_TailInvoke, &&op_GetEnclosing,
+		&&op_SetEnclosing, &&op_FrameClosure, &&op_PopUnder,
+		&&op_ConstantLong, &&op_GetGlobalLong, &&op_DefineGlobalLong, &&op_SetGlobalLong, &&op_GetPropertyLong,
+		&&op_SetPropertyLong, &&op_GetSuperLong, &&op_InvokeLong, &&op_SuperInvokeLong, &&op_ClosureLong,
+		&&op_ClassLong, &&op_MethodLong, &&op_FrameClosureLong, &&op_AddNumber, &&op_AddString,
+		&&op_SubtractNumber,
+		&&op_MultiplyNumber, &&op_DivideNumber, &&op_GreaterNumber, &&op_LessNumber, &&op_NegateNumber,
+		&&op_AddUnchecked, &&op_SubtractUnchecked, &&op_MultiplyUnchecked, &&op_DivideUnchecked,
+		&&op_GreaterUnchecked, &&op_LessUnchecked, &&op_NegateUnchecked,
+		&&op_GetLocalGetLocal, &&op_GetLocalConstant, &&op_GetLocalGetProperty, &&op_SetLocalPop, &&op_PopLoop,
+		&&op_JumpIfFalsePop, &&op_LessJumpIfFalsePop,
+		&&op_RegMove, &&op_RegConstant, &&op_RegNil, &&op_RegTrue, &&op_RegFalse,
+		&&op_RegGetGlobal, &&op_RegDefineGlobal, &&op_RegSetGlobal, &&op_RegGetUpvalue, &&op_RegSetUpvalue,
+		&&op_RegEqual, &&op_RegGreater, &&op_RegLess, &&op_RegAdd, &&op_RegSubtract,
+		&&op_RegMultiply, &&op_RegDivide, &&op_RegNot, &&op_RegNegate, &&op_RegPrint,
+		&&op_RegJump, &&op_RegJumpIfFalse, &&op_RegLoop, &&op_RegCall, &&op_RegTailCall, &&op_RegClosure,
+		&&op_RegCloseUpvalue, &&op_RegReturn
+	};
+	static_assert(std::size(dispatch_table) == OPCODE_COUNT);
+
+#define DISPATCH() \
+do{\
+		TRACE_INSTRUCTION();\
+		COUNT_DISPATCH();\
+		PROFILE_OPCODE(*ip);\
+		goto *dispatch_table[READ_BYTE()];\
+} while (false)
+#define CASE(op) op_##op
+#define NEXT DISPATCH()
+
+	DISPATCH();
+
+#else
+
+#define CASE(op) case OpCode::op
+#define NEXT break
+
+	while (true)
+	{
+		TRACE_INSTRUCTION();
+		COUNT_DISPATCH();
+		PROFILE_OPCODE(*ip);
+		auto instruction = static_cast<OpCode>(READ_BYTE());
 		switch (instruction)
 		{
-			case OpCode::Constant:
+
+#endif // COMPUTED_GOTO
+
+			CASE(Constant):
 			{
-				auto&& constant = frame->read_constant();
+				auto&& constant = READ_CONSTANT();
 				push(constant);
-				break;
+				NEXT;
 			}
-			case OpCode::Nil: push(Value()); break;
-			case OpCode::True: push(true); break;
-			case OpCode::False: push(false); break;
-			case OpCode::Pop: pop(); break;
-			case OpCode::GetLocal:
+			CASE(Nil): push(Value()); NEXT;
+			CASE(True): push(true); NEXT;
+			CASE(False): push(false); NEXT;
+			CASE(Pop): pop(); NEXT;
+			CASE(GetLocal):
 			{
-				auto slot = static_cast<size_t>(frame->read_byte());
-				push(frame->slots[slot]);
-				break;
+				auto slot = static_cast<size_t>(READ_BYTE());
+				push(slots[slot]);
+				NEXT;
 			}
-			case OpCode::SetLocal:
+			CASE(SetLocal):
 			{
-				auto slot = static_cast<size_t>(frame->read_byte());
-				frame->slots[slot] = peek(0);
-				break;
+				auto slot = static_cast<size_t>(READ_BYTE());
+				slots[slot] = peek(0);
+				NEXT;
 			}
-			case OpCode::GetGlobal:
+			CASE(GetGlobal):
 			{
-				auto name = frame->read_string();
-				try
-				{
-					auto& value = globals.at(name);
-					push(value);
-				} catch (const std::out_of_range&)
-				{
-					runtime_error("Undefined variable ", name->text());
-					return InterpretResult::RuntimeError;
-				}
-				break;
+				auto slot = static_cast<size_t>(READ_SHORT());
+				auto& value = globals.values[slot];
+				if (value.is_undefined())
+					RUNTIME_ERROR("Undefined variable ", global_name(slot)->text());
+				push(value);
+				NEXT;
 			}
-			case OpCode::DefineGlobal:
+			CASE(DefineGlobal):
 			{
-				auto name = frame->read_string();
-				globals.insert_or_assign(name, peek(0));
+				globals.values[READ_SHORT()] = peek(0);
 				pop();
-				break;
+				NEXT;
 			}
-			case OpCode::SetGlobal:
+			CASE(SetGlobal):
 			{
-				auto name = frame->read_string();
-				try
-				{
-					globals.at(name) = peek(0);
-				} catch (const std::out_of_range&)
-				{
-					runtime_error("Undefined variable ", name->text());
-					return InterpretResult::RuntimeError;
-				}
-				break;
+				auto slot = static_cast<size_t>(READ_SHORT());
+				auto& value = globals.values[slot];
+				if (value.is_undefined())
+					RUNTIME_ERROR("Undefined variable ", global_name(slot)->text());
+				value = peek(0);
+				NEXT;
 			}
-			case OpCode::GetUpvalue:
+			CASE(GetUpvalue):
 			{
-				auto slot = frame->read_byte();
-				push(*frame->closure->upvalues.at(slot)->location);
-				break;
+				auto slot = READ_BYTE();
+				push(*frame->closure->upvalues[slot]->location);
+				NEXT;
 			}
-			case OpCode::SetUpvalue:
+			CASE(SetUpvalue):
 			{
-				auto slot = frame->read_byte();
-				*frame->closure->upvalues.at(slot)->location = peek(0);
-				break;
+				auto slot = READ_BYTE();
+				*frame->closure->upvalues[slot]->location = peek(0);
+				NEXT;
 			}
-			case OpCode::GetProperty:
+			CASE(GetProperty):
 			{
 				if (!peek(0).is_obj_type<ObjInstance>())
-				{
-					runtime_error("Only instances have properties.");
-					return InterpretResult::RuntimeError;
-				}
+					RUNTIME_ERROR("Only instances have properties.");
 
 				auto instance = peek(0).as_obj<ObjInstance>();
-				auto name = frame->read_string();
-				try
-				{
-					auto& value = instance->fields.at(name);
-					pop();
-					push(value);
-				} catch (const std::out_of_range&)
-				{
-					if (!bind_method(instance->klass, name))
-						return InterpretResult::RuntimeError;
-				}
-				break;
+				auto name = READ_STRING();
+				auto& cache = READ_CACHE();
+				frame->ip = ip;
+				if (!get_property(instance, name, cache))
+					return InterpretResult::RuntimeError;
+				NEXT;
 			}
-			case OpCode::SetProperty:
+			CASE(SetProperty):
 			{
 				if (!peek(1).is_obj_type<ObjInstance>())
-				{
-					runtime_error("Only instances have fields.");
-					return InterpretResult::RuntimeError;
-				}
+					RUNTIME_ERROR("Only instances have fields.");
 				auto instance = peek(1).as_obj<ObjInstance>();
-				instance->fields.insert_or_assign(frame->read_string(), peek(0));
+				auto name = READ_STRING();
+				set_property(instance, name, READ_CACHE());
 
 				auto value = pop();
 				pop();
 				push(value);
-				break;
+				NEXT;
 			}
-			case OpCode::GetSuper:
+			CASE(GetSuper):
 			{
-				auto name = frame->read_string();
+				auto name = READ_STRING();
 				auto superclass = pop().as_obj<ObjClass>();
+				frame->ip = ip;
 				if (!bind_method(superclass, name))
 					return InterpretResult::RuntimeError;
-				break;
+				NEXT;
 			}
-			case OpCode::Equal:
+			CASE(Equal):
 			{
 				auto b = pop();
 				auto a = pop();
 				push(a == b);
-				break;
+				NEXT;
 			}
-			case OpCode::Greater: BINARY_OP(> ); break;
-			case OpCode::Less: BINARY_OP(< ); break;
-			case OpCode::Add:
+			CASE(Greater): BINARY_OP(GreaterNumber, > ); NEXT;
+			CASE(Less): BINARY_OP(LessNumber, < ); NEXT;
+			CASE(Add):
 			{
-				if (peek(0).is_obj_type<ObjString>()
+				if (peek(0).is_number() && peek(1).is_number())
+				{
+					QUICKEN(AddNumber);
+					auto b = pop().as<double>();
+					auto a = pop().as<double>();
+					push(a + b);
+				} else if (peek(0).is_obj_type<ObjString>()
 					&& peek(1).is_obj_type<ObjString>())
 				{
+					QUICKEN(AddString);
 					auto b = peek(0).as_obj<ObjString>();
 					auto a = peek(1).as_obj<ObjString>();
 					auto res = create_obj_string((*a) + (*b), *this);
 					pop();
 					pop();
 					push(res);
-				} else if (peek(0).is_number() && peek(1).is_number())
-				{
-					auto b = pop().as<double>();
-					auto a = pop().as<double>();
-					push(a + b);
 				} else
 				{
-					runtime_error("Operands must be two numbers or two strings.");
-					return InterpretResult::RuntimeError;
+					RUNTIME_ERROR("Operands must be two numbers or two strings.");
 				}
-				break;
+				NEXT;
 			}
-			case OpCode::Subtract: BINARY_OP(-); break;
-			case OpCode::Multiply: BINARY_OP(*); break;
-			case OpCode::Divide: BINARY_OP(/ ); break;
-			case OpCode::Not:push(is_falsey(pop())); break;
-			case OpCode::Negate:
+			CASE(Subtract): BINARY_OP(SubtractNumber, -); NEXT;
+			CASE(Multiply): BINARY_OP(MultiplyNumber, *); NEXT;
+			CASE(Divide): BINARY_OP(DivideNumber, / ); NEXT;
+			CASE(Not):push(is_falsey(pop())); NEXT;
+			CASE(Negate):
 				if (!peek(0).is_number())
-				{
-					runtime_error("Operand must be a number.");
-					return InterpretResult::RuntimeError;
-				}
+					RUNTIME_ERROR("Operand must be a number.");
+				QUICKEN(NegateNumber);
 				push(-pop().as<double>());
-				break;
-			case OpCode::Print:
+				NEXT;
+			CASE(Print):
 				std::cout << "~$ " << pop() << '\n';
-				break;
-			case OpCode::Jump:
+				NEXT;
+			CASE(Jump):
 			{
-				auto offset = frame->read_short();
-				frame->ip += offset;
-				break;
+				auto offset = READ_SHORT();
+				ip += offset;
+				NEXT;
 			}
-			case OpCode::JumpIfFalse:
+			CASE(JumpIfFalse):
 			{
-				auto offset = frame->read_short();
+				auto offset = READ_SHORT();
 				if (is_falsey(peek(0)))
-					frame->ip += offset;
-				break;
+					ip += offset;
+				NEXT;
 			}
-			case OpCode::Loop:
+			CASE(Loop):
 			{
-				auto offset = frame->read_short();
-				frame->ip -= offset;
-				break;
+				auto offset = READ_SHORT();
+				ip -= offset;
+				if (options.jit)
+				{
+					tier_up(*frame->closure->function);
+					JIT_ENTER();
+				}
+				NEXT;
 			}
-			case OpCode::Call:
+			CASE(Call):
 			{
-				auto arg_count = static_cast<uint8_t>(frame->read_byte());
+				auto arg_count = static_cast<uint8_t>(READ_BYTE());
+				frame->ip = ip;
 				if (!call_value(peek(arg_count), arg_count))
 					return InterpretResult::RuntimeError;
-				frame = &frames.at(frame_count - 1);
-				break;
+				LOAD_FRAME();
+				JIT_ENTER();
+				NEXT;
 			}
-			case OpCode::Invoke:
+			CASE(Invoke):
 			{
-				auto method = frame->read_string();
-				auto arg_count = frame->read_byte();
-				if (!invoke(method, arg_count))
+				auto method = READ_STRING();
+				auto arg_count = READ_BYTE();
+				auto& cache = READ_CACHE();
+				frame->ip = ip;
+				if (!invoke(method, arg_count, cache))
 					return InterpretResult::RuntimeError;
-				frame = &frames.at(frame_count - 1);
-				break;
+				LOAD_FRAME();
+				JIT_ENTER();
+				NEXT;
+			}
+			// The returning frame is dropped before the call, which either pushes
+			// the callee's frame in its place or, calling a native or a class
+			// without an initializer, leaves the result for the caller as
+			// Return would have.
+			CASE(TailCall):
+			{
+				auto arg_count = READ_BYTE();
+				drop_frame(stacktop - arg_count - 1, arg_count);
+				if (!call_value(peek(arg_count), arg_count))
+					return InterpretResult::RuntimeError;
+				LOAD_FRAME();
+				JIT_ENTER();
+				NEXT;
+			}
+			CASE(TailInvoke):
+			{
+				auto method = READ_STRING();
+				auto arg_count = READ_BYTE();
+				auto& cache = READ_CACHE();
+				drop_frame(stacktop - arg_count - 1, arg_count);
+				if (!invoke(method, arg_count, cache))
+					return InterpretResult::RuntimeError;
+				LOAD_FRAME();
+				JIT_ENTER();
+				NEXT;
+			}
+			CASE(GetEnclosing):
+			{
+				auto slot = READ_BYTE();
+				push((frame - 1)->slots[slot]);
+				NEXT;
+			}
+			CASE(SetEnclosing):
+			{
+				auto slot = READ_BYTE();
+				(frame - 1)->slots[slot] = peek(0);
+				NEXT;
+			}
+			CASE(PopUnder):
+			{
+				auto count = READ_BYTE();
+				auto result = peek(0);
+				stacktop -= count;
+				stacktop[-1] = result;
+				NEXT;
+			}
+			CASE(FrameClosure):
+			{
+				auto closure = frame_closure(READ_CONSTANT().as_obj<ObjFunction>());
+				push(closure);
+				CAPTURE_UPVALUES(closure);
+				NEXT;
 			}
-			case OpCode::SuperInvoke:
+			CASE(SuperInvoke):
 			{
-				auto method = frame->read_string();
-				auto arg_count = frame->read_byte();
+				auto method = READ_STRING();
+				auto arg_count = READ_BYTE();
 				auto superclass = pop().as_obj<ObjClass>();
+				frame->ip = ip;
 				if (!invoke_from_class(superclass, method, arg_count))
 					return InterpretResult::RuntimeError;
-				frame = &frames.at(frame_count - 1);
-				break;
+				LOAD_FRAME();
+				JIT_ENTER();
+				NEXT;
 			}
-			case OpCode::Closure:
+			CASE(Closure):
 			{
-				auto function = frame->read_constant().as_obj<ObjFunction>();
+				auto function = READ_CONSTANT().as_obj<ObjFunction>();
 				auto closure = create_obj<ObjClosure>(gc, function);
 				push(closure);
-				for (size_t i = 0; i < closure->upvalue_count(); i++)
-				{
-					auto is_local = frame->read_byte();
-					auto index = frame->read_byte();
-					if (is_local > 0)
-						closure->upvalues.at(i) = captured_upvalue(frame->slots + index);
-					else
-						closure->upvalues.at(i) = frame->closure->upvalues.at(index);
-				}
-				break;
+				CAPTURE_UPVALUES(closure);
+				NEXT;
 			}
-			case OpCode::CloseUpvalue:
+			CASE(CloseUpvalue):
 				close_upvalues(stacktop - 1);
 				pop();
-				break;
-			case OpCode::Return:
+				NEXT;
+			CASE(Return):
 			{
 				auto result = pop();
-				close_upvalues(frame->slots);
+				close_upvalues(slots);
 				frame_count--;
 				if (frame_count == 0)
 				{
 					pop();
 					return InterpretResult::Ok;
 				}
-				stacktop = frame->slots;
+				stacktop = slots;
 				push(result);
-				frame = &frames.at(frame_count - 1);
-				break;
+				LOAD_FRAME();
+				JIT_ENTER();
+				NEXT;
 			}
-			case OpCode::Class:
-				push(create_obj<ObjClass>(gc, frame->read_string()));
-				break;
-			case OpCode::Inherit:
+			CASE(Class):
+				push(create_obj<ObjClass>(gc, READ_STRING()));
+				NEXT;
+			CASE(Inherit):
+			{
+				auto superclass = peek(1).try_as_obj<ObjClass>();
+				if (superclass == nullptr)
+					RUNTIME_ERROR("Superclass must be a class.");
+				auto subclass = peek(0).as_obj<ObjClass>();
+				subclass->methods.add_all(superclass->methods);
+				pop();
+				NEXT;
+			}
+			CASE(Method):
+				define_method(READ_STRING());
+				NEXT;
+			CASE(ConstantLong):
+			{
+				auto&& constant = READ_CONSTANT_LONG();
+				push(constant);
+				NEXT;
+			}
+			CASE(GetGlobalLong):
+			{
+				auto slot = READ_LONG();
+				auto& value = globals.values[slot];
+				if (value.is_undefined())
+					RUNTIME_ERROR("Undefined variable ", global_name(slot)->text());
+				push(value);
+				NEXT;
+			}
+			CASE(DefineGlobalLong):
+			{
+				globals.values[READ_LONG()] = peek(0);
+				pop();
+				NEXT;
+			}
+			CASE(SetGlobalLong):
+			{
+				auto slot = READ_LONG();
+				auto& value = globals.values[slot];
+				if (value.is_undefined())
+					RUNTIME_ERROR("Undefined variable ", global_name(slot)->text());
+				value = peek(0);
+				NEXT;
+			}
+			CASE(GetPropertyLong):
 			{
-				try
+				if (!peek(0).is_obj_type<ObjInstance>())
+					RUNTIME_ERROR("Only instances have properties.");
+
+				auto instance = peek(0).as_obj<ObjInstance>();
+				auto name = READ_STRING_LONG();
+				auto& cache = READ_CACHE();
+				frame->ip = ip;
+				if (!get_property(instance, name, cache))
+					return InterpretResult::RuntimeError;
+				NEXT;
+			}
+			CASE(SetPropertyLong):
+			{
+				if (!peek(1).is_obj_type<ObjInstance>())
+					RUNTIME_ERROR("Only instances have fields.");
+				auto instance = peek(1).as_obj<ObjInstance>();
+				auto name = READ_STRING_LONG();
+				set_property(instance, name, READ_CACHE());
+
+				auto value = pop();
+				pop();
+				push(value);
+				NEXT;
+			}
+			CASE(GetSuperLong):
+			{
+				auto name = READ_STRING_LONG();
+				auto superclass = pop().as_obj<ObjClass>();
+				frame->ip = ip;
+				if (!bind_method(superclass, name))
+					return InterpretResult::RuntimeError;
+				NEXT;
+			}
+			CASE(InvokeLong):
+			{
+				auto method = READ_STRING_LONG();
+				auto arg_count = READ_BYTE();
+				auto& cache = READ_CACHE();
+				frame->ip = ip;
+				if (!invoke(method, arg_count, cache))
+					return InterpretResult::RuntimeError;
+				LOAD_FRAME();
+				JIT_ENTER();
+				NEXT;
+			}
+			CASE(SuperInvokeLong):
+			{
+				auto method = READ_STRING_LONG();
+				auto arg_count = READ_BYTE();
+				auto superclass = pop().as_obj<ObjClass>();
+				frame->ip = ip;
+				if (!invoke_from_class(superclass, method, arg_count))
+					return InterpretResult::RuntimeError;
+				LOAD_FRAME();
+				JIT_ENTER();
+				NEXT;
+			}
+			CASE(ClosureLong):
+			{
+				auto function = READ_CONSTANT_LONG().as_obj<ObjFunction>();
+				auto closure = create_obj<ObjClosure>(gc, function);
+				push(closure);
+				CAPTURE_UPVALUES(closure);
+				NEXT;
+			}
+			CASE(FrameClosureLong):
+			{
+				auto closure = frame_closure(READ_CONSTANT_LONG().as_obj<ObjFunction>());
+				push(closure);
+				CAPTURE_UPVALUES(closure);
+				NEXT;
+			}
+			CASE(ClassLong):
+				push(create_obj<ObjClass>(gc, READ_STRING_LONG()));
+				NEXT;
+			CASE(MethodLong):
+				define_method(READ_STRING_LONG());
+				NEXT;
+			CASE(AddNumber): NUMBER_OP(Add, +); NEXT;
+			CASE(AddString):
+			{
+				if (!peek(0).is_obj_type<ObjString>() || !peek(1).is_obj_type<ObjString>())
+				{
+					DEOPTIMIZE(Add);
+					NEXT;
+				}
+				auto b = peek(0).as_obj<ObjString>();
+				auto a = peek(1).as_obj<ObjString>();
+				auto res = create_obj_string((*a) + (*b), *this);
+				pop();
+				pop();
+				push(res);
+				NEXT;
+			}
+			CASE(SubtractNumber): NUMBER_OP(Subtract, -); NEXT;
+			CASE(MultiplyNumber): NUMBER_OP(Multiply, *); NEXT;
+			CASE(DivideNumber): NUMBER_OP(Divide, / ); NEXT;
+			CASE(GreaterNumber): NUMBER_OP(Greater, > ); NEXT;
+			CASE(LessNumber): NUMBER_OP(Less, < ); NEXT;
+			CASE(NegateNumber):
+				if (!peek(0).is_number())
+				{
+					DEOPTIMIZE(Negate);
+					NEXT;
+				}
+				push(-pop().as<double>());
+				NEXT;
+			CASE(AddUnchecked): UNCHECKED_OP(+); NEXT;
+			CASE(SubtractUnchecked): UNCHECKED_OP(-); NEXT;
+			CASE(MultiplyUnchecked): UNCHECKED_OP(*); NEXT;
+			CASE(DivideUnchecked): UNCHECKED_OP(/ ); NEXT;
+			CASE(GreaterUnchecked): UNCHECKED_OP(> ); NEXT;
+			CASE(LessUnchecked): UNCHECKED_OP(< ); NEXT;
+			CASE(NegateUnchecked): stacktop[-1] = -stacktop[-1].as<double>(); NEXT;
+			// a superinstruction steps over the opcodes of the instructions it
+			// stands for, whose operands it reads in place
+			CASE(GetLocalGetLocal):
+				push(slots[READ_BYTE()]);
+				ip++;
+				push(slots[READ_BYTE()]);
+				NEXT;
+			CASE(GetLocalConstant):
+			{
+				push(slots[READ_BYTE()]);
+				ip++;
+				auto&& constant = READ_CONSTANT();
+				push(constant);
+				NEXT;
+			}
+			CASE(GetLocalGetProperty):
+			{
+				push(slots[READ_BYTE()]);
+				ip++;
+				if (!peek(0).is_obj_type<ObjInstance>())
+					RUNTIME_ERROR("Only instances have properties.");
+
+				auto instance = peek(0).as_obj<ObjInstance>();
+				auto name = READ_STRING();
+				auto& cache = READ_CACHE();
+				frame->ip = ip;
+				if (!get_property(instance, name, cache))
+					return InterpretResult::RuntimeError;
+				NEXT;
+			}
+			CASE(SetLocalPop):
+				slots[READ_BYTE()] = pop();
+				ip++;
+				NEXT;
+			CASE(PopLoop):
+			{
+				pop();
+				ip++;
+				auto offset = READ_SHORT();
+				ip -= offset;
+				if (options.jit)
+				{
+					tier_up(*frame->closure->function);
+					JIT_ENTER();
+				}
+				NEXT;
+			}
+			CASE(JumpIfFalsePop):
+			{
+				auto offset = READ_SHORT();
+				if (is_falsey(peek(0)))
+					ip += offset;
+				else
 				{
-					auto superclass = peek(1).as_obj<ObjClass>();
-					auto subclass = peek(0).as_obj<ObjClass>();
-					subclass->methods.insert(superclass->methods.begin(), superclass->methods.end());
 					pop();
-				} catch (const std::invalid_argument&)
+					ip++;
+				}
+				NEXT;
+			}
+			CASE(LessJumpIfFalsePop):
+			{
+				if (!peek(0).is_number() || !peek(1).is_number())
+					RUNTIME_ERROR("Operands must be numbers.");
+				auto b = pop().as<double>();
+				auto a = pop().as<double>();
+				ip++;
+				auto offset = READ_SHORT();
+				// the condition stays on the stack only where the jump is taken
+				if (a < b)
+					ip++;
+				else
 				{
-					runtime_error("Superclass must be a class.");
+					push(false);
+					ip += offset;
+				}
+				NEXT;
+			}
+			CASE(RegMove):
+			{
+				auto& a = READ_REGISTER();
+				a = READ_REGISTER();
+				NEXT;
+			}
+			CASE(RegConstant):
+			{
+				auto& a = READ_REGISTER();
+				a = READ_CONSTANT();
+				NEXT;
+			}
+			CASE(RegNil): READ_REGISTER() = Value(); NEXT;
+			CASE(RegTrue): READ_REGISTER() = true; NEXT;
+			CASE(RegFalse): READ_REGISTER() = false; NEXT;
+			CASE(RegGetGlobal):
+			{
+				auto& a = READ_REGISTER();
+				auto slot = static_cast<size_t>(READ_SHORT());
+				const auto& value = globals.values[slot];
+				if (value.is_undefined())
+					RUNTIME_ERROR("Undefined variable ", global_name(slot)->text());
+				a = value;
+				NEXT;
+			}
+			CASE(RegDefineGlobal):
+			{
+				auto& value = globals.values[READ_SHORT()];
+				value = READ_REGISTER();
+				NEXT;
+			}
+			CASE(RegSetGlobal):
+			{
+				auto slot = static_cast<size_t>(READ_SHORT());
+				auto& value = globals.values[slot];
+				if (value.is_undefined())
+					RUNTIME_ERROR("Undefined variable ", global_name(slot)->text());
+				value = READ_REGISTER();
+				NEXT;
+			}
+			CASE(RegGetUpvalue):
+			{
+				auto& a = READ_REGISTER();
+				a = *frame->closure->upvalues[READ_BYTE()]->location;
+				NEXT;
+			}
+			CASE(RegSetUpvalue):
+			{
+				auto upvalue = frame->closure->upvalues[READ_BYTE()];
+				*upvalue->location = READ_REGISTER();
+				NEXT;
+			}
+			CASE(RegEqual):
+			{
+				auto& a = READ_REGISTER();
+				const auto& b = READ_REGISTER();
+				a = b == READ_REGISTER();
+				NEXT;
+			}
+			CASE(RegGreater): REGISTER_OP(> ); NEXT;
+			CASE(RegLess): REGISTER_OP(< ); NEXT;
+			CASE(RegAdd):
+			{
+				auto& a = READ_REGISTER();
+				const auto& b = READ_REGISTER();
+				const auto& c = READ_REGISTER();
+				if (b.is_number() && c.is_number())
+					a = b.as<double>() + c.as<double>();
+				else if (b.is_obj_type<ObjString>() && c.is_obj_type<ObjString>())
+					a = create_obj_string((*b.as_obj<ObjString>()) + (*c.as_obj<ObjString>()), *this);
+				else
+					RUNTIME_ERROR("Operands must be two numbers or two strings.");
+				NEXT;
+			}
+			CASE(RegSubtract): REGISTER_OP(-); NEXT;
+			CASE(RegMultiply): REGISTER_OP(*); NEXT;
+			CASE(RegDivide): REGISTER_OP(/ ); NEXT;
+			CASE(RegNot):
+			{
+				auto& a = READ_REGISTER();
+				a = is_falsey(READ_REGISTER());
+				NEXT;
+			}
+			CASE(RegNegate):
+			{
+				auto& a = READ_REGISTER();
+				const auto& b = READ_REGISTER();
+				if (!b.is_number())
+					RUNTIME_ERROR("Operand must be a number.");
+				a = -b.as<double>();
+				NEXT;
+			}
+			CASE(RegPrint):
+				std::cout << "~$ " << READ_REGISTER() << '\n';
+				NEXT;
+			CASE(RegJump):
+			{
+				auto offset = READ_SHORT();
+				ip += offset;
+				NEXT;
+			}
+			CASE(RegJumpIfFalse):
+			{
+				const auto& condition = READ_REGISTER();
+				auto offset = READ_SHORT();
+				if (is_falsey(condition))
+					ip += offset;
+				NEXT;
+			}
+			CASE(RegLoop):
+			{
+				auto offset = READ_SHORT();
+				ip -= offset;
+				NEXT;
+			}
+			CASE(RegCall):
+			{
+				// the callee and its arguments are the top of the stack for the call
+				auto callee = slots + READ_BYTE();
+				auto arg_count = READ_BYTE();
+				frame->ip = ip;
+				stacktop = callee + arg_count + 1;
+				if (!call_value(*callee, arg_count))
 					return InterpretResult::RuntimeError;
+				LOAD_FRAME();
+				JIT_ENTER();
+				NEXT;
+			}
+			CASE(RegTailCall):
+			{
+				auto callee = slots + READ_BYTE();
+				auto arg_count = READ_BYTE();
+				drop_frame(callee, arg_count);
+				if (!call_value(peek(arg_count), arg_count))
+					return InterpretResult::RuntimeError;
+				LOAD_FRAME();
+				JIT_ENTER();
+				NEXT;
+			}
+			CASE(RegClosure):
+			{
+				auto& a = READ_REGISTER();
+				auto function = READ_CONSTANT().as_obj<ObjFunction>();
+				auto closure = create_obj<ObjClosure>(gc, function);
+				a = closure;
+				for (size_t i = 0; i < closure->upvalue_count(); i++)
+				{
+					auto is_local = READ_BYTE();
+					auto index = READ_BYTE();
+					if (is_local > 0)
+						closure->upvalues[i] = captured_upvalue(slots + index);
+					else
+						closure->upvalues[i] = frame->closure->upvalues[index];
 				}
-				break;
+				NEXT;
 			}
-			case OpCode::Method:
-				define_method(frame->read_string());
-				break;
+			CASE(RegCloseUpvalue):
+				close_upvalues(slots + READ_BYTE());
+				NEXT;
+			CASE(RegReturn):
+			{
+				auto result = READ_REGISTER();
+				close_upvalues(slots);
+				frame_count--;
+				stacktop = slots;
+				if (frame_count == 0)
+					return InterpretResult::Ok;
+				push(result);
+				LOAD_FRAME();
+				JIT_ENTER();
+				NEXT;
+			}
+
+#ifndef COMPUTED_GOTO
 			default:
 				break;
 		}
 	}
+#endif // !COMPUTED_GOTO
 
+#undef NEXT
+#undef CASE
+#undef DISPATCH
+#undef TRACE_INSTRUCTION
+#undef RUNTIME_ERROR
+#undef READ_CACHE
+#undef CAPTURE_UPVALUES
+#undef READ_STRING_LONG
+#undef READ_CONSTANT_LONG
+#undef READ_LONG
+#undef READ_STRING
+#undef READ_CONSTANT
+#undef READ_SHORT
+#undef READ_BYTE
+#undef LOAD_FRAME
+#undef JIT_ENTER
+#undef REGISTER_OP
+#undef READ_REGISTER
+#undef UNCHECKED_OP
+#undef NUMBER_OP
 #undef BINARY_OP
+#undef DEOPTIMIZE
+#undef QUICKEN
 }
 
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif // COMPUTED_GOTO
+
 ObjUpvalue* VM::captured_upvalue(Value* local)
 {
 	ObjUpvalue* prev_upvalue = nullptr;
@@ -373,6 +1054,15 @@ ObjUpvalue* VM::captured_upvalue(Value* local)
 	return created;
 }
 
+ObjClosure* VM::frame_closure(ObjFunction* function)
+{
+	if (function->upvalue_count > 0)
+		return create_obj<ObjClosure>(gc, function);
+	if (function->shared_closure == nullptr)
+		function->shared_closure = create_obj<ObjClosure>(gc, function);
+	return function->shared_closure;
+}
+
 void VM::close_upvalues(Value* last)
 {
 	while (open_upvalues != nullptr && open_upvalues->location >= last)
@@ -384,14 +1074,54 @@ void VM::close_upvalues(Value* last)
 	}
 }
 
+void VM::drop_frame(Value* callee, uint8_t arg_count)
+{
+	auto& frame = frames[frame_count - 1];
+	close_upvalues(frame.slots);
+	std::copy(callee, callee + arg_count + 1, frame.slots);
+	stacktop = frame.slots + arg_count + 1;
+	frame_count--;
+}
+
+// Moves the stack to storage of at least needed slots and points the frames
+// and open upvalues there. The stack is not allocated through the GC, so no
+// collection can see it half moved.
+void VM::grow_stack(size_t needed)
+{
+	auto size = stack.size();
+	while (size < needed)
+		size *= 2;
+	std::vector<Value> grown(size);
+	std::copy(stack.begin(), stack.end(), grown.begin());
+
+	auto relocate = [this, &grown](Value* slot) { return grown.data() + (slot - stack.data()); };
+	for (size_t i = 0; i < frame_count; i++)
+	{
+		frames[i].slots = relocate(frames[i].slots);
+		if (frames[i].top != nullptr)
+			frames[i].top = relocate(frames[i].top);
+	}
+	for (auto upvalue = open_upvalues; upvalue != nullptr; upvalue = upvalue->next)
+		upvalue->location = relocate(upvalue->location);
+	stacktop = relocate(stacktop);
+	stack.swap(grown);
+}
+
 void VM::define_method(ObjString* name)
 {
 	auto method = peek(0);
 	auto klass = peek(1).as_obj<ObjClass>();
-	klass->methods.insert_or_assign(name, method);
+	klass->methods.set(name, method);
 	pop();
 }
 
+void VM::tier_up(ObjFunction& function)
+{
+	// native code works on the stack layout, not on registers
+	if (function.register_chunk == nullptr && ++function.hotness == options.jit_threshold)
+		function.jit_code = jit_compile(function);
+}
+
 bool VM::call(const ObjClosure* closure, uint8_t arg_count)
 {
 	if (arg_count != closure->function->arity)
@@ -400,15 +1130,39 @@ bool VM::call(const ObjClosure* closure, uint8_t arg_count)
 			static_cast<unsigned>(arg_count));
 		return false;
 	}
-	if (frame_count == FRAME_MAX)
+	if (frame_count >= options.max_frames)
 	{
 		runtime_error("Stack overflow");
 		return false;
 	}
-	auto& frame = frames.at(frame_count++);
+	if (!closure->function->lazy_source.empty() && !cu.compile_lazy(*closure->function))
+	{
+		runtime_error("Could not compile ", closure->function->name->text(), "().");
+		return false;
+	}
+	if (frame_count == frames.size())
+		frames.resize(std::min(frames.size() * 2, options.max_frames));
+	auto base = static_cast<size_t>(stacktop - stack.data()) - arg_count - 1;
+	auto needed = base + closure->function->max_depth + FRAME_HEADROOM;
+	if (needed > stack.size())
+		grow_stack(needed);
+	if (options.jit)
+		tier_up(*closure->function);
+	auto& frame = frames[frame_count++];
 	frame.closure = closure;
-	frame.ip = 0;
-	frame.slots = stacktop - arg_count - 1;
+	frame.slots = stack.data() + base;
+	auto registers = closure->function->register_chunk.get();
+	if (registers == nullptr)
+	{
+		frame.ip = closure->function->chunk.code.data();
+		frame.top = nullptr;
+		return true;
+	}
+	// temporaries start out nil, stale values must not be taken for roots
+	frame.ip = registers->code.data();
+	frame.top = frame.slots + registers->frame_size;
+	std::fill(stacktop, frame.top, Value());
+	stacktop = frame.top;
 	return true;
 }
 
@@ -428,17 +1182,13 @@ bool VM::call_value(const Value& callee, uint8_t arg_count)
 			{
 				auto klass = callee.as_obj<ObjClass>();
 				stacktop[-arg_count - 1] = create_obj<ObjInstance>(gc, klass);
-				try
+				auto initializer = klass->methods.find(init_string);
+				if (initializer != nullptr)
+					return call(initializer->as_obj<ObjClosure>(), arg_count);
+				if (arg_count != 0)
 				{
-					auto& initializer = klass->methods.at(init_string);
-					return call(initializer.as_obj<ObjClosure>(), arg_count);
-				} catch (const std::out_of_range&)
-				{
-					if (arg_count != 0)
-					{
-						runtime_error("Expected 0 arguments but got ", arg_count, " .");
-						return false;
-					}
+					runtime_error("Expected 0 arguments but got ", arg_count, " .");
+					return false;
 				}
 				return true;
 			}
@@ -460,24 +1210,97 @@ bool VM::call_value(const Value& callee, uint8_t arg_count)
 	return false;
 }
 
-bool VM::bind_method(const ObjClass* klass, ObjString* name)
+std::optional<InlineCacheEntry> VM::resolve_property(const ObjInstance* instance,
+	ObjString* name)const
 {
-	try
+	auto shape = instance->shape;
+	auto slot = shape->slot_of(name);
+	if (slot.has_value())
+		return InlineCacheEntry{ shape, shape, slot.value(), nullptr };
+
+	auto method = find_method(instance->klass, name);
+	if (method != nullptr)
+		return InlineCacheEntry{ shape, shape, 0, method };
+	return std::nullopt;
+}
+
+ObjClosure* VM::find_method(const ObjClass* klass, ObjString* name)const
+{
+	auto found = klass->methods.find(name);
+	if (found == nullptr)
+		return nullptr;
+	return found->as_obj<ObjClosure>();
+}
+
+bool VM::get_property(ObjInstance* instance, ObjString* name, InlineCache& cache)
+{
+	auto entry = cache.lookup(instance->shape);
+	std::optional<InlineCacheEntry> resolved;
+	if (entry == nullptr)
 	{
-		auto method = klass->methods.at(name);
-		auto bound = create_obj<ObjBoundMethod>(gc, peek(0), method.as_obj<ObjClosure>());
+		resolved = resolve_property(instance, name);
+		if (!resolved.has_value())
+		{
+			runtime_error("Undefined property ", *name, " .");
+			return false;
+		}
+		cache.update(resolved.value());
+		entry = &resolved.value();
+	}
+
+	if (entry->method == nullptr)
+	{
+		auto value = instance->fields[entry->slot];
 		pop();
-		push(bound);
+		push(value);
 		return true;
-	} catch (const std::out_of_range&)
+	}
+	auto bound = create_obj<ObjBoundMethod>(gc, peek(0), entry->method);
+	pop();
+	push(bound);
+	return true;
+}
+
+void VM::set_property(ObjInstance* instance, ObjString* name, InlineCache& cache)
+{
+	auto entry = cache.lookup(instance->shape);
+	std::optional<InlineCacheEntry> resolved;
+	if (entry == nullptr)
+	{
+		auto shape = instance->shape;
+		auto slot = shape->slot_of(name);
+		if (slot.has_value())
+			resolved = InlineCacheEntry{ shape, shape, slot.value(), nullptr };
+		else
+			resolved = InlineCacheEntry{ shape, shape->add(name), shape->field_count(), nullptr };
+		cache.update(resolved.value());
+		entry = &resolved.value();
+	}
+
+	if (entry->transition == instance->shape)
+		instance->fields[entry->slot] = peek(0);
+	else
+	{
+		instance->fields.push_back(peek(0));
+		instance->shape = entry->transition;
+	}
+}
+
+bool VM::bind_method(const ObjClass* klass, ObjString* name)
+{
+	auto method = find_method(klass, name);
+	if (method == nullptr)
 	{
 		runtime_error("Undefined property ", *name, " .");
 		return false;
 	}
-	return false;
+	auto bound = create_obj<ObjBoundMethod>(gc, peek(0), method);
+	pop();
+	push(bound);
+	return true;
 }
 
-bool VM::invoke(ObjString* const name, uint8_t arg_count)
+bool VM::invoke(ObjString* const name, uint8_t arg_count, InlineCache& cache)
 {
 	auto& receiver = peek(arg_count);
 	if (!receiver.is_obj_type<ObjInstance>())
@@ -487,38 +1310,77 @@ bool VM::invoke(ObjString* const name, uint8_t arg_count)
 	}
 	auto instance = receiver.as_obj<ObjInstance>();
 
-	try
+	auto entry = cache.lookup(instance->shape);
+	std::optional<InlineCacheEntry> resolved;
+	if (entry == nullptr)
+	{
+		resolved = resolve_property(instance, name);
+		if (!resolved.has_value())
+		{
+			runtime_error("Undefined property '", *name, "'.");
+			return false;
+		}
+		cache.update(resolved.value());
+		entry = &resolved.value();
+	}
+
+	if (entry->method == nullptr)
 	{
-		auto& value = instance->fields.at(name);
+		auto value = instance->fields[entry->slot];
 		stacktop[-arg_count - 1] = value;
 		return call_value(value, arg_count);
-	} catch (const std::out_of_range&) {}
-
-	return invoke_from_class(instance->klass, name, arg_count);
+	}
+	return call(entry->method, arg_count);
 }
 
 bool VM::invoke_from_class(const ObjClass* klass, ObjString* name, uint8_t arg_count)
 {
-	try
-	{
-		auto& method = klass->methods.at(name);
-		return call(method.as_obj<ObjClosure>(), arg_count);
-	} catch (const std::out_of_range&)
+	auto method = find_method(klass, name);
+	if (method == nullptr)
 	{
 		runtime_error("Undefined property '", *name, "'.");
 		return false;
 	}
+	return call(method, arg_count);
 }
 
 void VM::define_native(std::string_view name, NativeFn function)
 {
 	push(create_obj_string(name, *this));
 	push(create_obj<ObjNative>(gc, function));
-	globals.insert_or_assign(stack.at(0).as_obj<ObjString>(), stack.at(1));
+	auto slot = global_slot(stack.at(0).as_obj<ObjString>());
+	globals.values[slot] = stack.at(1);
 	pop();
 	pop();
 }
 
+size_t VM::global_slot(ObjString* name)
+{
+	auto found = global_slots.find(name);
+	if (found != nullptr)
+		return static_cast<size_t>(found->as<double>());
+
+	// growing either table may collect
+	push(name);
+	auto slot = globals.count();
+	globals.write(Value::undefined());
+	global_slots.set(name, static_cast<double>(slot));
+	pop();
+	return slot;
+}
+
+ObjString* VM::global_name(size_t slot)const
+{
+	// only reached when reporting an error, so a scan is fine
+	ObjString* res = nullptr;
+	global_slots.for_each([&res, slot](ObjString* key, const Value& value)
+		{
+			if (static_cast<size_t>(value.as<double>()) == slot)
+				res = key;
+		});
+	return res;
+}
+
 const Value& VM::peek(size_t distance) const
 {
 	return stacktop[-1 - distance];
@@ -542,34 +1404,45 @@ void VM::reset_stack() noexcept
 	frame_count = 0;
 }
 
-const Chunk& CallFrame::chunk() const noexcept
+void VM::print_trace() const
 {
-	return closure->function->chunk;
-}
-
-uint8_t CallFrame::read_byte()
-{
-	auto code = chunk().code.at(ip);
-	ip++;
-	return code;
-}
-
-Value CallFrame::read_constant()
-{
-	return chunk().constants.values.at(read_byte());
+	for (size_t i = frame_count; i-- > 0;)
+	{
+		// a stack overflow would print every one of max_frames frames
+		if (frame_count > 2 * TRACE_FRAMES && i == frame_count - TRACE_FRAMES - 1)
+		{
+			std::cerr << "... " << frame_count - 2 * TRACE_FRAMES << " frames omitted\n";
+			i = TRACE_FRAMES;
+			continue;
+		}
+		const auto& frame = frames[i];
+		auto function = frame.closure->function;
+		auto line = frame.line();
+		if (line == 0)
+			std::cerr << "[line ?] in ";
+		else
+			std::cerr << "[line " << line << "] in ";
+		if (function->name == nullptr)
+			std::cerr << "script\n";
+		else
+			std::cerr << function->name->text() << "()\n";
+	}
 }
 
-uint16_t CallFrame::read_short()
+const Chunk& CallFrame::chunk() const noexcept
 {
-	ip += 2;
-	auto a = chunk().code.at(ip - 2) << 8;
-	auto b = chunk().code.at(ip - 1);
-	return static_cast<uint16_t>(a | b);
+	return closure->function->chunk;
 }
 
-ObjString* CallFrame::read_string()
+size_t CallFrame::line() const
 {
-	return read_constant().as_obj<ObjString>();
+	auto function = closure->function;
+	if (top != nullptr)
+	{
+		const auto& registers = *function->register_chunk;
+		return registers.lines.line_at(static_cast<size_t>(ip - registers.code.data()) - 1);
+	}
+	return function->chunk.lines.line_at(static_cast<size_t>(ip - function->chunk.code.data()) - 1);
 }
 
 } //Clox
\ No newline at end of file
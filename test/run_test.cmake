@@ -0,0 +1,101 @@
+# Runs one script through clox and checks it against the expectations in its
+# comments, for CTest (see CMakeLists.txt):
+#
+#   // expect: <value>                  a line print writes, without its "~$ " prompt
+#   // expect runtime error: <message>  the message it stops with, exit code 70
+#   // expect trace: <frame>            each line of the stack trace after it, in order
+#   // expect compile error: <report>   a line the compiler reports, exit code 65
+#
+# cmake -DCLOX=<clox> -DSCRIPT=<script.lox> [-DARGS=<flag;...>] [-DCACHE=ON] -P run_test.cmake
+#
+# With CACHE the script is copied to cache/ under the working directory and
+# run twice, compiling it and writing its .loxc, then loading that.
+
+if(NOT CLOX OR NOT SCRIPT)
+	message(FATAL_ERROR "Usage: cmake -DCLOX=<clox> -DSCRIPT=<script> [-DARGS=<flags>] -P run_test.cmake")
+endif()
+
+# list elements are separated by semicolons, which Lox is full of, so they are
+# kept out of the lists until each expectation is used
+set(SEMICOLON "<semicolon>")
+file(READ "${SCRIPT}" source)
+string(REPLACE "\r" "" source "${source}")
+string(REPLACE ";" "${SEMICOLON}" source "${source}")
+
+set(expected_output "")
+set(expected_code 0)
+set(expected_errors "")
+set(runtime_error "")
+set(expected_trace "")
+string(REGEX MATCHALL "// expect[^\n]*" expectations "${source}")
+foreach(expectation IN LISTS expectations)
+	if(expectation MATCHES "^// expect: (.*)$")
+		string(REPLACE "${SEMICOLON}" ";" value "${CMAKE_MATCH_1}")
+		string(APPEND expected_output "~$ ${value}\n")
+	elseif(expectation MATCHES "^// expect runtime error: (.*)$")
+		string(REPLACE "${SEMICOLON}" ";" runtime_error "${CMAKE_MATCH_1}")
+		set(expected_code 70)
+	elseif(expectation MATCHES "^// expect trace: (.*)$")
+		string(REPLACE "${SEMICOLON}" ";" frame "${CMAKE_MATCH_1}")
+		string(APPEND expected_trace "${frame}\n")
+	elseif(expectation MATCHES "^// expect compile error: (.*)$")
+		list(APPEND expected_errors "${CMAKE_MATCH_1}")
+		set(expected_code 65)
+	endif()
+endforeach()
+
+set(runs 1)
+if(CACHE)
+	get_filename_component(name "${SCRIPT}" NAME_WE)
+	set(copy "${CMAKE_CURRENT_BINARY_DIR}/cache/${name}.lox")
+	set(cache_file "${CMAKE_CURRENT_BINARY_DIR}/cache/${name}.loxc")
+	file(REMOVE "${cache_file}")
+	configure_file("${SCRIPT}" "${copy}" COPYONLY)
+	set(SCRIPT "${copy}")
+	set(runs 2)
+endif()
+
+set(failures "")
+foreach(run RANGE 1 ${runs})
+	execute_process(
+		COMMAND "${CLOX}" ${ARGS} "${SCRIPT}"
+		RESULT_VARIABLE code
+		OUTPUT_VARIABLE output
+		ERROR_VARIABLE errors)
+	string(REPLACE "\r" "" output "${output}")
+	string(REPLACE "\r" "" errors "${errors}")
+
+	if(NOT code STREQUAL expected_code)
+		string(APPEND failures "run ${run}: exit code ${code}, expected ${expected_code}\n")
+	endif()
+	if(NOT output STREQUAL expected_output)
+		string(APPEND failures "run ${run}: output:\n${output}expected:\n${expected_output}")
+	endif()
+	if(runtime_error)
+		# without trace expectations only the message is checked, the frames
+		# differ with how calls were inlined
+		string(FIND "${errors}" "${runtime_error}\n" at)
+		if(NOT at EQUAL 0)
+			string(APPEND failures "run ${run}: errors:\n${errors}expected to start with:\n${runtime_error}\n")
+		elseif(expected_trace AND NOT errors STREQUAL "${runtime_error}\n${expected_trace}")
+			string(APPEND failures "run ${run}: errors:\n${errors}expected:\n${runtime_error}\n${expected_trace}")
+		endif()
+	elseif(expected_errors)
+		foreach(report IN LISTS expected_errors)
+			string(REPLACE "${SEMICOLON}" ";" report "${report}")
+			string(FIND "${errors}" "${report}\n" at)
+			if(at EQUAL -1)
+				string(APPEND failures "run ${run}: errors:\n${errors}expected to report:\n${report}\n")
+			endif()
+		endforeach()
+	elseif(NOT errors STREQUAL "")
+		string(APPEND failures "run ${run}: errors:\n${errors}")
+	endif()
+	if(CACHE AND run EQUAL 1 AND NOT expected_code EQUAL 65 AND NOT EXISTS "${cache_file}")
+		string(APPEND failures "run 1: wrote no ${cache_file}\n")
+	endif()
+endforeach()
+
+if(failures)
+	message(FATAL_ERROR "${SCRIPT} ${ARGS}\n${failures}")
+endif()